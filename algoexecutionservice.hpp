@@ -23,6 +23,7 @@ private:
     void AggressTopOfBook(const OrderBook<Bond>& orderBook, const string& productId);
 
     unordered_map<string, ExecutionOrder<Bond>> algoExecutionMap;
+    unordered_map<string, uint64_t> orderSequences;
     vector<ServiceListener<ExecutionOrder<Bond>>*> listeners;
     
     bool lastAggressBid;
@@ -111,7 +112,8 @@ inline void BondAlgoExecutionService::AggressTopOfBook(const OrderBook<Bond>& or
         quantity = offerStack.front().GetQuantity();
     }
 
-    string orderId = productId; // + "_A_"; + to_string(orderCounter++);
+    // Every order gets its own id, so each fill books as a new trade
+    string orderId = productId + "_A_" + to_string(++orderSequences[productId]);
     double hiddenQuantity = 0L;
     string parentOrderId = "";
     PricingSide side = (aggressSide == BID) ? BID : OFFER;
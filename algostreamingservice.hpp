@@ -26,6 +26,97 @@ public:
 
 };
 
+/**
+ * One rung of a tiered price stream: the size quoted at this tier and how wide
+ * its bid/offer spread is relative to the inside spread from the pricing service.
+ */
+struct StreamTier
+{
+    long visibleQuantity;
+    long hiddenQuantity;
+    double spreadMultiplier;
+};
+
+/**
+ * Computes bid/offer ladders for a batch of instruments in one pass.
+ * Inputs are struct-of-arrays mids and spreads. Outputs are stored tier-major
+ * (bids[tier * count + i]) so the inner loop runs over contiguous instruments
+ * and vectorizes without gathers.
+ */
+class TieredStreamGenerator
+{
+private:
+    vector<StreamTier> tiers;
+    vector<double> bids;
+    vector<double> offers;
+    size_t count;
+
+public:
+    explicit TieredStreamGenerator(const vector<StreamTier>& _tiers);
+
+    // The default 1/5/10/25MM ladder, each tier wider than the last
+    static vector<StreamTier> DefaultTiers();
+
+    const vector<StreamTier>& GetTiers() const { return tiers; }
+
+    // Compute every tier's bid and offer for n instruments
+    void Compute(const double* mids, const double* spreads, size_t n);
+
+    double GetBid(size_t tier, size_t i) const { return bids[tier * count + i]; }
+    double GetOffer(size_t tier, size_t i) const { return offers[tier * count + i]; }
+
+    // Build the ladder for instrument i of the last Compute call
+    PriceStreamLadder<Bond> BuildLadder(const Bond& product, size_t i) const;
+};
+
+TieredStreamGenerator::TieredStreamGenerator(const vector<StreamTier>& _tiers) : tiers(_tiers), count(0)
+{
+    if (tiers.empty()) {
+        throw invalid_argument("TieredStreamGenerator needs at least one tier");
+    }
+}
+
+vector<StreamTier> TieredStreamGenerator::DefaultTiers()
+{
+    return {
+        {1000000, 2000000, 1.0},
+        {5000000, 10000000, 1.5},
+        {10000000, 20000000, 2.0},
+        {25000000, 50000000, 3.0}
+    };
+}
+
+void TieredStreamGenerator::Compute(const double* mids, const double* spreads, size_t n)
+{
+    count = n;
+    bids.resize(tiers.size() * n);
+    offers.resize(tiers.size() * n);
+
+    for (size_t t = 0; t < tiers.size(); ++t) {
+        const double halfWidth = tiers[t].spreadMultiplier * 0.5;
+        double* __restrict bidOut = bids.data() + t * n;
+        double* __restrict offerOut = offers.data() + t * n;
+        for (size_t i = 0; i < n; ++i) {
+            double half = spreads[i] * halfWidth;
+            bidOut[i] = mids[i] - half;
+            offerOut[i] = mids[i] + half;
+        }
+    }
+}
+
+PriceStreamLadder<Bond> TieredStreamGenerator::BuildLadder(const Bond& product, size_t i) const
+{
+    vector<PriceStreamOrder> bidOrders;
+    vector<PriceStreamOrder> offerOrders;
+    bidOrders.reserve(tiers.size());
+    offerOrders.reserve(tiers.size());
+    for (size_t t = 0; t < tiers.size(); ++t) {
+        bidOrders.emplace_back(GetBid(t, i), tiers[t].visibleQuantity, tiers[t].hiddenQuantity, BID);
+        offerOrders.emplace_back(GetOffer(t, i), tiers[t].visibleQuantity, tiers[t].hiddenQuantity, OFFER);
+    }
+    return PriceStreamLadder<Bond>(product, bidOrders, offerOrders);
+}
+
 class BondAlgoStreamingService : public ServiceListener<Price<Bond>>
 {
 private: 
@@ -38,8 +129,18 @@ private:
     vector<ServiceListener<PriceStream<Bond>>*> listeners;
     unordered_map<string, SizeTracker> sizeTrackers;
 
+    // Tiered mode is enabled by SetTiers; without it we keep the 1MM/2MM toggle
+    TieredStreamGenerator* tieredGenerator;
+    unordered_map<string, PriceStreamLadder<Bond>> ladderMap;
+    vector<double> batchMids;
+    vector<double> batchSpreads;
+
+    void PublishLadder(const Bond& product, size_t i);
+
 public: 
-    
+    BondAlgoStreamingService() : tieredGenerator(nullptr) {}
+    ~BondAlgoStreamingService();
+
     AlgoStream& GetData(string productId) ;
     void OnMessage(AlgoStream& data) ;
     void AddListener(ServiceListener<PriceStream<Bond>>* listener);
@@ -48,12 +149,26 @@ public:
     const vector<ServiceListener<PriceStream<Bond>>*>& GetListeners();
     void ProcessPrice(Price<Bond>& price);
 
+    // Switch to tiered ladders, one PriceStreamLadder per product per refresh
+    void SetTiers(const vector<StreamTier>& tiers);
+
+    // Get the last ladder published for a product (tiered mode only)
+    const PriceStreamLadder<Bond>& GetLadder(const string& productId) const;
+
+    // Refresh ladders for a batch of prices in one pass over the generator
+    void ProcessPrices(const vector<Price<Bond>>& prices);
+
     void ProcessAdd(Price<Bond>& price) override;
     void ProcessRemove(Price<Bond>& price) override;
     void ProcessUpdate(Price<Bond>& price) override;
 
 };
 
+BondAlgoStreamingService::~BondAlgoStreamingService()
+{
+    delete tieredGenerator;
+}
+
 void BondAlgoStreamingService::ProcessAdd(Price<Bond>& price) 
 {
     ProcessPrice(price);
@@ -93,8 +208,88 @@ const vector<ServiceListener<PriceStream<Bond>>*>& BondAlgoStreamingService::Get
     return listeners;
 }
 
+void BondAlgoStreamingService::SetTiers(const vector<StreamTier>& tiers)
+{
+    TieredStreamGenerator* generator = new TieredStreamGenerator(tiers);
+    delete tieredGenerator;
+    tieredGenerator = generator;
+}
+
+const PriceStreamLadder<Bond>& BondAlgoStreamingService::GetLadder(const string& productId) const
+{
+    auto it = ladderMap.find(productId);
+    if (it != ladderMap.end()) {
+        return it->second;
+    }
+    throw runtime_error("Ladder key not found: " + productId);
+}
+
+void BondAlgoStreamingService::ProcessPrices(const vector<Price<Bond>>& prices)
+{
+    if (!tieredGenerator) {
+        for (const auto& price : prices) {
+            Price<Bond> p = price;
+            ProcessPrice(p);
+        }
+        return;
+    }
+
+    size_t n = prices.size();
+    batchMids.resize(n);
+    batchSpreads.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        batchMids[i] = prices[i].GetMid();
+        batchSpreads[i] = prices[i].GetBidOfferSpread();
+    }
+
+    tieredGenerator->Compute(batchMids.data(), batchSpreads.data(), n);
+    for (size_t i = 0; i < n; ++i) {
+        PublishLadder(prices[i].GetProduct(), i);
+    }
+}
+
+void BondAlgoStreamingService::PublishLadder(const Bond& product, size_t i)
+{
+    const string& productId = product.GetProductId();
+    PriceStreamLadder<Bond> ladder = tieredGenerator->BuildLadder(product, i);
+
+    auto it = ladderMap.find(productId);
+    bool isNew = (it == ladderMap.end());
+    if (isNew) {
+        it = ladderMap.emplace(productId, move(ladder)).first;
+    }
+    else {
+        it->second = move(ladder);
+    }
+    AlgoStream algoStream(product, it->second.GetBidOrder(), it->second.GetOfferOrder());
+    auto streamIt = algoStreamMap.find(productId);
+    if (streamIt == algoStreamMap.end()) {
+        algoStreamMap.emplace(productId, algoStream);
+    }
+    else {
+        streamIt->second = move(algoStream);
+    }
+
+    for (auto listener : listeners) {
+        if (isNew) {
+            listener->ProcessAdd(it->second);
+        }
+        else {
+            listener->ProcessUpdate(it->second);
+        }
+    }
+}
+
 void BondAlgoStreamingService::ProcessPrice(Price<Bond>& price) 
 {
+    if (tieredGenerator) {
+        double mid = price.GetMid();
+        double spread = price.GetBidOfferSpread();
+        tieredGenerator->Compute(&mid, &spread, 1);
+        PublishLadder(price.GetProduct(), 0);
+        return;
+    }
+
     string productId = price.GetProduct().GetProductId();
     bool isNew = (algoStreamMap.find(productId) == algoStreamMap.end());
     if (isNew) {
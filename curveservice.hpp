@@ -0,0 +1,414 @@
+/**
+ * curveservice.hpp
+ * Nelson-Siegel-Svensson yield curve fitted to the live mids of the on-the-run
+ * tenors.
+ */
+#ifndef CURVE_SERVICE_HPP
+#define CURVE_SERVICE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "soa.hpp"
+#include "products.hpp"
+#include "pricingservice.hpp"
+#include "snapshot.hpp"
+
+using namespace std;
+
+/**
+ * Fitted Nelson-Siegel-Svensson curve. The yield to maturity at t years is
+ *   beta0 + beta1 * f(t / tau1) + beta2 * g(t / tau1) + beta3 * g(t / tau2)
+ * with f(x) = (1 - e^-x) / x and g(x) = f(x) - e^-x. The version counts the
+ * fits published; a version of 0 means no curve has been fitted yet.
+ */
+struct YieldCurve
+{
+  double beta0;
+  double beta1;
+  double beta2;
+  double beta3;
+  double tau1;
+  double tau2;
+  double rmsError;
+  uint64_t version;
+
+  // Fitted yield at a time in years
+  double GetYield(double years) const;
+};
+
+inline double YieldCurve::GetYield(double years) const
+{
+  years = max(years, 1e-6);
+  double x1 = years / tau1;
+  double x2 = years / tau2;
+  double e1 = exp(-x1);
+  double e2 = exp(-x2);
+  double f1 = (1.0 - e1) / x1;
+  double f2 = (1.0 - e2) / x2;
+  return beta0 + beta1 * f1 + beta2 * (f1 - e1) + beta3 * (f2 - e2);
+}
+
+/**
+ * Curve service listening to the pricing service. Every tick on one of the
+ * curve's tenors solves that bond's yield from its mid and refits the curve
+ * once every tenor has a yield; ticks on other products are ignored.
+ *
+ * The fit is Levenberg-Marquardt on the six parameters, with the decay factors
+ * fitted as log(tau) so they stay positive. Each refit starts from the last fit
+ * and its damping, so a tick that moves the curve a little converges in a few
+ * iterations; noisier ticks take more, since seven tenors barely pin down six
+ * parameters. The fits reuse scratch buffers sized in the ctor, so a tick does
+ * not allocate. The fitted curve is published through a SeqLock; pricing, risk and
+ * quoting on any thread read a consistent copy with GetCurve, without locks.
+ *
+ * Prices are quoted per 100 of face.
+ */
+class BondCurveService : public ServiceListener<Price<Bond>>
+{
+
+public:
+
+  static constexpr int PARAMETERS = 6;
+
+  // ctor for a curve over the given tenor bonds
+  explicit BondCurveService(const vector<Bond> &_tenors);
+
+  // Latest fitted curve (any thread)
+  YieldCurve GetCurve() const;
+
+  // Yield off the latest curve at a time in years, and a bond's price per 100
+  // discounted at the curve's yield for its maturity (any thread)
+  double GetYield(double years) const;
+  double GetFairPrice(const Bond &bond) const;
+
+  // Number of Levenberg-Marquardt iterations in the last fit
+  int GetLastIterations() const;
+
+  // Fit to the latest tenor yields now; false, leaving the last curve, if a
+  // tenor has no yield yet or the yields admit no finite fit
+  bool Refit();
+
+  // Ticks on a tenor refit the curve
+  void ProcessAdd(Price<Bond> &data) override;
+  void ProcessRemove(Price<Bond> &data) override;
+  void ProcessUpdate(Price<Bond> &data) override;
+
+private:
+  static constexpr int PAYMENTS = 2;
+  static constexpr int MAX_ITERATIONS = 100;
+  static constexpr double MIN_LOG_TAU = -3.0;
+  static constexpr double MAX_LOG_TAU = 4.0;
+
+  // Stop once a step improves the squared error per tenor by less than this,
+  // i.e. moves the fit by well under a hundredth of a basis point
+  static constexpr double COST_TOLERANCE = 1e-16;
+
+  static double YearsToMaturity(const Bond &bond);
+  static YieldCurve ToCurve(const double *parameters);
+  double Residuals(const double *parameters, double *residuals, double *jacobian) const;
+  static bool Solve(double *matrix, double *vector, int n);
+  bool ColdStart();
+
+  vector<Bond> tenors;
+  unordered_map<string, size_t> tenorIds;
+  vector<double> maturities;
+  vector<double> yields;
+  vector<bool> priced;
+  size_t pricedCount;
+
+  // Scratch for the fits, sized once so a tick allocates nothing: residuals at
+  // the current and trial parameters, and the Jacobian, row per tenor
+  vector<double> residuals;
+  vector<double> trialResiduals;
+  vector<double> jacobian;
+
+  // Parameters beta0..beta3, log tau1, log tau2 of the last fit, and its damping
+  double parameters[PARAMETERS];
+  double damping;
+  bool fitted;
+  int lastIterations;
+  uint64_t fitCount;
+
+  SeqLock<YieldCurve> curve;
+
+};
+
+BondCurveService::BondCurveService(const vector<Bond> &_tenors) :
+  tenors(_tenors), maturities(_tenors.size(), 0.0), yields(_tenors.size(), 0.0), priced(_tenors.size(), false),
+  pricedCount(0), residuals(_tenors.size()), trialResiduals(_tenors.size()), jacobian(_tenors.size() * PARAMETERS), parameters{}, damping(1e-3), fitted(false), lastIterations(0), fitCount(0)
+{
+  if (tenors.size() < PARAMETERS) {
+    throw invalid_argument("A Nelson-Siegel-Svensson fit needs at least six tenors");
+  }
+  for (size_t i = 0; i < tenors.size(); ++i) {
+    tenorIds.emplace(tenors[i].GetProductId(), i);
+  }
+  curve.Store(YieldCurve{0.0, 0.0, 0.0, 0.0, 1.0, 1.0, 0.0, 0});
+}
+
+inline YieldCurve BondCurveService::GetCurve() const
+{
+  return curve.Load();
+}
+
+inline double BondCurveService::GetYield(double years) const
+{
+  return curve.Load().GetYield(years);
+}
+
+double BondCurveService::GetFairPrice(const Bond &bond) const
+{
+  double yield = GetYield(YearsToMaturity(bond));
+  return bond.ComputeBondPrice(yield, PAYMENTS) * 100.0 / bond.GetFaceValue();
+}
+
+inline int BondCurveService::GetLastIterations() const
+{
+  return lastIterations;
+}
+
+inline double BondCurveService::YearsToMaturity(const Bond &bond)
+{
+  long days = static_cast<long>(bond.GetMaturityDate().day_number()) - static_cast<long>(BusinessDate::GetDayNumber());
+  return static_cast<double>(days) / 365.0;
+}
+
+inline YieldCurve BondCurveService::ToCurve(const double *p)
+{
+  return YieldCurve{p[0], p[1], p[2], p[3], exp(p[4]), exp(p[5]), 0.0, 0};
+}
+
+double BondCurveService::Residuals(const double *p, double *residuals, double *jacobian) const
+{
+  // Residuals model - market, and their derivatives by parameter, row per tenor
+  double tau1 = exp(p[4]);
+  double tau2 = exp(p[5]);
+  double sumSquares = 0.0;
+  for (size_t i = 0; i < maturities.size(); ++i) {
+    double t = maturities[i];
+    double x1 = t / tau1;
+    double x2 = t / tau2;
+    double e1 = exp(-x1);
+    double e2 = exp(-x2);
+    double f1 = (1.0 - e1) / x1;
+    double f2 = (1.0 - e2) / x2;
+    double g1 = f1 - e1;
+    double g2 = f2 - e2;
+    double residual = p[0] + p[1] * f1 + p[2] * g1 + p[3] * g2 - yields[i];
+    residuals[i] = residual;
+    sumSquares += residual * residual;
+
+    if (jacobian) {
+      // d/dx of f is (e^-x (1 + x) - 1) / x^2, of g that plus e^-x; dx/dlog(tau) = -x
+      double df1 = (e1 * (1.0 + x1) - 1.0) / (x1 * x1);
+      double df2 = (e2 * (1.0 + x2) - 1.0) / (x2 * x2);
+      double *row = jacobian + i * PARAMETERS;
+      row[0] = 1.0;
+      row[1] = f1;
+      row[2] = g1;
+      row[3] = g2;
+      row[4] = -x1 * (p[1] * df1 + p[2] * (df1 + e1));
+      row[5] = -x2 * p[3] * (df2 + e2);
+    }
+  }
+  return sumSquares;
+}
+
+bool BondCurveService::Solve(double *a, double *b, int n)
+{
+  // Gaussian elimination with partial pivoting on an n x n system
+  for (int col = 0; col < n; ++col) {
+    int pivot = col;
+    for (int row = col + 1; row < n; ++row) {
+      if (fabs(a[row * n + col]) > fabs(a[pivot * n + col])) {
+        pivot = row;
+      }
+    }
+    if (fabs(a[pivot * n + col]) < 1e-300) {
+      return false;
+    }
+    if (pivot != col) {
+      for (int k = 0; k < n; ++k) {
+        swap(a[col * n + k], a[pivot * n + k]);
+      }
+      swap(b[col], b[pivot]);
+    }
+    for (int row = col + 1; row < n; ++row) {
+      double factor = a[row * n + col] / a[col * n + col];
+      for (int k = col; k < n; ++k) {
+        a[row * n + k] -= factor * a[col * n + k];
+      }
+      b[row] -= factor * b[col];
+    }
+  }
+  for (int row = n - 1; row >= 0; --row) {
+    double sum = b[row];
+    for (int k = row + 1; k < n; ++k) {
+      sum -= a[row * n + k] * b[k];
+    }
+    b[row] = sum / a[row * n + row];
+  }
+  return true;
+}
+
+bool BondCurveService::ColdStart()
+{
+  // With the decay factors fixed the betas are linear least squares, so try a
+  // grid of decay factors and start from the best; this keeps the first fit
+  // away from the tau1 = tau2 ridge where the two humps cannot be told apart
+  static const double SHORT_TAUS[] = {0.5, 1.0, 2.0, 3.0, 5.0};
+  static const double LONG_TAUS[] = {4.0, 7.0, 10.0, 15.0, 25.0};
+  const int betas = 4;
+  double bestCost = HUGE_VAL;
+  for (double tau1 : SHORT_TAUS) {
+    for (double tau2 : LONG_TAUS) {
+      if (tau2 <= tau1) {
+        continue;
+      }
+      double candidate[PARAMETERS] = {0.0, 0.0, 0.0, 0.0, log(tau1), log(tau2)};
+      Residuals(candidate, residuals.data(), jacobian.data());
+
+      // Residuals are linear in the betas, so one Gauss-Newton step solves them
+      double normal[betas * betas] = {};
+      double step[betas] = {};
+      for (size_t i = 0; i < tenors.size(); ++i) {
+        const double *row = &jacobian[i * PARAMETERS];
+        for (int j = 0; j < betas; ++j) {
+          step[j] -= row[j] * residuals[i];
+          for (int k = 0; k < betas; ++k) {
+            normal[j * betas + k] += row[j] * row[k];
+          }
+        }
+      }
+      if (!Solve(normal, step, betas)) {
+        continue;
+      }
+      copy(step, step + betas, candidate);
+      double cost = Residuals(candidate, residuals.data(), nullptr);
+      if (isfinite(cost) && cost < bestCost) {
+        bestCost = cost;
+        copy(candidate, candidate + PARAMETERS, parameters);
+      }
+    }
+  }
+  damping = 1e-3;
+  return bestCost != HUGE_VAL;
+}
+
+bool BondCurveService::Refit()
+{
+  if (pricedCount < tenors.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < tenors.size(); ++i) {
+    maturities[i] = max(YearsToMaturity(tenors[i]), 1e-3);
+  }
+  if (!fitted && !ColdStart()) {
+    return false;
+  }
+
+  const size_t points = tenors.size();
+  double normal[PARAMETERS * PARAMETERS];
+  double gradient[PARAMETERS];
+  double step[PARAMETERS];
+  double trial[PARAMETERS];
+
+  double cost = Residuals(parameters, residuals.data(), jacobian.data());
+  int iteration = 0;
+  bool converged = cost <= 1e-24;
+  while (!converged && iteration < MAX_ITERATIONS) {
+    ++iteration;
+
+    // Normal equations J'J and J'r
+    for (int j = 0; j < PARAMETERS; ++j) {
+      gradient[j] = 0.0;
+      for (int k = 0; k < PARAMETERS; ++k) {
+        normal[j * PARAMETERS + k] = 0.0;
+      }
+    }
+    for (size_t i = 0; i < points; ++i) {
+      const double *row = &jacobian[i * PARAMETERS];
+      for (int j = 0; j < PARAMETERS; ++j) {
+        gradient[j] += row[j] * residuals[i];
+        for (int k = 0; k < PARAMETERS; ++k) {
+          normal[j * PARAMETERS + k] += row[j] * row[k];
+        }
+      }
+    }
+
+    // Raise the damping until a step lowers the cost, and relax it after one does
+    bool improved = false;
+    while (!improved && damping < 1e12) {
+      double system[PARAMETERS * PARAMETERS];
+      copy(normal, normal + PARAMETERS * PARAMETERS, system);
+      for (int j = 0; j < PARAMETERS; ++j) {
+        system[j * PARAMETERS + j] += damping * max(normal[j * PARAMETERS + j], 1e-12);
+        step[j] = -gradient[j];
+      }
+      if (Solve(system, step, PARAMETERS)) {
+        for (int j = 0; j < PARAMETERS; ++j) {
+          trial[j] = parameters[j] + step[j];
+        }
+        trial[4] = min(max(trial[4], MIN_LOG_TAU), MAX_LOG_TAU);
+        trial[5] = min(max(trial[5], MIN_LOG_TAU), MAX_LOG_TAU);
+        improved = Residuals(trial, trialResiduals.data(), nullptr) < cost;
+      }
+      damping = improved ? max(damping * 0.1, 1e-12) : damping * 10.0;
+    }
+
+    if (!improved) {
+      // No step helps: this is the minimum; start the next fit lightly damped
+      damping = 1e-3;
+      converged = true;
+    }
+    else {
+      double previousCost = cost;
+      copy(trial, trial + PARAMETERS, parameters);
+      cost = Residuals(parameters, residuals.data(), jacobian.data());
+      converged = previousCost - cost <= max(1e-8 * previousCost, COST_TOLERANCE * points) || cost <= 1e-24;
+    }
+  }
+
+  if (!isfinite(cost)) {
+    // Leave the last good curve published and start the next fit cold
+    fitted = false;
+    return false;
+  }
+  fitted = true;
+  lastIterations = iteration;
+  YieldCurve fit = ToCurve(parameters);
+  fit.rmsError = sqrt(cost / points);
+  fit.version = ++fitCount;
+  curve.Store(fit);
+  return true;
+}
+
+void BondCurveService::ProcessAdd(Price<Bond> &data)
+{
+  auto it = tenorIds.find(data.GetProduct().GetProductId());
+  if (it == tenorIds.end()) {
+    return;
+  }
+  size_t tenor = it->second;
+  const Bond &bond = tenors[tenor];
+  yields[tenor] = bond.ComputeYield(data.GetMid() * bond.GetFaceValue() / 100.0, PAYMENTS);
+  if (!priced[tenor]) {
+    priced[tenor] = true;
+    ++pricedCount;
+  }
+  Refit();
+}
+
+inline void BondCurveService::ProcessRemove(Price<Bond> &data)
+{
+}
+
+inline void BondCurveService::ProcessUpdate(Price<Bond> &data)
+{
+  ProcessAdd(data);
+}
+
+#endif
@@ -272,6 +272,7 @@ inline void BondExecutionService::ExecuteOrder(const ExecutionOrder<Bond>& order
   // long executedQuantity = 0;
 
   long executionQuant = (order.GetVisibleQuantity() > 0) ? order.GetVisibleQuantity() : order.GetHiddenQuantity();
+  bool isNew = (executionMap.find(order.GetOrderId()) == executionMap.end());
 
   if (order.IsChildOrder()) {
     string productId = order.GetParentOrderId();
@@ -317,10 +318,7 @@ inline void BondExecutionService::ExecuteOrder(const ExecutionOrder<Bond>& order
   }
 
   if (executionState == Execution::EXECUTED) {
-    string orderId = order.GetOrderId();
-    auto it = executionMap.find(orderId);
-    bool isNew = (it == executionMap.end());
-    executionMap.emplace(orderId, order);
+    executionMap.emplace(order.GetOrderId(), order);
 
     string tradeBook = tradeBooks[currentTradeBookIndex];
     currentTradeBookIndex = (currentTradeBookIndex + 1) % tradeBooks.size();
@@ -2,173 +2,565 @@
 #define GUI_SERVICE_HPP
 
 #include <unordered_map>
-#include <fstream> 
+#include <fstream>
 #include <chrono>
-#include <sstream>
-#include <iomanip>
 #include <iostream>
 #include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include "soa.hpp"
 #include "products.hpp"
 #include "pricingservice.hpp"
+#include "textformat.hpp"
 
 
-
-class GUIService : public ServiceListener<Price<Bond>>
+/**
+ * Latest-value price table shared by the pricing thread and the GUI sampler.
+ * Each slot packs mid and spread (both in 256ths, the GUI's display resolution)
+ * into one 64-bit word, so publishing a tick is a single atomic store.
+ * Slots are only ever added by the pricing thread; the sampler reads up to Size().
+ */
+class GUIPriceTable
 {
-private: 
-    unordered_map<string, Price<Bond>> priceMap;
-    //vector<ServiceListener<Price<Bond>>*> listeners;
-    string filename;
-    ofstream file;
+public:
+    static constexpr size_t CAPACITY = 4096;
 
-    chrono::steady_clock::time_point lastUpdateTime;
-    int printCount;
-    string latestPriceID;
+    GUIPriceTable();
+    ~GUIPriceTable();
 
-    string GetCurrentTime();
+    // Find or register the slot for a product (pricing thread only)
+    size_t GetSlot(const Bond& product);
 
-    string ConvertToFrac(double price);
+    // Find the slot for a product id, or CAPACITY if it was never seen (pricing thread only)
+    size_t FindSlot(const string& productId) const;
 
-public: 
-    GUIService(string filename = "gui.txt");
-    ~GUIService();
+    // Publish the latest mid/spread for a slot
+    void Store(size_t slot, double mid, double spread);
 
-    Price<Bond>& GetData(string productId);
-    void PriceUpdate(const Price<Bond>& price);
+    // Number of registered slots, safe to call from any thread
+    size_t Size() const;
 
-    void ProcessAdd(Price<Bond> &price) override;
-    void ProcessRemove(Price<Bond> &price) override;
-    void ProcessUpdate(Price<Bond> &price) override;
+    // Load the packed value for a slot; 0 means nothing published yet
+    uint64_t Load(size_t slot) const;
+
+    // Product registered on a slot, valid for any slot below Size()
+    const Bond& GetProduct(size_t slot) const;
+
+    static double UnpackMid(uint64_t value);
+    static double UnpackSpread(uint64_t value);
+
+private:
+    static constexpr uint64_t PRESENT = 1ULL << 63;
+
+    atomic<uint64_t> values[CAPACITY];
+    const Bond* products[CAPACITY];
+    atomic<size_t> size;
+    unordered_map<string, size_t> slotIndex;
 };
 
-GUIService::GUIService(string filename) : filename(filename), printCount(0) 
+GUIPriceTable::GUIPriceTable() : size(0)
 {
-    file.open(filename, ios::out);
-    if (!file.is_open()) {
-        cerr << "could not open file" << filename << endl;
+    for (size_t i = 0; i < CAPACITY; ++i) {
+        values[i].store(0, memory_order_relaxed);
+        products[i] = nullptr;
     }
-
-    lastUpdateTime = chrono::steady_clock::now();
 }
 
-GUIService::~GUIService()
+GUIPriceTable::~GUIPriceTable()
 {
-    if (file.is_open()) {
-        file.close();
+    for (size_t i = 0; i < size.load(memory_order_relaxed); ++i) {
+        delete products[i];
     }
 }
 
-inline Price<Bond>& GUIService::GetData(string productId) 
+inline size_t GUIPriceTable::GetSlot(const Bond& product)
 {
-    auto it = priceMap.find(productId);
-    if (it != priceMap.end()) {
+    const string& productId = product.GetProductId();
+    auto it = slotIndex.find(productId);
+    if (it != slotIndex.end()) {
         return it->second;
     }
-    throw runtime_error("Price key not found: " + productId);
+
+    size_t slot = size.load(memory_order_relaxed);
+    if (slot == CAPACITY) {
+        throw runtime_error("GUI price table is full, cannot add " + productId);
+    }
+    products[slot] = new Bond(product);
+    slotIndex.emplace(productId, slot);
+    size.store(slot + 1, memory_order_release);
+    return slot;
 }
 
+inline size_t GUIPriceTable::FindSlot(const string& productId) const
+{
+    auto it = slotIndex.find(productId);
+    return (it != slotIndex.end()) ? it->second : CAPACITY;
+}
 
-void GUIService::PriceUpdate(const Price<Bond> &price) 
+inline void GUIPriceTable::Store(size_t slot, double mid, double spread)
 {
-    string productId = price.GetProduct().GetProductId();
-    priceMap.emplace(productId, price);
+    uint64_t mid256 = static_cast<uint64_t>(llround(mid * 256.0)) & 0x7FFFFFFFULL;
+    uint64_t spread256 = static_cast<uint64_t>(llround(spread * 256.0)) & 0xFFFFFFFFULL;
+    values[slot].store(PRESENT | (mid256 << 32) | spread256, memory_order_relaxed);
+}
 
-    latestPriceID = productId;
+inline size_t GUIPriceTable::Size() const
+{
+    return size.load(memory_order_acquire);
+}
 
-    auto now = chrono::steady_clock::now();
-    auto msSinceLast = chrono::duration_cast<chrono::milliseconds>(now - lastUpdateTime).count();
+inline uint64_t GUIPriceTable::Load(size_t slot) const
+{
+    return values[slot].load(memory_order_relaxed);
+}
 
-    if (printCount < 100 && msSinceLast >= 300) {
-        string fracMid = ConvertToFrac(price.GetMid());
-        string fracSpread = ConvertToFrac(price.GetBidOfferSpread());
-        if (file.is_open()) {
-            file << GetCurrentTime() << " "
-                    << price.GetProduct().GetProductId() << " "
-                    << fixed << setprecision(6) 
-                    << fracMid << " "
-                    << fracSpread << endl;
-        }
-        else { 
-            cerr << "Could not open file" << endl;
-        }
-        ++printCount;
-        lastUpdateTime = now;
+inline const Bond& GUIPriceTable::GetProduct(size_t slot) const
+{
+    return *products[slot];
+}
+
+inline double GUIPriceTable::UnpackMid(uint64_t value)
+{
+    return static_cast<double>((value >> 32) & 0x7FFFFFFFULL) / 256.0;
+}
+
+inline double GUIPriceTable::UnpackSpread(uint64_t value)
+{
+    return static_cast<double>(value & 0xFFFFFFFFULL) / 256.0;
+}
+
+/**
+ * Fixed-layout, memory-mapped GUI snapshot file: a header followed by one slot
+ * per instrument. Each slot is double-buffered under a sequence number so the
+ * single writer never blocks and viewers in other processes always have a
+ * complete buffer to read:
+ *   sequence odd  -> version (sequence / 2 + 1) is being written into buffer (version & 1)
+ *   sequence even -> version (sequence / 2) is complete in buffer (version & 1)
+ * A reader that started at version v is only torn if the writer has begun
+ * version v + 2, i.e. the sequence reached 2v + 3.
+ */
+struct GUISnapshotHeader
+{
+    char magic[8];
+    uint32_t layoutVersion;
+    uint32_t slotCapacity;
+    atomic<uint64_t> instrumentCount;
+    uint64_t reserved[5];
+};
+
+struct alignas(64) GUISnapshotSlot
+{
+    char productId[32];
+    atomic<uint64_t> sequence;
+    atomic<uint64_t> buffers[2][3];   // mid bits, spread bits, timestamp in ns
+};
+
+static_assert(sizeof(GUISnapshotHeader) == 64, "GUI snapshot header layout changed");
+static_assert(atomic<uint64_t>::is_always_lock_free, "GUI snapshot needs lock-free 64-bit atomics");
+
+/**
+ * Writer side of the GUI snapshot file. Owned by the GUI sampler thread.
+ */
+class GUISnapshotFile
+{
+public:
+    static constexpr uint32_t LAYOUT_VERSION = 1;
+
+    GUISnapshotFile(const string& path, uint32_t slotCapacity);
+    ~GUISnapshotFile();
+
+    bool IsOpen() const { return header != nullptr; }
+
+    // Register the product id on the next slot; slots are assigned in order
+    void AddInstrument(size_t slot, const string& productId);
+
+    // Publish the latest values for a slot
+    void Publish(size_t slot, double mid, double spread, int64_t timestampNs);
+
+private:
+    int fd;
+    size_t mappedSize;
+    GUISnapshotHeader* header;
+    GUISnapshotSlot* slots;
+};
+
+/**
+ * Reader side of the GUI snapshot file, for viewers polling from other processes.
+ */
+class GUISnapshotReader
+{
+public:
+    GUISnapshotReader(const string& path);
+    ~GUISnapshotReader();
+
+    bool IsOpen() const { return header != nullptr; }
+
+    size_t GetInstrumentCount() const;
+
+    const char* GetProductId(size_t slot) const;
+
+    // Copy a consistent view of a slot; false if it has never been written
+    bool Read(size_t slot, double& mid, double& spread, int64_t& timestampNs) const;
+
+private:
+    int fd;
+    size_t mappedSize;
+    const GUISnapshotHeader* header;
+    const GUISnapshotSlot* slots;
+};
+
+GUISnapshotFile::GUISnapshotFile(const string& path, uint32_t slotCapacity)
+    : fd(-1), mappedSize(sizeof(GUISnapshotHeader) + sizeof(GUISnapshotSlot) * slotCapacity), header(nullptr), slots(nullptr)
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(mappedSize)) != 0) {
+        cerr << "could not create GUI snapshot file " << path << endl;
+        return;
     }
 
+    void* mem = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        cerr << "could not map GUI snapshot file " << path << endl;
+        return;
+    }
 
+    // ftruncate zero-fills, which is a valid initial state for every atomic in the layout
+    header = static_cast<GUISnapshotHeader*>(mem);
+    slots = reinterpret_cast<GUISnapshotSlot*>(static_cast<char*>(mem) + sizeof(GUISnapshotHeader));
+    header->layoutVersion = LAYOUT_VERSION;
+    header->slotCapacity = slotCapacity;
+    header->instrumentCount.store(0, memory_order_relaxed);
+    memcpy(header->magic, "BTGUISN", 8);
+    atomic_thread_fence(memory_order_release);
 }
 
-void GUIService::ProcessAdd(Price<Bond> &price) 
+GUISnapshotFile::~GUISnapshotFile()
 {
-    cout << "Process Add called for product" << endl;
-    PriceUpdate(price);
+    if (header) {
+        msync(header, mappedSize, MS_ASYNC);
+        munmap(header, mappedSize);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
 }
 
-void GUIService::ProcessRemove(Price<Bond> &price) 
+inline void GUISnapshotFile::AddInstrument(size_t slot, const string& productId)
 {
+    strncpy(slots[slot].productId, productId.c_str(), sizeof(slots[slot].productId) - 1);
+    header->instrumentCount.store(slot + 1, memory_order_release);
+}
 
+inline void GUISnapshotFile::Publish(size_t slot, double mid, double spread, int64_t timestampNs)
+{
+    GUISnapshotSlot& s = slots[slot];
+    uint64_t sequence = s.sequence.load(memory_order_relaxed);
+    s.sequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    uint64_t version = sequence / 2 + 1;
+    atomic<uint64_t>* buffer = s.buffers[version & 1];
+    uint64_t bits;
+    memcpy(&bits, &mid, sizeof(bits));
+    buffer[0].store(bits, memory_order_relaxed);
+    memcpy(&bits, &spread, sizeof(bits));
+    buffer[1].store(bits, memory_order_relaxed);
+    buffer[2].store(static_cast<uint64_t>(timestampNs), memory_order_relaxed);
+
+    s.sequence.store(sequence + 2, memory_order_release);
 }
 
-void GUIService::ProcessUpdate(Price<Bond> &price) 
+GUISnapshotReader::GUISnapshotReader(const string& path) : fd(-1), mappedSize(0), header(nullptr), slots(nullptr)
 {
-    cout << "Process update called for product " << endl;
-    PriceUpdate(price);
+    fd = open(path.c_str(), O_RDONLY);
+    off_t size = (fd >= 0) ? lseek(fd, 0, SEEK_END) : -1;
+    if (size < static_cast<off_t>(sizeof(GUISnapshotHeader))) {
+        cerr << "could not open GUI snapshot file " << path << endl;
+        return;
+    }
+
+    void* mem = mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        cerr << "could not map GUI snapshot file " << path << endl;
+        return;
+    }
+    mappedSize = static_cast<size_t>(size);
+    header = static_cast<const GUISnapshotHeader*>(mem);
+    slots = reinterpret_cast<const GUISnapshotSlot*>(static_cast<const char*>(mem) + sizeof(GUISnapshotHeader));
+    if (header->layoutVersion != GUISnapshotFile::LAYOUT_VERSION) {
+        cerr << "unexpected GUI snapshot layout in " << path << endl;
+    }
+}
+
+GUISnapshotReader::~GUISnapshotReader()
+{
+    if (header) {
+        munmap(const_cast<GUISnapshotHeader*>(header), mappedSize);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+inline size_t GUISnapshotReader::GetInstrumentCount() const
+{
+    return header->instrumentCount.load(memory_order_acquire);
+}
+
+inline const char* GUISnapshotReader::GetProductId(size_t slot) const
+{
+    return slots[slot].productId;
+}
+
+inline bool GUISnapshotReader::Read(size_t slot, double& mid, double& spread, int64_t& timestampNs) const
+{
+    const GUISnapshotSlot& s = slots[slot];
+    for (;;) {
+        uint64_t before = s.sequence.load(memory_order_acquire);
+        uint64_t version = before / 2;
+        if (version == 0) {
+            return false;
+        }
+
+        const atomic<uint64_t>* buffer = s.buffers[version & 1];
+        uint64_t midBits = buffer[0].load(memory_order_relaxed);
+        uint64_t spreadBits = buffer[1].load(memory_order_relaxed);
+        uint64_t timestamp = buffer[2].load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+
+        uint64_t after = s.sequence.load(memory_order_relaxed);
+        if (after < 2 * version + 3) {
+            memcpy(&mid, &midBits, sizeof(mid));
+            memcpy(&spread, &spreadBits, sizeof(spread));
+            timestampNs = static_cast<int64_t>(timestamp);
+            return true;
+        }
+    }
 }
 
-string GUIService::GetCurrentTime()
+// GUI output modes: append lines to a text file, or keep a memory-mapped snapshot file current
+enum GUIOutputMode { GUI_TEXT, GUI_SNAPSHOT };
+
+/**
+ * GUI output. The pricing thread only publishes into a GUIPriceTable; a separate
+ * low-priority thread samples the table every throttle interval (300ms by default)
+ * and writes the instruments that changed since the last snapshot. In GUI_TEXT mode
+ * they are appended to the file (first 100 lines only); in GUI_SNAPSHOT mode they
+ * are published into a GUISnapshotFile that viewers can poll.
+ *
+ * Registered as a tick listener, the GUI resolves each product's slot on its
+ * first tick and every later tick is a single store into it; as a plain
+ * ServiceListener it looks the slot up by product id on every tick.
+ */
+class GUIService : public ServiceListener<Price<Bond>>, public PriceTickListener<Bond>
+{
+private:
+    GUIPriceTable priceTable;
+    string filename;
+    GUIOutputMode mode;
+    ofstream file;
+    GUISnapshotFile* snapshotFile;
+    size_t snapshotInstruments;
+
+    chrono::milliseconds throttle;
+    int printCount;
+
+    // Sampler thread state
+    thread sampler;
+    mutex samplerMutex;
+    condition_variable samplerCv;
+    bool stopping;
+    vector<uint64_t> lastWritten;
+
+    // Price table slot by the pricing service's product index, CAPACITY until the first tick
+    vector<size_t> tickSlots;
+
+    TimestampFormatter timestampFormatter;
+    string snapshotBuffer;
+
+    void RunSampler();
+    void WriteSnapshot();
+    void PublishSnapshot();
+
+public:
+    GUIService(string filename = "gui.txt", GUIOutputMode mode = GUI_TEXT, chrono::milliseconds throttle = chrono::milliseconds(300));
+    ~GUIService();
+
+    // Latest price seen for a product (pricing thread only)
+    Price<Bond> GetData(string productId);
+    void PriceUpdate(const Price<Bond>& price);
+
+    void ProcessAdd(Price<Bond> &price) override;
+    void ProcessRemove(Price<Bond> &price) override;
+    void ProcessUpdate(Price<Bond> &price) override;
+
+    void ProcessTick(const Price<Bond> &price, uint32_t index) override;
+};
+
+GUIService::GUIService(string filename, GUIOutputMode mode, chrono::milliseconds throttle)
+    : filename(filename), mode(mode), snapshotFile(nullptr), snapshotInstruments(0), throttle(throttle), printCount(0),
+      stopping(false), lastWritten(GUIPriceTable::CAPACITY, 0), timestampFormatter('T', 3)
 {
-    auto now = chrono::system_clock::now();
-    auto timeT = chrono::system_clock::to_time_t(now);
-    auto ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()) % 1000;
+    if (mode == GUI_SNAPSHOT) {
+        snapshotFile = new GUISnapshotFile(filename, GUIPriceTable::CAPACITY);
+    }
+    else {
+        snapshotBuffer.reserve(4096);
+        file.open(filename, ios::out);
+        if (!file.is_open()) {
+            cerr << "could not open file" << filename << endl;
+        }
+    }
 
-    tm bt;
-#ifdef _WIN32
-    localtime_s(&bt, &timeT);
-#else 
-    localtime_r(&timeT, &bt);
+    sampler = thread(&GUIService::RunSampler, this);
+#ifdef __linux__
+    sched_param param{};
+    param.sched_priority = 0;
+    pthread_setschedparam(sampler.native_handle(), SCHED_IDLE, &param);
 #endif
+}
 
-    char buf[64];
-    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &bt);
-    ostringstream oss; 
+GUIService::~GUIService()
+{
+    {
+        lock_guard<mutex> lock(samplerMutex);
+        stopping = true;
+    }
+    samplerCv.notify_one();
+    if (sampler.joinable()) {
+        sampler.join();
+    }
 
-    oss << buf << "." << setw(3) << setfill('0') << ms.count();
-    return oss.str();
+    if (file.is_open()) {
+        file.close();
+    }
+    delete snapshotFile;
 }
 
-string GUIService::ConvertToFrac(double price) 
+inline Price<Bond> GUIService::GetData(string productId)
 {
-    int whole = static_cast<int>(price);
-    double frac = price - static_cast<double>(whole);
+    size_t slot = priceTable.FindSlot(productId);
+    uint64_t value = (slot != GUIPriceTable::CAPACITY) ? priceTable.Load(slot) : 0;
+    if (value == 0) {
+        throw runtime_error("Price key not found: " + productId);
+    }
+    return Price<Bond>(priceTable.GetProduct(slot), GUIPriceTable::UnpackMid(value), GUIPriceTable::UnpackSpread(value));
+}
+
 
-    double totalTicks = round(frac * 256.0);
-    int ticks256 = static_cast<int>(totalTicks);
+void GUIService::PriceUpdate(const Price<Bond> &price)
+{
+    size_t slot = priceTable.GetSlot(price.GetProduct());
+    priceTable.Store(slot, price.GetMid(), price.GetBidOfferSpread());
+}
 
-    if (ticks256 == 256) {
-        ticks256 = 0;
-        ++whole;
+inline void GUIService::ProcessTick(const Price<Bond> &price, uint32_t index)
+{
+    if (index >= tickSlots.size()) {
+        tickSlots.resize(index + 1, GUIPriceTable::CAPACITY);
+    }
+    size_t &slot = tickSlots[index];
+    if (slot == GUIPriceTable::CAPACITY) {
+        slot = priceTable.GetSlot(price.GetProduct());
     }
+    priceTable.Store(slot, price.GetMid(), price.GetBidOfferSpread());
+}
 
-    int ticks32 = ticks256 / 8;
-    int subTicks = ticks256 % 8;
-    ostringstream oss;
-    oss << whole << "-";
-    if (ticks32 < 10) oss << "0";
-    oss << ticks32;
+void GUIService::RunSampler()
+{
+    // Always sample at least once after waking, so a sampler first scheduled
+    // after the destructor set stopping still flushes the last prices
+    unique_lock<mutex> lock(samplerMutex);
+    do {
+        samplerCv.wait_for(lock, throttle, [this] { return stopping; });
+        if (mode == GUI_SNAPSHOT) {
+            PublishSnapshot();
+        }
+        else {
+            WriteSnapshot();
+        }
+    } while (!stopping);
+}
 
-    if (subTicks == 4) {
-        oss << "+";
+void GUIService::WriteSnapshot()
+{
+    if (!file.is_open()) {
+        return;
     }
 
-    else if (subTicks != 0) {
-        oss << subTicks;
+    char timestamp[TimestampFormatter::MAX_LENGTH];
+    size_t timestampLength = timestampFormatter.Format(timestamp);
+    char price[FractionalPriceFormatter::MAX_LENGTH];
+
+    snapshotBuffer.clear();
+    size_t count = priceTable.Size();
+    for (size_t slot = 0; slot < count && printCount < 100; ++slot) {
+        uint64_t value = priceTable.Load(slot);
+        if (value == 0 || value == lastWritten[slot]) continue;
+        lastWritten[slot] = value;
+
+        snapshotBuffer.append(timestamp, timestampLength);
+        snapshotBuffer += ' ';
+        snapshotBuffer += priceTable.GetProduct(slot).GetProductId();
+        snapshotBuffer += ' ';
+        snapshotBuffer.append(price, FractionalPriceFormatter::FormatPrice(price, GUIPriceTable::UnpackMid(value)));
+        snapshotBuffer += ' ';
+        snapshotBuffer.append(price, FractionalPriceFormatter::FormatPrice(price, GUIPriceTable::UnpackSpread(value)));
+        snapshotBuffer += '\n';
+        ++printCount;
     }
 
-    return oss.str();
+    if (!snapshotBuffer.empty()) {
+        file.write(snapshotBuffer.data(), snapshotBuffer.size());
+        file.flush();
+    }
+}
+
+void GUIService::PublishSnapshot()
+{
+    if (!snapshotFile->IsOpen()) {
+        return;
+    }
 
+    size_t count = priceTable.Size();
+    for (; snapshotInstruments < count; ++snapshotInstruments) {
+        snapshotFile->AddInstrument(snapshotInstruments, priceTable.GetProduct(snapshotInstruments).GetProductId());
+    }
+
+    int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    for (size_t slot = 0; slot < count; ++slot) {
+        uint64_t value = priceTable.Load(slot);
+        if (value == 0 || value == lastWritten[slot]) continue;
+        lastWritten[slot] = value;
+        snapshotFile->Publish(slot, GUIPriceTable::UnpackMid(value), GUIPriceTable::UnpackSpread(value), now);
+    }
 }
 
+void GUIService::ProcessAdd(Price<Bond> &price)
+{
+    PriceUpdate(price);
+}
+
+void GUIService::ProcessRemove(Price<Bond> &price)
+{
+
+}
+
+void GUIService::ProcessUpdate(Price<Bond> &price)
+{
+    PriceUpdate(price);
+}
 
 
 #endif
@@ -20,6 +20,7 @@
 #include <fstream>
 #include <string>
 #include <chrono>
+#include "textformat.hpp"
 
 
 using namespace std;
@@ -45,46 +46,42 @@ class FileConnector : public Connector<T>
 {
 private: 
   string filename;
+  ofstream outFile;
+  TimestampFormatter timestampFormatter;
 
 public: 
   FileConnector(const string& _filename);
+  ~FileConnector();
   void Publish(T& data) override;
   //void SetFilename(const string& filename) {filename = filename;}
 
 };
 
 template<typename T>
-FileConnector<T>::FileConnector(const string& _filename) 
+FileConnector<T>::FileConnector(const string& _filename) : timestampFormatter(' ', 3)
 {
   filename = _filename;
+  outFile.open(filename, ios::app);
 }
 
 template<typename T>
-inline void FileConnector<T>::Publish(T& data) 
+FileConnector<T>::~FileConnector()
 {
-  ofstream outFile(filename, ios::app);
   if (outFile.is_open()) {
-    auto now = chrono::system_clock::now();
-    auto time_t_now = chrono::system_clock::to_time_t(now);
-    auto ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()) % 1000;
-
-    outFile << put_time(localtime(&time_t_now), "%Y-%m-%d %H:%M:%S")
-            << "." << setfill('0') << setw(3) << ms.count() << " "
-            << data << endl;
     outFile.close();
+  }
+}
 
-    // auto now = chrono::system_clock::now();
-    // auto time_t_now = chrono::system_clock::to_time_t(now);
-    // auto ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()) % 1000;
-
-    // stringstream logData;
-    // logData << put_time(localtime(&time_t_now), "%Y-%m-%d %H:%M:%S")
-    //         << "." << setfill('0') << setw(3) << ms.count() << " "
-    //         << data << endl;
+template<typename T>
+inline void FileConnector<T>::Publish(T& data) 
+{
+  if (outFile.is_open()) {
+    char timestamp[TimestampFormatter::MAX_LENGTH + 1];
+    size_t length = timestampFormatter.Format(timestamp);
+    timestamp[length++] = ' ';
 
-    // cout << "Writing to File: " << logData.str();
-    // outFile << logData.str();
-    // outFile.close();
+    outFile.write(timestamp, length);
+    outFile << data << '\n';
   }
   else {
     cerr << "Error: Could not open file " << filename << " for writing. " << endl;
@@ -151,10 +148,16 @@ inline void FileConnector<T>::Publish(T& data)
 //   PersistData("", data);
 // }
 
-class BondPositionHistoricalDataService : public ServiceListener<Position<Bond>>
+/**
+ * Persists positions to positions.txt. As a ServiceListener it writes every book
+ * of the product on each update; as a PositionDeltaListener it writes only the
+ * book that changed and the new aggregate.
+ */
+class BondPositionHistoricalDataService : public ServiceListener<Position<Bond>>, public PositionDeltaListener<Bond>
 {
 private: 
   FileConnector<string>* connector;
+  string buffer;
 public: 
   BondPositionHistoricalDataService() {
     connector = new FileConnector<string>("positions.txt");
@@ -167,23 +170,22 @@ public:
 
   void PersistData(string persistKey, const Position<Bond>& position)
   {
-    stringstream ss;
-
     const Bond& bond = position.GetProduct();
-    string productId = bond.GetProductId();
-
-    for (const auto& bookPosition : position.GetPositions()) {
-        ss << "Product: " << productId << ", " 
-          << "Book: " << bookPosition.first << ", " 
-          << "Quantity: " << bookPosition.second << endl;
-    }
-    ss << "Product: " << productId << ", " 
-      << "Aggregate Position: " << position.GetAggregatePosition() << endl;
-
-    string ss_string = ss.str();
-    
-
-    connector->Publish(ss_string);
+    const string& productId = bond.GetProductId();
+
+    buffer.clear();
+    position.ForEachBook([&](const string& book, long quantity) {
+      buffer.append("Product: ").append(productId)
+            .append(", Book: ").append(book)
+            .append(", Quantity: ");
+      AppendNumber(buffer, quantity);
+      buffer += '\n';
+    });
+    buffer.append("Product: ").append(productId).append(", Aggregate Position: ");
+    AppendNumber(buffer, position.GetAggregatePosition());
+    buffer += '\n';
+
+    connector->Publish(buffer);
       
       
   }
@@ -200,13 +202,36 @@ public:
 
   void ProcessRemove(Position<Bond>& data) override {}
 
+  void ProcessDelta(const Position<Bond>& position, const PositionDelta& delta) override
+  {
+    const string& productId = position.GetProduct().GetProductId();
+
+    buffer.clear();
+    buffer.append("Product: ").append(productId)
+          .append(", Book: ").append(position.GetBookName(delta.book))
+          .append(", Quantity: ");
+    AppendNumber(buffer, delta.bookPosition);
+    buffer.append(", Change: ");
+    AppendNumber(buffer, delta.change);
+    buffer.append(", Aggregate Position: ");
+    AppendNumber(buffer, delta.aggregate);
+    buffer += '\n';
+
+    connector->Publish(buffer);
+  }
+
 };
 
-class BondRiskHistoricalDataService : public ServiceListener<PV01<Bond>>
+/**
+ * Persists risk to risk.txt: product PV01s, and bucket totals when registered
+ * as a bucket listener on the risk service.
+ */
+class BondRiskHistoricalDataService : public ServiceListener<PV01<Bond>>, public ServiceListener<PV01<BucketedSector<Bond>>>
 {
 
 private: 
   FileConnector<string>* connector;
+  string buffer;
 public: 
   BondRiskHistoricalDataService() {
     connector = new FileConnector<string>("risk.txt");
@@ -219,49 +244,58 @@ public:
 
   void PersistData(string persistKey, const PV01<Bond>& pv01)
   {
-    stringstream ss;
     const Bond& bond = pv01.GetProduct();
 
-    // cout << "Persisting Risk Data - Product: " << bond.GetProductId()
-    //      << ", PV01: " << pv01.GetPV01()
-    //      << ", Quantity: " << pv01.GetQuantity() << endl;
+    buffer.clear();
+    buffer.append("Product: ").append(bond.GetProductId()).append(", PV01: ");
+    AppendNumber(buffer, pv01.GetPV01());
+    buffer.append(", Quantity: ");
+    AppendNumber(buffer, pv01.GetQuantity());
+    buffer += '\n';
 
-    ss << "Product: " << bond.GetProductId() << ", "
-        << "PV01: " << pv01.GetPV01() << ", "
-        << "Quantity: " << pv01.GetQuantity() << endl;
-    
-    string ss_string = ss.str();
-    connector->Publish(ss_string);
+    connector->Publish(buffer);
 
   }
   
 
   void PersistBucketedRisk(const string& persistKey, const PV01<BucketedSector<Bond>>& bucketedRisk) 
   {
-    stringstream ss;
-    const BucketedSector<Bond> bucket = bucketedRisk.GetProduct();
+    const BucketedSector<Bond>& bucket = bucketedRisk.GetProduct();
 
-    ss << "Bucket Sector: " << bucket.GetName() << ", "
-            << "Total PV01: " << bucketedRisk.GetPV01() << ", "
-            << "Total Quantity: " << bucketedRisk.GetQuantity() << endl;
-    string ss_string = ss.str();
-    connector->Publish(ss_string);
+    buffer.clear();
+    buffer.append("Bucket Sector: ").append(bucket.GetName()).append(", Total PV01: ");
+    AppendNumber(buffer, bucketedRisk.GetPV01());
+    buffer.append(", Total Quantity: ");
+    AppendNumber(buffer, bucketedRisk.GetQuantity());
+    buffer += '\n';
+
+    connector->Publish(buffer);
 
   }
   void ProcessAdd(PV01<Bond>& data) override 
   {
     PersistData("risk.txt", data);
-    //PersistBucketedRisk("risk.txt", data)
   }
 
   void ProcessUpdate(PV01<Bond>& data) override
   {
     PersistData("risk.txt", data);
-    //PersistBucketedRisk("risk.txt", data);
   }
 
   void ProcessRemove(PV01<Bond>& data) override {}
 
+  void ProcessAdd(PV01<BucketedSector<Bond>>& data) override
+  {
+    PersistBucketedRisk("risk.txt", data);
+  }
+
+  void ProcessUpdate(PV01<BucketedSector<Bond>>& data) override
+  {
+    PersistBucketedRisk("risk.txt", data);
+  }
+
+  void ProcessRemove(PV01<BucketedSector<Bond>>& data) override {}
+
 };
 
 class BondStreamingHistoricalDataService : public ServiceListener<PriceStream<Bond>>
@@ -269,6 +303,7 @@ class BondStreamingHistoricalDataService : public ServiceListener<PriceStream<Bo
 
 private: 
   FileConnector<string>* connector;
+  string buffer;
 public: 
   BondStreamingHistoricalDataService() {
     connector = new FileConnector<string>("streaming.txt");
@@ -283,21 +318,26 @@ public:
   {
 
     const Bond& bond = stream.GetProduct();
-    string productId = bond.GetProductId();
-
-    auto bidStream = stream.GetBidOrder();
-    auto offerStream = stream.GetOfferOrder();
 
-    stringstream ss;
-    ss << "Streaming for product: " << productId << endl;
-    ss << " Bid price: " << bidStream.GetPrice() 
-        << ", Bid visible quantity: " << bidStream.GetVisibleQuantity()
-        << ", Bid hidden quantity: " << bidStream.GetHiddenQuantity() << endl;
-    ss << "Offer price " << offerStream.GetPrice() 
-        << ", Offer visible quantity: " << offerStream.GetVisibleQuantity() 
-        << ", offer hidden quantity: " << offerStream.GetHiddenQuantity() << endl;
-    string ss_string = ss.str();
-    connector->Publish(ss_string);
+    const PriceStreamOrder& bidStream = stream.GetBidOrder();
+    const PriceStreamOrder& offerStream = stream.GetOfferOrder();
+
+    buffer.clear();
+    buffer.append("Streaming for product: ").append(bond.GetProductId()).append("\n Bid price: ");
+    AppendNumber(buffer, bidStream.GetPrice());
+    buffer.append(", Bid visible quantity: ");
+    AppendNumber(buffer, bidStream.GetVisibleQuantity());
+    buffer.append(", Bid hidden quantity: ");
+    AppendNumber(buffer, bidStream.GetHiddenQuantity());
+    buffer.append("\nOffer price ");
+    AppendNumber(buffer, offerStream.GetPrice());
+    buffer.append(", Offer visible quantity: ");
+    AppendNumber(buffer, offerStream.GetVisibleQuantity());
+    buffer.append(", offer hidden quantity: ");
+    AppendNumber(buffer, offerStream.GetHiddenQuantity());
+    buffer += '\n';
+
+    connector->Publish(buffer);
 
   }
 
@@ -319,6 +359,7 @@ class BondInquiryHistoricalDataService : public ServiceListener<Inquiry<Bond>>
 
 private: 
   FileConnector<string>* connector;
+  string buffer;
 public: 
   BondInquiryHistoricalDataService() {
     connector = new FileConnector<string>("allinquiries.txt");
@@ -334,23 +375,22 @@ public:
 
     const Bond& bond = inquiry.GetProduct();
     InquiryState state = inquiry.GetState();
-    double price = inquiry.GetPrice();
 
-    stringstream ss;
-    
-    ss << "Inquiry for Bond: " << bond.GetProductId() 
-        << ", inquiry ID: " << inquiry.GetInquiryId()
-        << ", Quantity: " << inquiry.GetQuantity()
-        << ", price: " << inquiry.GetPrice()
-        << ", side: " << (inquiry.GetSide() == BUY ? "BUY" : "SELL")
-        << ", state: " << (state == RECEIVED ? "RECEIVED" : 
-                          state == QUOTED ? "QUOTED" :
-                          state == DONE ? "DONE" : 
-                          state == REJECTED ? "REJECTED" : "UNKNOWN")
-        << endl;
-        
-    string ss_string = ss.str();
-    connector->Publish(ss_string);
+    buffer.clear();
+    buffer.append("Inquiry for Bond: ").append(bond.GetProductId())
+          .append(", inquiry ID: ").append(inquiry.GetInquiryId())
+          .append(", Quantity: ");
+    AppendNumber(buffer, inquiry.GetQuantity());
+    buffer.append(", price: ");
+    AppendNumber(buffer, inquiry.GetPrice());
+    buffer.append(", side: ").append(inquiry.GetSide() == BUY ? "BUY" : "SELL")
+          .append(", state: ").append(state == RECEIVED ? "RECEIVED" : 
+                                      state == QUOTED ? "QUOTED" :
+                                      state == DONE ? "DONE" : 
+                                      state == REJECTED ? "REJECTED" : "UNKNOWN");
+    buffer += '\n';
+
+    connector->Publish(buffer);
 
   }
 
@@ -372,6 +412,7 @@ class BondExecutionHistoricalDataService : public ServiceListener<Trade<Bond>>
 
 private: 
   FileConnector<string>* connector;
+  string buffer;
 public: 
   BondExecutionHistoricalDataService() {
     connector = new FileConnector<string>("executions.txt");
@@ -385,25 +426,20 @@ public:
   void PersistData(string persistKey, const Trade<Bond>& trade) 
   {
     const Bond& bond = trade.GetProduct();
-    string tradeID = trade.GetTradeId();
     Side side = trade.GetSide();
-    double price = trade.GetPrice();
     double quantity = trade.GetQuantity();
-    string book = trade.GetBook();
 
-
-    stringstream ss;
-  
-    ss << "Product: " << bond.GetProductId() 
-        << ", Trade ID: " << tradeID 
-        << ", Quantity: " << quantity 
-        << ", Book: " << book 
-        << ", price: " << price 
-        << ", side: " << (side == BUY ? "BUY" : "SELL") << endl;
-        
-        
-    string ss_string = ss.str();
-    connector->Publish(ss_string);
+    buffer.clear();
+    buffer.append("Product: ").append(bond.GetProductId())
+          .append(", Trade ID: ").append(trade.GetTradeId())
+          .append(", Quantity: ");
+    AppendNumber(buffer, quantity);
+    buffer.append(", Book: ").append(trade.GetBook()).append(", price: ");
+    AppendNumber(buffer, trade.GetPrice());
+    buffer.append(", side: ").append(side == BUY ? "BUY" : "SELL");
+    buffer += '\n';
+
+    connector->Publish(buffer);
 
   }
 
@@ -10,7 +10,14 @@
 #include "soa.hpp"
 #include "tradebookingservice.hpp"
 #include "products.hpp"
+#include "pricingservice.hpp"
+#include "riskservice.hpp"
+#include "timerwheel.hpp"
 #include <iostream> 
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <mutex>
 #include <fstream>
 #include <sstream>
 
@@ -82,6 +89,12 @@ public:
   // Reject an inquiry from the client
   virtual void RejectInquiry(const string &inquiryId) = 0;
 
+  // Set the connector that quotes and rejections are published back to the client on
+  virtual void SetConnector(Connector<Inquiry<T> > *connector) = 0;
+
+  // Block until every message handed to OnMessage has been fully processed
+  virtual void Flush() = 0;
+
 };
 
 template<typename T>
@@ -143,60 +156,646 @@ void Inquiry<T>::SetPrice(double _price)
 }
 
 
+// Whether an inquiry may move from one state to another, indexed [from][to]
+const bool INQUIRY_TRANSITIONS[5][5] = {
+  //               RECEIVED QUOTED DONE   REJECTED CUSTOMER_REJECTED
+  /* RECEIVED */ { false,   true,  false, true,    true  },
+  /* QUOTED   */ { false,   false, true,  true,    true  },
+  /* DONE     */ { false,   false, false, false,   false },
+  /* REJECTED */ { false,   false, false, false,   false },
+  /* CUSTOMER_REJECTED */ { false, false, false, false, false }
+};
+
+/**
+ * Parameters for auto-quoting inquiries. Quotes are placed on the far side of
+ * our two-way price from the client (we offer to a buyer, bid to a seller) and
+ * are pushed further out by sizeSkew half-spreads for every sizeUnit of quantity.
+ * Both sides are then shifted against our inventory by inventorySkew half-spreads
+ * per riskUnit of position PV01, capped at maxInventorySkew, so the side that
+ * reduces our risk is quoted tighter.
+ */
+struct InquiryQuoteParameters
+{
+  double sizeUnit = 1000000.0;
+  double sizeSkew = 0.25;
+  double riskUnit = 10000.0;
+  double inventorySkew = 0.5;
+  double maxInventorySkew = 1.0;
+};
+
+/**
+ * Time-to-live for open inquiries. An inquiry still RECEIVED after receivedTtl,
+ * or still QUOTED after quotedTtl, is rejected and evicted. A zero TTL disables
+ * that timer. Expiry is checked on every tick.
+ */
+struct InquiryTimeouts
+{
+  chrono::milliseconds receivedTtl = chrono::seconds(60);
+  chrono::milliseconds quotedTtl = chrono::seconds(30);
+  chrono::milliseconds tick = chrono::milliseconds(100);
+};
+
+/**
+ * Computes inquiry quotes from the live mid and bid/offer spread, skewed by our
+ * position PV01. Price, position and risk are all read through the services'
+ * lock-free snapshots, so any thread may quote. The position and risk services
+ * are optional; without them quotes carry no inventory skew.
+ */
+class InquiryQuoter
+{
+
+public:
+
+  // ctor for a quoter on the given pricing, position and risk services
+  InquiryQuoter(BondPricingService *_pricingService, BondPositionService *_positionService,
+                BondRiskService *_riskService, const InquiryQuoteParameters &_parameters);
+
+  // Compute the quote for an inquiry; false if there is no live price for the product
+  bool Quote(const Inquiry<Bond> &inquiry, double &price) const;
+
+  // Inventory skew for a product in half-spreads; positive when we are long risk
+  double InventorySkew(const string &productId) const;
+
+private:
+  BondPricingService *pricingService;
+  BondPositionService *positionService;
+  BondRiskService *riskService;
+  InquiryQuoteParameters parameters;
+
+};
+
+InquiryQuoter::InquiryQuoter(BondPricingService *_pricingService, BondPositionService *_positionService,
+                             BondRiskService *_riskService, const InquiryQuoteParameters &_parameters) :
+  pricingService(_pricingService), positionService(_positionService), riskService(_riskService), parameters(_parameters)
+{
+}
+
+inline double InquiryQuoter::InventorySkew(const string &productId) const
+{
+  PositionSnapshot position;
+  RiskSnapshot risk;
+  if (!positionService || !riskService || !positionService->GetSnapshot(productId, position) ||
+      !riskService->GetSnapshot(productId, risk)) {
+    return 0.0;
+  }
+
+  // The position snapshot may be newer than the risk one, so scale it by the unit PV01
+  double pv01 = static_cast<double>(position.aggregate) * risk.pv01PerUnit;
+  double skew = parameters.inventorySkew * pv01 / parameters.riskUnit;
+  return max(-parameters.maxInventorySkew, min(parameters.maxInventorySkew, skew));
+}
+
+inline bool InquiryQuoter::Quote(const Inquiry<Bond> &inquiry, double &price) const
+{
+  PriceSnapshot livePrice;
+  if (!pricingService || !pricingService->GetSnapshot(inquiry.GetProduct().GetProductId(), livePrice)) {
+    return false;
+  }
+
+  double sizeSteps = static_cast<double>(inquiry.GetQuantity()) / parameters.sizeUnit;
+  double halfSpread = 0.5 * livePrice.bidOfferSpread;
+  double halfWidth = halfSpread * (1.0 + parameters.sizeSkew * sizeSteps);
+  // Long risk lowers both sides: a tighter offer to buyers, a wider bid to sellers
+  double mid = livePrice.mid - halfSpread * InventorySkew(inquiry.GetProduct().GetProductId());
+  price = (inquiry.GetSide() == BUY) ? mid + halfWidth : mid - halfWidth;
+  return true;
+}
+
+/**
+ * Open-addressing table of live inquiries keyed by inquiry id.
+ * Inquiries are stored in a flat record array; buckets hold the id hash and the
+ * record index, and erased records are recycled through a free list.
+ */
+class InquiryTable
+{
+
+public:
+
+  static constexpr size_t NPOS = ~static_cast<size_t>(0);
+
+  // ctor for a table with room for initialCapacity inquiries before it grows
+  explicit InquiryTable(size_t initialCapacity = 1024);
+
+  // Find the record index for an inquiry id, or NPOS
+  size_t Find(const string &inquiryId) const;
+
+  // Insert an inquiry whose id is not in the table; returns its record index
+  size_t Insert(const Inquiry<Bond> &inquiry);
+
+  // Erase an inquiry; its record index may be reused by the next Insert
+  void Erase(const string &inquiryId);
+
+  // Get the inquiry on a record index
+  Inquiry<Bond>& Get(size_t record);
+
+  // Number of live inquiries
+  size_t Size() const;
+
+private:
+  static constexpr uint32_t EMPTY = ~static_cast<uint32_t>(0);
+  static constexpr uint32_t TOMBSTONE = EMPTY - 1;
+
+  struct Bucket
+  {
+    uint64_t hash;
+    uint32_t record;
+  };
+
+  size_t FindBucket(const string &inquiryId, uint64_t h) const;
+  void Rehash(size_t bucketCount);
+
+  vector<Bucket> buckets;
+  vector<Inquiry<Bond>> records;
+  vector<uint32_t> freeRecords;
+  size_t live;
+  size_t used;
+
+};
+
+InquiryTable::InquiryTable(size_t initialCapacity) : live(0), used(0)
+{
+  size_t bucketCount = 16;
+  while (bucketCount < initialCapacity * 2) bucketCount <<= 1;
+  buckets.assign(bucketCount, Bucket{0, EMPTY});
+  records.reserve(initialCapacity);
+}
+
+inline size_t InquiryTable::FindBucket(const string &inquiryId, uint64_t h) const
+{
+  size_t mask = buckets.size() - 1;
+  for (size_t i = h & mask; ; i = (i + 1) & mask) {
+    const Bucket &bucket = buckets[i];
+    if (bucket.record == EMPTY) {
+      return NPOS;
+    }
+    if (bucket.record != TOMBSTONE && bucket.hash == h && records[bucket.record].GetInquiryId() == inquiryId) {
+      return i;
+    }
+  }
+}
+
+inline size_t InquiryTable::Find(const string &inquiryId) const
+{
+  size_t bucket = FindBucket(inquiryId, hash<string>()(inquiryId));
+  return (bucket == NPOS) ? NPOS : buckets[bucket].record;
+}
+
+inline size_t InquiryTable::Insert(const Inquiry<Bond> &inquiry)
+{
+  if ((used + 1) * 10 > buckets.size() * 7) {
+    // Grow only if live entries, not tombstones, are filling the table
+    Rehash((live + 1) * 10 > buckets.size() * 5 ? buckets.size() * 2 : buckets.size());
+  }
+
+  uint32_t record;
+  if (!freeRecords.empty()) {
+    record = freeRecords.back();
+    freeRecords.pop_back();
+    records[record] = inquiry;
+  }
+  else {
+    record = static_cast<uint32_t>(records.size());
+    records.push_back(inquiry);
+  }
+
+  uint64_t h = hash<string>()(inquiry.GetInquiryId());
+  size_t mask = buckets.size() - 1;
+  size_t i = h & mask;
+  while (buckets[i].record != EMPTY && buckets[i].record != TOMBSTONE) {
+    i = (i + 1) & mask;
+  }
+  if (buckets[i].record == EMPTY) {
+    ++used;
+  }
+  buckets[i] = Bucket{h, record};
+  ++live;
+  return record;
+}
+
+inline void InquiryTable::Erase(const string &inquiryId)
+{
+  size_t bucket = FindBucket(inquiryId, hash<string>()(inquiryId));
+  if (bucket == NPOS) {
+    return;
+  }
+  freeRecords.push_back(buckets[bucket].record);
+  buckets[bucket].record = TOMBSTONE;
+  --live;
+}
+
+inline Inquiry<Bond>& InquiryTable::Get(size_t record)
+{
+  return records[record];
+}
+
+inline size_t InquiryTable::Size() const
+{
+  return live;
+}
+
+void InquiryTable::Rehash(size_t bucketCount)
+{
+  vector<Bucket> old;
+  old.swap(buckets);
+  buckets.assign(bucketCount, Bucket{0, EMPTY});
+  size_t mask = bucketCount - 1;
+  for (const Bucket &bucket : old) {
+    if (bucket.record == EMPTY || bucket.record == TOMBSTONE) continue;
+    size_t i = bucket.hash & mask;
+    while (buckets[i].record != EMPTY) {
+      i = (i + 1) & mask;
+    }
+    buckets[i] = bucket;
+  }
+  used = live;
+}
+
+/**
+ * Fixed-size ring of the most recent inquiries to reach a terminal state; once
+ * it is full each new inquiry overwrites the oldest, so memory stays flat
+ * however long the session runs. The historical data service keeps the full
+ * record. Ids are stored inline, cut to ID_LENGTH characters, and products are
+ * interned, so each entry is a fixed 48 bytes.
+ */
+class InquiryArchive
+{
+
+public:
+
+  static constexpr size_t DEFAULT_CAPACITY = 4096;
+  static constexpr size_t ID_LENGTH = 23;
+
+  // ctor for an archive keeping the last capacity inquiries
+  explicit InquiryArchive(size_t _capacity = DEFAULT_CAPACITY);
+
+  // Archive an inquiry
+  void Add(const Inquiry<Bond> &inquiry);
+
+  // Number of inquiries kept, at most the capacity; index 0 is the oldest
+  size_t Size() const;
+
+  // Number of inquiries ever archived
+  uint64_t GetTotal() const;
+
+  string GetInquiryId(size_t i) const;
+  const string& GetProductId(size_t i) const;
+  Side GetSide(size_t i) const;
+  long GetQuantity(size_t i) const;
+  double GetPrice(size_t i) const;
+  InquiryState GetState(size_t i) const;
+
+private:
+  struct Entry
+  {
+    char id[ID_LENGTH + 1];
+    uint32_t productIndex;
+    uint8_t side;
+    uint8_t state;
+    long quantity;
+    double price;
+  };
+
+  const Entry& At(size_t i) const;
+
+  vector<Entry> entries;
+  uint64_t total;
+  vector<string> products;
+  unordered_map<string, uint32_t> productIndex;
+
+};
+
+InquiryArchive::InquiryArchive(size_t _capacity) :
+  entries(_capacity), total(0)
+{
+}
+
+inline void InquiryArchive::Add(const Inquiry<Bond> &inquiry)
+{
+  if (entries.empty()) {
+    return;
+  }
+  const string &productId = inquiry.GetProduct().GetProductId();
+  auto it = productIndex.find(productId);
+  if (it == productIndex.end()) {
+    it = productIndex.emplace(productId, static_cast<uint32_t>(products.size())).first;
+    products.push_back(productId);
+  }
+
+  Entry &entry = entries[total % entries.size()];
+  const string &inquiryId = inquiry.GetInquiryId();
+  size_t idLength = min(inquiryId.size(), ID_LENGTH);
+  memcpy(entry.id, inquiryId.data(), idLength);
+  entry.id[idLength] = '\0';
+  entry.productIndex = it->second;
+  entry.side = static_cast<uint8_t>(inquiry.GetSide());
+  entry.state = static_cast<uint8_t>(inquiry.GetState());
+  entry.quantity = inquiry.GetQuantity();
+  entry.price = inquiry.GetPrice();
+  ++total;
+}
+
+inline size_t InquiryArchive::Size() const
+{
+  return static_cast<size_t>(min<uint64_t>(total, entries.size()));
+}
+
+inline uint64_t InquiryArchive::GetTotal() const
+{
+  return total;
+}
+
+inline const InquiryArchive::Entry& InquiryArchive::At(size_t i) const
+{
+  return entries[(total - Size() + i) % entries.size()];
+}
+
+inline string InquiryArchive::GetInquiryId(size_t i) const
+{
+  return string(At(i).id);
+}
+
+inline const string& InquiryArchive::GetProductId(size_t i) const
+{
+  return products[At(i).productIndex];
+}
+
+inline Side InquiryArchive::GetSide(size_t i) const
+{
+  return static_cast<Side>(At(i).side);
+}
+
+inline long InquiryArchive::GetQuantity(size_t i) const
+{
+  return At(i).quantity;
+}
+
+inline double InquiryArchive::GetPrice(size_t i) const
+{
+  return At(i).price;
+}
+
+inline InquiryState InquiryArchive::GetState(size_t i) const
+{
+  return static_cast<InquiryState>(At(i).state);
+}
+
+/**
+ * Inquiry state machine over one InquiryTable: quotes new inquiries, validates
+ * each transition against INQUIRY_TRANSITIONS, notifies listeners exactly once
+ * per transition and retires terminal inquiries to an InquiryArchive.
+ * A book is single-threaded; the sharded service runs one per worker thread and
+ * passes a mutex to serialize listener and connector callbacks.
+ * Each open inquiry holds one timer on a TimerWheel; expired inquiries are
+ * rejected through the normal transition path.
+ */
+class InquiryBook
+{
+
+public:
+
+  // ctor for a book notifying the given listeners, under notifyMutex if it is set
+  InquiryBook(const InquiryQuoter &_quoter, const InquiryTimeouts &_timeouts, const vector<ServiceListener<Inquiry<Bond>>*> &_listeners,
+              mutex *_notifyMutex);
+
+  // Process a client message: a new inquiry, or a reply to our quote
+  void OnMessage(const Inquiry<Bond> &data);
+
+  void SendQuote(const string &inquiryId, double price);
+  void RejectInquiry(const string &inquiryId);
+
+  // Get a live inquiry
+  Inquiry<Bond>& GetData(const string &inquiryId);
+
+  void SetConnector(Connector<Inquiry<Bond>> *_connector);
+
+  // Reject every inquiry whose TTL has run out by now
+  void ExpireInquiries(TimerWheel::Clock::time_point now);
+
+  const InquiryTable& GetTable() const;
+  const InquiryArchive& GetArchive() const;
+
+private:
+  size_t FindInquiry(const string &inquiryId) const;
+  bool Transition(size_t record, InquiryState state);
+  void Notify(Inquiry<Bond> &inquiry, bool isNew, bool publish);
+  void StartTimer(size_t record, chrono::milliseconds ttl);
+  void StopTimer(size_t record);
+
+  InquiryTable table;
+  InquiryArchive archive;
+  InquiryQuoter quoter;
+  const vector<ServiceListener<Inquiry<Bond>>*> &listeners;
+  mutex *notifyMutex;
+  Connector<Inquiry<Bond>> *connector;
+  InquiryTimeouts timeouts;
+  TimerWheel timers;
+  vector<uint32_t> timerHandles;
+
+};
+
+InquiryBook::InquiryBook(const InquiryQuoter &_quoter, const InquiryTimeouts &_timeouts,
+                         const vector<ServiceListener<Inquiry<Bond>>*> &_listeners, mutex *_notifyMutex) :
+  quoter(_quoter), listeners(_listeners), notifyMutex(_notifyMutex), connector(nullptr),
+  timeouts(_timeouts), timers(_timeouts.tick)
+{
+}
+
+inline void InquiryBook::StartTimer(size_t record, chrono::milliseconds ttl)
+{
+  if (record >= timerHandles.size()) {
+    timerHandles.resize(record + 1, TimerWheel::NONE);
+  }
+  StopTimer(record);
+  if (ttl > chrono::milliseconds::zero()) {
+    timerHandles[record] = timers.Schedule(ttl, record);
+  }
+}
+
+inline void InquiryBook::StopTimer(size_t record)
+{
+  if (record < timerHandles.size() && timerHandles[record] != TimerWheel::NONE) {
+    timers.Cancel(timerHandles[record]);
+    timerHandles[record] = TimerWheel::NONE;
+  }
+}
+
+inline void InquiryBook::ExpireInquiries(TimerWheel::Clock::time_point now)
+{
+  timers.Advance(now, [this](uint64_t record) {
+    timerHandles[record] = TimerWheel::NONE;
+    Transition(static_cast<size_t>(record), REJECTED);
+  });
+}
+
+inline size_t InquiryBook::FindInquiry(const string &inquiryId) const
+{
+  size_t record = table.Find(inquiryId);
+  if (record == InquiryTable::NPOS) {
+    throw runtime_error("Inquiry key not found: " + inquiryId);
+  }
+  return record;
+}
+
+inline void InquiryBook::Notify(Inquiry<Bond> &inquiry, bool isNew, bool publish)
+{
+  unique_lock<mutex> lock;
+  if (notifyMutex) {
+    lock = unique_lock<mutex>(*notifyMutex);
+  }
+
+  for (auto listener : listeners) {
+    if (isNew) {
+      listener->ProcessAdd(inquiry);
+    }
+    else {
+      listener->ProcessUpdate(inquiry);
+    }
+  }
+  if (publish && connector) {
+    connector->Publish(inquiry);
+  }
+}
+
+inline bool InquiryBook::Transition(size_t record, InquiryState state)
+{
+  Inquiry<Bond> &inquiry = table.Get(record);
+  if (!INQUIRY_TRANSITIONS[inquiry.GetState()][state]) {
+    cerr << "Invalid inquiry transition for " << inquiry.GetInquiryId() << ": " << inquiry.GetState() << " -> " << state << endl;
+    return false;
+  }
+
+  inquiry.SetState(state);
+  Notify(inquiry, false, state == QUOTED || state == REJECTED);
+
+  if (state == QUOTED) {
+    StartTimer(record, timeouts.quotedTtl);
+  }
+  else if (state == DONE || state == REJECTED || state == CUSTOMER_REJECTED) {
+    StopTimer(record);
+    archive.Add(inquiry);
+    table.Erase(inquiry.GetInquiryId());
+  }
+  return true;
+}
+
+inline void InquiryBook::OnMessage(const Inquiry<Bond> &data)
+{
+  ExpireInquiries(TimerWheel::Clock::now());
+
+  const string &inquiryId = data.GetInquiryId();
+  size_t record = table.Find(inquiryId);
+
+  if (record == InquiryTable::NPOS) {
+    if (data.GetState() != RECEIVED) {
+      cerr << "Ignoring unknown inquiry " << inquiryId << " in state " << data.GetState() << endl;
+      return;
+    }
+
+    record = table.Insert(data);
+    StartTimer(record, timeouts.receivedTtl);
+    Notify(table.Get(record), true, false);
+
+    double price;
+    if (quoter.Quote(table.Get(record), price)) {
+      SendQuote(inquiryId, price);
+    }
+    else {
+      RejectInquiry(inquiryId);
+    }
+    return;
+  }
+
+  // The client echoes a quote back to accept it
+  InquiryState state = (data.GetState() == QUOTED) ? DONE : data.GetState();
+  Transition(record, state);
+}
+
+inline void InquiryBook::SendQuote(const string &inquiryId, double price)
+{
+  size_t record = FindInquiry(inquiryId);
+  Inquiry<Bond> &inquiry = table.Get(record);
+  double previousPrice = inquiry.GetPrice();
+  inquiry.SetPrice(price);
+  if (!Transition(record, QUOTED)) {
+    inquiry.SetPrice(previousPrice);
+  }
+}
+
+inline void InquiryBook::RejectInquiry(const string &inquiryId)
+{
+  Transition(FindInquiry(inquiryId), REJECTED);
+}
+
+inline Inquiry<Bond>& InquiryBook::GetData(const string &inquiryId)
+{
+  return table.Get(FindInquiry(inquiryId));
+}
+
+inline void InquiryBook::SetConnector(Connector<Inquiry<Bond>> *_connector)
+{
+  connector = _connector;
+}
+
+inline const InquiryTable& InquiryBook::GetTable() const
+{
+  return table;
+}
+
+inline const InquiryArchive& InquiryBook::GetArchive() const
+{
+  return archive;
+}
+
+/**
+ * Bond inquiry service. Runs a single InquiryBook on the caller's thread; see
+ * BondShardedInquiryService for the multi-threaded mode. Inquiries that reach a
+ * terminal state are retired from GetData into the archive, which keeps the most
+ * recent ones. Expiry runs on each OnMessage; call ExpireInquiries to drive it
+ * while no messages arrive.
+ */
 class BondInquiryService : public InquiryService<Bond>
 {
 private: 
-  map<string, Inquiry<Bond>> inquiryMap;
   vector<ServiceListener<Inquiry<Bond>>*> listeners;
-  //Connector<Inquiry<Bond>>* connector;
+  InquiryBook book;
 
 public:
-  BondInquiryService();
+  BondInquiryService(BondPricingService *pricingService, BondPositionService *positionService = nullptr,
+                     BondRiskService *riskService = nullptr,
+                     const InquiryQuoteParameters &parameters = InquiryQuoteParameters(),
+                     const InquiryTimeouts &timeouts = InquiryTimeouts());
   Inquiry<Bond>& GetData(string key) override;
   void OnMessage(Inquiry<Bond> &data) override;
   void AddListener(ServiceListener<Inquiry<Bond>>* listener) override;
   const vector<ServiceListener<Inquiry<Bond>>*>& GetListeners() const override;
   void SendQuote(const string& inquiryId, double price) override;
   void RejectInquiry(const string& inquiryId) override;
+  void SetConnector(Connector<Inquiry<Bond>>* connector) override;
+  void Flush() override;
+
+  // Inquiries that reached a terminal state
+  const InquiryArchive& GetArchive() const;
+
+  // Reject every inquiry whose TTL has run out
+  void ExpireInquiries();
 
 };
 
-BondInquiryService::BondInquiryService()
+BondInquiryService::BondInquiryService(BondPricingService *pricingService, BondPositionService *positionService,
+                                       BondRiskService *riskService, const InquiryQuoteParameters &parameters,
+                                       const InquiryTimeouts &timeouts) :
+  book(InquiryQuoter(pricingService, positionService, riskService, parameters), timeouts, listeners, nullptr)
 {
-  //connector = _connector;
 }
 
 inline Inquiry<Bond>& BondInquiryService::GetData(string key)
 {
-  return inquiryMap.at(key);
+  return book.GetData(key);
 }
 
 inline void BondInquiryService::OnMessage(Inquiry<Bond> &data)
 {
-  string inquiryId = data.GetInquiryId();
-  auto it = inquiryMap.find(inquiryId);
-  bool isNew = (it == inquiryMap.end());
-  
-  inquiryMap.emplace(inquiryId, data);
-  
-  if (data.GetState() == RECEIVED) {
-    SendQuote(inquiryId, 100.0);
-  }
-  else if (data.GetState() == QUOTED) {
-    data.SetState(DONE);
-
-  }
-  // }
-  for (auto listener : listeners) {
-    if (isNew) {
-      listener->ProcessAdd(data);
-    }
-    else {
-      listener->ProcessUpdate(data);
-    }
-  }
-  
-  
+  book.OnMessage(data);
 }
 
 inline void BondInquiryService::AddListener(ServiceListener<Inquiry<Bond>>* listener)
@@ -209,51 +808,82 @@ inline const vector<ServiceListener<Inquiry<Bond>>*>& BondInquiryService::GetLis
   return listeners;
 }
 
-inline void BondInquiryService::SendQuote(const string& inquiryId, double price)
+inline void BondInquiryService::SetConnector(Connector<Inquiry<Bond>>* connector)
 {
-  auto& inquiry = inquiryMap.at(inquiryId);
-  Inquiry<Bond> quotedInquiry(inquiryId, inquiry.GetProduct(), inquiry.GetSide(), inquiry.GetQuantity(), price, QUOTED);
-  
-  //connector->Publish(quotedInquiry);
-  OnMessage(quotedInquiry);
+  book.SetConnector(connector);
+}
 
-  Inquiry<Bond> doneInquiry(inquiryId, inquiry.GetProduct(), inquiry.GetSide(), inquiry.GetQuantity(), price, DONE);
-  OnMessage(doneInquiry);
+inline void BondInquiryService::Flush()
+{
+}
+
+inline void BondInquiryService::SendQuote(const string& inquiryId, double price)
+{
+  book.SendQuote(inquiryId, price);
 }
 
 inline void BondInquiryService::RejectInquiry(const string& inquiryId)
 {
-  auto& inquiry = inquiryMap.at(inquiryId);
-  Inquiry<Bond> rejectedInquiry(inquiryId, inquiry.GetProduct(), inquiry.GetSide(), inquiry.GetQuantity(), inquiry.GetPrice(), REJECTED);
-  
-  //connector->Publish(rejectedInquiry);
+  book.RejectInquiry(inquiryId);
+}
 
-  for (auto listener : listeners) {
-    listener->ProcessUpdate(rejectedInquiry);
-  }
+inline const InquiryArchive& BondInquiryService::GetArchive() const
+{
+  return book.GetArchive();
+}
+
+inline void BondInquiryService::ExpireInquiries()
+{
+  book.ExpireInquiries(TimerWheel::Clock::now());
 }
 
+/**
+ * Inquiry connector reading client inquiries from a file. Quotes published back
+ * to it are accepted by the simulated client once the current inquiry has been
+ * processed, so the service is never re-entered from inside its own callbacks.
+ * Publish may be called from the sharded service's worker threads.
+ */
 class InquiryConnector : public Connector<Inquiry<Bond>>
 {
 private: 
-  BondInquiryService *service;
+  InquiryService<Bond> *service;
   BondProductService *bondProductService;
   string filename;
+  mutex repliesMutex;
+  vector<Inquiry<Bond>> pendingReplies;
+
+  bool DrainReplies();
 
 public: 
-  InquiryConnector(BondInquiryService *_service, BondProductService *_bondProductService, const string& filename) 
-                  : service(_service), bondProductService(_bondProductService), filename(filename) {}
+  InquiryConnector(InquiryService<Bond> *_service, BondProductService *_bondProductService, const string& filename) 
+                  : service(_service), bondProductService(_bondProductService), filename(filename)
+  {
+    service->SetConnector(this);
+  }
   void Publish(Inquiry<Bond> &inquiry) override;
   void Subscribe();
 
 };
 
-// InquiryConnector::InquiryConnector(BondInquiryService &_service, BondProductService &_bondProductService) 
-//                   : service(_service), bondProductService(_bondProductService) {}
-
 inline void InquiryConnector::Publish(Inquiry<Bond> &inquiry)
 {
-  service->OnMessage(inquiry);
+  if (inquiry.GetState() == QUOTED) {
+    lock_guard<mutex> lock(repliesMutex);
+    pendingReplies.push_back(inquiry);
+  }
+}
+
+inline bool InquiryConnector::DrainReplies()
+{
+  vector<Inquiry<Bond>> replies;
+  {
+    lock_guard<mutex> lock(repliesMutex);
+    replies.swap(pendingReplies);
+  }
+  for (size_t i = 0; i < replies.size(); ++i) {
+    service->OnMessage(replies[i]);
+  }
+  return !replies.empty();
 }
 
 inline void InquiryConnector::Subscribe()
@@ -278,8 +908,9 @@ inline void InquiryConnector::Subscribe()
       else { side = SELL; }
 
       Bond bond = bondProductService->GetData(productId);
-      Inquiry<Bond> inquiry(inquiryId, bond, BUY, quantity, 0.0, RECEIVED);
+      Inquiry<Bond> inquiry(inquiryId, bond, side, quantity, 0.0, RECEIVED);
       service->OnMessage(inquiry);
+      DrainReplies();
     }
     else {
       cerr << "Invalid line format in " << filename << ": " << line << endl;
@@ -287,6 +918,11 @@ inline void InquiryConnector::Subscribe()
   }
 
   file.close();
+
+  // Quotes from an asynchronous service may still be in flight
+  do {
+    service->Flush();
+  } while (DrainReplies());
 }
 
 #endif
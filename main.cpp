@@ -13,6 +13,12 @@
 #include "marketdataservice.hpp"
 #include "algoexecutionservice.hpp"
 #include "executionservice.hpp"
+#include "pnlservice.hpp"
+#include "risktree.hpp"
+#include "varservice.hpp"
+#include "curveservice.hpp"
+#include "positioncheckpoint.hpp"
+#include "scenarioengine.hpp"
 
 int main()
 {
@@ -34,11 +40,19 @@ int main()
     BondStreamingService* bondStreamingService = new BondStreamingService(nullptr); // Replace nullptr with an appropriate connector
     BondStreamingHistoricalDataService* bondStreamingHistoricalService = new BondStreamingHistoricalDataService();
     GUIService* gui = new GUIService("gui.txt");
-    BondInquiryService* inquiryService = new BondInquiryService();
     BondInquiryHistoricalDataService* inquiryHistoricalService = new BondInquiryHistoricalDataService();
-    BondTradeBookingService* bondTradeBookingService = new BondTradeBookingService();
+    // The journal survives restarts; an existing one is reloaded rather than replaced
+    BondTradeBookingService* bondTradeBookingService = new BondTradeBookingService(0, "trades.journal", bondProductService);
     BondPositionService* bondPositionService = new BondPositionService();
     BondRiskService* bondRiskService = new BondRiskService(*bondPricingService);
+    BondInquiryService* inquiryService = new BondInquiryService(bondPricingService, bondPositionService, bondRiskService);
+    BondPnLService* pnlService = new BondPnLService(*bondTradeBookingService);
+    BondRiskTree* riskTree = new BondRiskTree(bondRiskService);
+    WorkStealingPool* workPool = new WorkStealingPool();
+    BondVaRService* varService = new BondVaRService(*workPool);
+    BondCurveService* curveService = new BondCurveService({bondProductService->GetData("T2Y"), bondProductService->GetData("T3Y"),
+        bondProductService->GetData("T5Y"), bondProductService->GetData("T7Y"), bondProductService->GetData("T10Y"),
+        bondProductService->GetData("T20Y"), bondProductService->GetData("T30Y")});
     BondPositionHistoricalDataService* positionHistoricalService = new BondPositionHistoricalDataService();
     BondRiskHistoricalDataService* riskHistoricalService = new BondRiskHistoricalDataService();
     BondMarketDataService* bondMarketDataService = new BondMarketDataService();
@@ -50,21 +64,51 @@ int main()
     bondPricingService->AddListener(bondAlgoStreamingService);
     bondAlgoStreamingService->AddListener(bondStreamingService);
     bondStreamingService->AddListener(bondStreamingHistoricalService);
-    bondPricingService->AddListener(gui);
+    bondPricingService->AddTickListener(gui);
     inquiryService->AddListener(inquiryHistoricalService);
     bondTradeBookingService->AddListener(bondPositionService);
+    bondTradeBookingService->AddListener(pnlService);
+    bondPricingService->AddListener(pnlService);
     bondPositionService->AddListener(bondRiskService);
-    bondPositionService->AddListener(positionHistoricalService);
+    bondPricingService->AddListener(bondRiskService);
+    bondPositionService->AddDeltaListener(positionHistoricalService);
     bondRiskService->AddListener(riskHistoricalService);
+    bondRiskService->AddBucketListener(riskHistoricalService);
+    bondPositionService->AddDeltaListener(riskTree);
+    bondRiskService->AddListener(riskTree);
+    bondPricingService->AddListener(varService);
+    bondPricingService->AddListener(curveService);
+    bondPositionService->AddDeltaListener(varService);
     bondMarketDataService->AddListener(algoExecutionService);
     algoExecutionService->AddListener(bondExecutionService);
     bondExecutionService->AddListener(executionHistoricalService);
     bondExecutionService->AddListener(bondTradeBookingService);
 
+    // Treasury books roll up to the rates desk
+    riskTree->AddNode("RATES");
+    riskTree->AssignBook("TRSY1", "RATES");
+    riskTree->AssignBook("TRSY2", "RATES");
+    riskTree->AssignBook("TRSY3", "RATES");
+
+    // Risk buckets along the curve
+    bondRiskService->AddBucket(BucketedSector<Bond>({bondProductService->GetData("T2Y"), bondProductService->GetData("T3Y")}, "FrontEnd"));
+    bondRiskService->AddBucket(BucketedSector<Bond>({bondProductService->GetData("T5Y"), bondProductService->GetData("T7Y"), bondProductService->GetData("T10Y")}, "Belly"));
+    bondRiskService->AddBucket(BucketedSector<Bond>({bondProductService->GetData("T20Y"), bondProductService->GetData("T30Y")}, "LongEnd"));
+
     // 3) Create and link connectors
     BondPricingConnector* pricingConnector = new BondPricingConnector(bondPricingService, "prices.txt", bondProductService);
     pricingConnector->Subscribe();
 
+    // Pick up where the last run left off: the latest checkpoint plus the journal after it
+    uint64_t replayed = PositionCheckpointer::Restore("positions.checkpoint", *bondProductService, *bondTradeBookingService,
+                                                      *bondPositionService, *bondRiskService, pnlService);
+    std::cout << "Restored positions, replayed " << replayed << " journaled trades." << std::endl;
+
+    // The checkpointer captures between bookings, so it listens last
+    PositionCheckpointer* checkpointer = new PositionCheckpointer(bondTradeBookingService, bondPositionService,
+                                                                  bondRiskService, "positions.checkpoint");
+    bondTradeBookingService->AddListener(checkpointer);
+
     InquiryConnector* inquiryConnector = new InquiryConnector(inquiryService, bondProductService, "inquiries.txt");
     inquiryConnector->Subscribe();
 
@@ -74,10 +118,32 @@ int main()
     MarketDataConnector* marketDataConnector = new MarketDataConnector(bondMarketDataService, bondProductService, "marketdata.txt");
     marketDataConnector->Subscribe();
 
+    // End-of-day scenarios: parallel shifts, a steepener and key-rate bumps over the book
+    BondScenarioEngine scenarioEngine(*workPool);
+    scenarioEngine.LoadPositions(*bondPositionService, *bondPricingService);
+    scenarioEngine.AddScenario(CurveShock::Parallel("PAR-100BP", -0.01));
+    scenarioEngine.AddScenario(CurveShock::Parallel("PAR+100BP", 0.01));
+    scenarioEngine.AddScenario(CurveShock::Twist("STEEPENER", -0.0025, 0.0025));
+    scenarioEngine.AddKeyRateScenarios(0.0001);
+    scenarioEngine.Run();
+    for (size_t s = 0; s < scenarioEngine.GetScenarioCount(); ++s) {
+        std::cout << "Scenario " << scenarioEngine.GetScenario(s).name << " P&L: " << scenarioEngine.GetScenarioTotal(s) << std::endl;
+    }
+
+    // The remark thread flushes dirty risk while running; catch the last ticks before the checkpoint
+    bondRiskService->RemarkDirty();
+
+    // Checkpoint at shutdown, so the next start has nothing to replay
+    checkpointer->Checkpoint();
+    checkpointer->Flush();
+
     // Indicate completion
     std::cout << "All processes completed. Check output files for results." << std::endl;
 
     // 4) Clean up
+    delete checkpointer;
+    // The risk service's remark thread reads prices and notifies the risk tree and history, so it stops first
+    delete bondRiskService;
     delete bondPricingService;
     delete bondAlgoStreamingService;
     delete bondStreamingService;
@@ -87,7 +153,11 @@ int main()
     delete inquiryHistoricalService;
     delete bondTradeBookingService;
     delete bondPositionService;
-    delete bondRiskService;
+    delete pnlService;
+    delete riskTree;
+    delete varService;
+    delete workPool;
+    delete curveService;
     delete positionHistoricalService;
     delete riskHistoricalService;
     delete bondMarketDataService;
@@ -0,0 +1,444 @@
+/**
+ * pnlservice.hpp
+ * Real-time P&L: joins booked trades with live marks, keeping realized and
+ * mark-to-market P&L per instrument and book with running book, desk and firm
+ * totals.
+ */
+#ifndef PNL_SERVICE_HPP
+#define PNL_SERVICE_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "soa.hpp"
+#include "products.hpp"
+#include "pricingservice.hpp"
+#include "tradebookingservice.hpp"
+
+using namespace std;
+
+/**
+ * Realized and unrealized (mark-to-market) P&L, in currency.
+ */
+struct PnL
+{
+  double realized = 0.0;
+  double unrealized = 0.0;
+
+  double GetTotal() const { return realized + unrealized; }
+};
+
+/**
+ * P&L service listening to the trade booking service and the pricing service.
+ * Each instrument/book cell tracks position, average cost and realized P&L;
+ * unrealized P&L is position * (mark - average cost). Prices are quoted per 100
+ * of face, so P&L is quantity * price difference / 100.
+ *
+ * A new trade updates its cell and the running totals in O(1). A price tick
+ * revalues only the books currently holding the instrument. Book, desk and firm
+ * totals are kept as running sums, so every Get is O(1). Books belong to the
+ * desk set by AssignBook, or to DEFAULT_DESK.
+ *
+ * Each cell keeps the journal sequence numbers of its live trades in booking
+ * order, 8 bytes a trade; the trades themselves stay in the booking service's
+ * journal. A removed trade (a cancel, or the old version of an amend) is
+ * dropped and the cell is rebuilt from the journal records left, so the trade
+ * is undone rather than closed out at its price. Cancels and amends therefore
+ * cost O(live trades in the cell), not O(1).
+ * P&L is not checkpointed: after a restart, Rebuild replays every live trade in
+ * the journal.
+ */
+class BondPnLService : public ServiceListener<Trade<Bond>>, public ServiceListener<Price<Bond>>
+{
+
+public:
+
+  static constexpr const char *DEFAULT_DESK = "UNASSIGNED";
+  static constexpr double PRICE_SCALE = 0.01;
+
+  // ctor for a service listening to, and reading trades back from, a trade booking service
+  explicit BondPnLService(const BondTradeBookingService &_tradeBookingService);
+
+  // Put a book under a desk, moving its P&L to the desk's total
+  void AssignBook(const string &book, const string &desk);
+
+  // P&L of one instrument in one book, of a book, of a desk, and of the firm
+  PnL GetPnL(const string &productId, const string &book) const;
+  PnL GetBookPnL(const string &book) const;
+  PnL GetDeskPnL(const string &desk) const;
+  const PnL& GetFirmPnL() const;
+
+  // Position and average cost of one instrument in one book
+  long GetPosition(const string &productId, const string &book) const;
+  double GetAverageCost(const string &productId, const string &book) const;
+
+  // Reset every cell and book the journal's live trades in journal order
+  void Rebuild();
+
+  // Trades: adds and updates book a trade, removes undo it
+  void ProcessAdd(Trade<Bond> &data) override;
+  void ProcessRemove(Trade<Bond> &data) override;
+  void ProcessUpdate(Trade<Bond> &data) override;
+
+  // Prices: every new price is a new mark
+  void ProcessAdd(Price<Bond> &data) override;
+  void ProcessRemove(Price<Bond> &data) override;
+  void ProcessUpdate(Price<Bond> &data) override;
+
+private:
+  static constexpr uint32_t NPOS = ~static_cast<uint32_t>(0);
+
+  struct Cell
+  {
+    long position;
+    double averageCost;
+    double realized;
+    double unrealized;
+    uint32_t holderIndex;
+    vector<uint64_t> trades;
+  };
+
+  uint32_t InternInstrument(const string &productId);
+  uint32_t InternBook(const string &book);
+  uint32_t InternDesk(const string &desk);
+  uint32_t FindInstrument(const string &productId) const;
+  uint32_t FindBook(const string &book) const;
+  const Cell* FindCell(const string &productId, const string &book) const;
+  void ResizeBooks(size_t newStride);
+  static double Fill(Cell &cell, long quantity, double price);
+  static long SignedQuantity(Side side, long quantity);
+  void AddTrade(const Trade<Bond> &trade, uint64_t sequence);
+  void RemoveTrade(const Trade<Bond> &trade, uint64_t sequence);
+  void Settle(uint32_t instrument, uint32_t book, long previousPosition, double realized);
+  void AddToTotals(uint32_t book, double realized, double unrealized);
+
+  const BondTradeBookingService &tradeBookingService;
+
+  // Cells are instrument-major with stride columns
+  vector<Cell> cells;
+  size_t stride;
+
+  unordered_map<string, uint32_t> instrumentIds;
+  vector<double> marks;
+  vector<bool> marked;
+  vector<vector<uint32_t>> holders;
+
+  unordered_map<string, uint32_t> bookIds;
+  vector<PnL> bookTotals;
+  vector<uint32_t> bookDesks;
+
+  unordered_map<string, uint32_t> deskIds;
+  vector<PnL> deskTotals;
+
+  PnL firmTotal;
+
+};
+
+BondPnLService::BondPnLService(const BondTradeBookingService &_tradeBookingService) :
+  tradeBookingService(_tradeBookingService), stride(16)
+{
+  InternDesk(DEFAULT_DESK);
+}
+
+inline uint32_t BondPnLService::InternInstrument(const string &productId)
+{
+  auto it = instrumentIds.find(productId);
+  if (it != instrumentIds.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(marks.size());
+  instrumentIds.emplace(productId, id);
+  marks.push_back(0.0);
+  marked.push_back(false);
+  holders.emplace_back();
+  cells.resize(cells.size() + stride, Cell{0, 0.0, 0.0, 0.0, NPOS, {}});
+  return id;
+}
+
+inline uint32_t BondPnLService::InternBook(const string &book)
+{
+  auto it = bookIds.find(book);
+  if (it != bookIds.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(bookTotals.size());
+  if (id == stride) {
+    ResizeBooks(stride * 2);
+  }
+  bookIds.emplace(book, id);
+  bookTotals.emplace_back();
+  bookDesks.push_back(0);
+  return id;
+}
+
+inline uint32_t BondPnLService::InternDesk(const string &desk)
+{
+  auto it = deskIds.find(desk);
+  if (it != deskIds.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(deskTotals.size());
+  deskIds.emplace(desk, id);
+  deskTotals.emplace_back();
+  return id;
+}
+
+inline uint32_t BondPnLService::FindInstrument(const string &productId) const
+{
+  auto it = instrumentIds.find(productId);
+  return (it != instrumentIds.end()) ? it->second : NPOS;
+}
+
+inline uint32_t BondPnLService::FindBook(const string &book) const
+{
+  auto it = bookIds.find(book);
+  return (it != bookIds.end()) ? it->second : NPOS;
+}
+
+inline const BondPnLService::Cell* BondPnLService::FindCell(const string &productId, const string &book) const
+{
+  uint32_t instrument = FindInstrument(productId);
+  uint32_t bookId = FindBook(book);
+  if (instrument == NPOS || bookId == NPOS) {
+    return nullptr;
+  }
+  return &cells[instrument * stride + bookId];
+}
+
+void BondPnLService::ResizeBooks(size_t newStride)
+{
+  size_t rows = marks.size();
+  vector<Cell> newCells(rows * newStride, Cell{0, 0.0, 0.0, 0.0, NPOS, {}});
+  for (size_t row = 0; row < rows; ++row) {
+    move(cells.begin() + row * stride, cells.begin() + (row + 1) * stride, newCells.begin() + row * newStride);
+  }
+  cells.swap(newCells);
+  stride = newStride;
+}
+
+inline void BondPnLService::AddToTotals(uint32_t book, double realized, double unrealized)
+{
+  PnL &bookTotal = bookTotals[book];
+  PnL &deskTotal = deskTotals[bookDesks[book]];
+  bookTotal.realized += realized;
+  bookTotal.unrealized += unrealized;
+  deskTotal.realized += realized;
+  deskTotal.unrealized += unrealized;
+  firmTotal.realized += realized;
+  firmTotal.unrealized += unrealized;
+}
+
+void BondPnLService::AssignBook(const string &book, const string &desk)
+{
+  uint32_t bookId = InternBook(book);
+  uint32_t deskId = InternDesk(desk);
+  const PnL &bookTotal = bookTotals[bookId];
+  PnL &from = deskTotals[bookDesks[bookId]];
+  PnL &to = deskTotals[deskId];
+  from.realized -= bookTotal.realized;
+  from.unrealized -= bookTotal.unrealized;
+  to.realized += bookTotal.realized;
+  to.unrealized += bookTotal.unrealized;
+  bookDesks[bookId] = deskId;
+}
+
+double BondPnLService::Fill(Cell &cell, long quantity, double price)
+{
+  double realized = 0.0;
+  long position = cell.position;
+  if (position == 0 || (position > 0) == (quantity > 0)) {
+    // Adding to the position moves the average cost
+    double size = static_cast<double>(labs(position));
+    cell.averageCost = (cell.averageCost * size + price * labs(quantity)) / (size + labs(quantity));
+  }
+  else {
+    // Reducing realizes P&L on the closed part; flipping opens the rest at this price
+    long closed = min(labs(quantity), labs(position));
+    realized = closed * (price - cell.averageCost) * (position > 0 ? 1 : -1) * PRICE_SCALE;
+    if (labs(quantity) > labs(position)) {
+      cell.averageCost = price;
+    }
+  }
+  cell.position = position + quantity;
+  if (cell.position == 0) {
+    cell.averageCost = 0.0;
+  }
+  cell.realized += realized;
+  return realized;
+}
+
+void BondPnLService::Settle(uint32_t instrument, uint32_t book, long previousPosition, double realized)
+{
+  Cell &cell = cells[instrument * stride + book];
+
+  // Keep the list of books holding the instrument, for price ticks
+  vector<uint32_t> &holding = holders[instrument];
+  if (previousPosition == 0 && cell.position != 0) {
+    cell.holderIndex = static_cast<uint32_t>(holding.size());
+    holding.push_back(book);
+  }
+  else if (previousPosition != 0 && cell.position == 0) {
+    uint32_t last = holding.back();
+    holding[cell.holderIndex] = last;
+    cells[instrument * stride + last].holderIndex = cell.holderIndex;
+    holding.pop_back();
+    cell.holderIndex = NPOS;
+  }
+
+  double unrealized = marked[instrument] ? cell.position * (marks[instrument] - cell.averageCost) * PRICE_SCALE : 0.0;
+  AddToTotals(book, realized, unrealized - cell.unrealized);
+  cell.unrealized = unrealized;
+}
+
+inline long BondPnLService::SignedQuantity(Side side, long quantity)
+{
+  return (side == BUY) ? quantity : -quantity;
+}
+
+void BondPnLService::AddTrade(const Trade<Bond> &trade, uint64_t sequence)
+{
+  uint32_t instrument = InternInstrument(trade.GetProduct().GetProductId());
+  uint32_t book = InternBook(trade.GetBook());
+  Cell &cell = cells[instrument * stride + book];
+  long quantity = SignedQuantity(trade.GetSide(), trade.GetQuantity());
+
+  long previousPosition = cell.position;
+  cell.trades.push_back(sequence);
+  double realized = Fill(cell, quantity, trade.GetPrice());
+  Settle(instrument, book, previousPosition, realized);
+}
+
+void BondPnLService::RemoveTrade(const Trade<Bond> &trade, uint64_t sequence)
+{
+  uint32_t instrument = FindInstrument(trade.GetProduct().GetProductId());
+  uint32_t book = FindBook(trade.GetBook());
+  if (instrument == NPOS || book == NPOS) {
+    return;
+  }
+  Cell &cell = cells[instrument * stride + book];
+
+  // Cancels mostly hit recent trades, so look from the newest
+  auto found = find(cell.trades.rbegin(), cell.trades.rend(), sequence);
+  if (found == cell.trades.rend()) {
+    return;
+  }
+  cell.trades.erase(next(found).base());
+
+  // Rebuild the cell from the trades left, in booking order
+  const TradeJournal &journal = tradeBookingService.GetJournal();
+  long previousPosition = cell.position;
+  double previousRealized = cell.realized;
+  cell.position = 0;
+  cell.averageCost = 0.0;
+  cell.realized = 0.0;
+  for (uint64_t remaining : cell.trades) {
+    const JournalRecord &record = journal.Get(remaining);
+    Fill(cell, SignedQuantity(static_cast<Side>(record.side), record.quantity), record.price);
+  }
+  Settle(instrument, book, previousPosition, cell.realized - previousRealized);
+}
+
+void BondPnLService::Rebuild()
+{
+  const TradeJournal &journal = tradeBookingService.GetJournal();
+  for (Cell &cell : cells) {
+    cell = Cell{0, 0.0, 0.0, 0.0, NPOS, {}};
+  }
+  for (vector<uint32_t> &holding : holders) {
+    holding.clear();
+  }
+  fill(bookTotals.begin(), bookTotals.end(), PnL());
+  fill(deskTotals.begin(), deskTotals.end(), PnL());
+  firmTotal = PnL();
+
+  for (uint64_t sequence = 0; sequence < journal.Size(); ++sequence) {
+    if (journal.Get(sequence).type != JOURNAL_CANCEL && journal.IsCurrent(sequence)) {
+      AddTrade(journal.Materialize(sequence), sequence);
+    }
+  }
+}
+
+inline PnL BondPnLService::GetPnL(const string &productId, const string &book) const
+{
+  const Cell *cell = FindCell(productId, book);
+  PnL pnl;
+  if (cell) {
+    pnl.realized = cell->realized;
+    pnl.unrealized = cell->unrealized;
+  }
+  return pnl;
+}
+
+inline PnL BondPnLService::GetBookPnL(const string &book) const
+{
+  uint32_t bookId = FindBook(book);
+  return (bookId != NPOS) ? bookTotals[bookId] : PnL();
+}
+
+inline PnL BondPnLService::GetDeskPnL(const string &desk) const
+{
+  auto it = deskIds.find(desk);
+  return (it != deskIds.end()) ? deskTotals[it->second] : PnL();
+}
+
+inline const PnL& BondPnLService::GetFirmPnL() const
+{
+  return firmTotal;
+}
+
+inline long BondPnLService::GetPosition(const string &productId, const string &book) const
+{
+  const Cell *cell = FindCell(productId, book);
+  return cell ? cell->position : 0;
+}
+
+inline double BondPnLService::GetAverageCost(const string &productId, const string &book) const
+{
+  const Cell *cell = FindCell(productId, book);
+  return cell ? cell->averageCost : 0.0;
+}
+
+inline void BondPnLService::ProcessAdd(Trade<Bond> &data)
+{
+  AddTrade(data, tradeBookingService.GetCurrentSequence());
+}
+
+inline void BondPnLService::ProcessRemove(Trade<Bond> &data)
+{
+  // The record being booked is the amend or cancel; it links back to the version removed
+  const TradeJournal &journal = tradeBookingService.GetJournal();
+  RemoveTrade(data, journal.Get(tradeBookingService.GetCurrentSequence()).previousVersion);
+}
+
+inline void BondPnLService::ProcessUpdate(Trade<Bond> &data)
+{
+  ProcessAdd(data);
+}
+
+void BondPnLService::ProcessAdd(Price<Bond> &data)
+{
+  uint32_t instrument = InternInstrument(data.GetProduct().GetProductId());
+  double mark = data.GetMid();
+  marks[instrument] = mark;
+  marked[instrument] = true;
+
+  for (uint32_t book : holders[instrument]) {
+    Cell &cell = cells[instrument * stride + book];
+    double unrealized = cell.position * (mark - cell.averageCost) * PRICE_SCALE;
+    AddToTotals(book, 0.0, unrealized - cell.unrealized);
+    cell.unrealized = unrealized;
+  }
+}
+
+inline void BondPnLService::ProcessRemove(Price<Bond> &data)
+{
+}
+
+inline void BondPnLService::ProcessUpdate(Price<Bond> &data)
+{
+  ProcessAdd(data);
+}
+
+#endif
@@ -0,0 +1,391 @@
+/**
+ * positioncheckpoint.hpp
+ * Periodic binary checkpoints of positions and risk, and restart from the latest
+ * checkpoint plus the trades journaled after it.
+ */
+#ifndef POSITION_CHECKPOINT_HPP
+#define POSITION_CHECKPOINT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "soa.hpp"
+#include "positionservice.hpp"
+#include "riskservice.hpp"
+#include "pnlservice.hpp"
+#include "tradebookingservice.hpp"
+
+/**
+ * Positions and risk as of one journal sequence number: every book position of
+ * every instrument, dense by instrument then book, and the PV01 per product.
+ */
+struct PositionCheckpoint
+{
+  uint64_t sequence = 0;
+  vector<string> books;
+  vector<string> products;
+  vector<long> quantities;
+  vector<uint8_t> touched;
+  vector<string> riskProducts;
+  vector<double> riskPV01;
+  vector<long> riskQuantities;
+};
+
+/**
+ * Writes checkpoints of the position matrix and risk every interval.
+ * Register it as the last listener on the trade booking service: once per
+ * interval the writer thread asks for a checkpoint, and the booking thread
+ * captures one at the end of the next booking, when positions, risk and the
+ * journal all agree. Capturing copies the dense arrays and syncs the journal;
+ * encoding and writing the file happen on the writer thread. Files are written
+ * to <path>.tmp, fsynced and renamed over path, and the journal is fsynced
+ * before its size is recorded, so neither a process nor an OS crash leaves a
+ * torn checkpoint or one ahead of the journal.
+ */
+class PositionCheckpointer : public ServiceListener<Trade<Bond>>
+{
+
+public:
+
+  // ctor for a checkpointer writing to path every interval
+  PositionCheckpointer(BondTradeBookingService *_tradeBookingService, BondPositionService *_positionService,
+                       BondRiskService *_riskService, const string &_path,
+                       chrono::milliseconds _interval = chrono::seconds(30));
+  ~PositionCheckpointer();
+
+  // Capture a checkpoint now; call from the booking thread between bookings
+  void Checkpoint();
+
+  // Block until every captured checkpoint has been written
+  void Flush();
+
+  void ProcessAdd(Trade<Bond> &data) override;
+  void ProcessRemove(Trade<Bond> &data) override;
+  void ProcessUpdate(Trade<Bond> &data) override;
+
+  // Restore positions and risk from the checkpoint at path, then replay the journal after it to the booking
+  // service's listeners; returns the number of journal records replayed. Position and delta listeners see
+  // every restored book position as a change from flat. A checkpoint that is missing, unreadable or ahead
+  // of the journal is ignored and the whole journal replayed. Call before adding a checkpointer.
+  // P&L is not in the checkpoint; a P&L service passed here is rebuilt from every live trade in the journal.
+  static uint64_t Restore(const string &path, const BondProductService &productService,
+                          BondTradeBookingService &tradeBookingService, BondPositionService &positionService,
+                          BondRiskService &riskService, BondPnLService *pnlService = nullptr);
+
+  static bool Write(const string &path, const PositionCheckpoint &checkpoint);
+  static bool Read(const string &path, PositionCheckpoint &checkpoint);
+
+private:
+  void CaptureIfDue();
+  void Run();
+
+  BondTradeBookingService *tradeBookingService;
+  BondPositionService *positionService;
+  BondRiskService *riskService;
+  string path;
+  chrono::milliseconds interval;
+
+  atomic<bool> due;
+  mutex pendingMutex;
+  condition_variable wake;
+  condition_variable written;
+  unique_ptr<PositionCheckpoint> pending;
+  bool writing;
+  bool stopping;
+  thread writer;
+
+};
+
+PositionCheckpointer::PositionCheckpointer(BondTradeBookingService *_tradeBookingService,
+                                           BondPositionService *_positionService, BondRiskService *_riskService,
+                                           const string &_path, chrono::milliseconds _interval) :
+  tradeBookingService(_tradeBookingService), positionService(_positionService), riskService(_riskService),
+  path(_path), interval(_interval), due(false), writing(false), stopping(false)
+{
+  writer = thread(&PositionCheckpointer::Run, this);
+}
+
+PositionCheckpointer::~PositionCheckpointer()
+{
+  {
+    lock_guard<mutex> lock(pendingMutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+}
+
+void PositionCheckpointer::Checkpoint()
+{
+  tradeBookingService->SyncJournal();
+
+  unique_ptr<PositionCheckpoint> checkpoint(new PositionCheckpoint());
+  checkpoint->sequence = tradeBookingService->GetJournal().Size();
+
+  const PositionMatrix &matrix = positionService->GetMatrix();
+  size_t bookCount = matrix.GetBookCount();
+  size_t instrumentCount = matrix.GetInstrumentCount();
+  for (uint32_t book = 0; book < bookCount; ++book) {
+    checkpoint->books.push_back(matrix.GetBookName(book));
+  }
+  checkpoint->quantities.resize(instrumentCount * bookCount);
+  checkpoint->touched.resize(instrumentCount * bookCount);
+  for (uint32_t instrument = 0; instrument < instrumentCount; ++instrument) {
+    checkpoint->products.push_back(positionService->GetPosition(instrument).GetProduct().GetProductId());
+    for (uint32_t book = 0; book < bookCount; ++book) {
+      checkpoint->quantities[instrument * bookCount + book] = matrix.Get(instrument, book);
+      checkpoint->touched[instrument * bookCount + book] = matrix.IsTouched(instrument, book) ? 1 : 0;
+    }
+  }
+
+  riskService->ForEachRisk([&](const PV01<Bond> &risk) {
+    checkpoint->riskProducts.push_back(risk.GetProduct().GetProductId());
+    checkpoint->riskPV01.push_back(risk.GetPV01());
+    checkpoint->riskQuantities.push_back(risk.GetQuantity());
+  });
+
+  {
+    lock_guard<mutex> lock(pendingMutex);
+    pending = move(checkpoint);
+  }
+  due.store(false, memory_order_relaxed);
+  wake.notify_one();
+}
+
+void PositionCheckpointer::Flush()
+{
+  unique_lock<mutex> lock(pendingMutex);
+  written.wait(lock, [this] { return !pending && !writing; });
+}
+
+inline void PositionCheckpointer::CaptureIfDue()
+{
+  if (due.load(memory_order_relaxed)) {
+    Checkpoint();
+  }
+}
+
+inline void PositionCheckpointer::ProcessAdd(Trade<Bond> &data)
+{
+  CaptureIfDue();
+}
+
+inline void PositionCheckpointer::ProcessRemove(Trade<Bond> &data)
+{
+  // An amendment is a remove followed by an update; only a cancel ends the booking here
+  const TradeJournal &journal = tradeBookingService->GetJournal();
+  uint64_t sequence = journal.Find(data.GetTradeId());
+  if (sequence != TradeJournal::NONE && journal.Get(sequence).type == JOURNAL_CANCEL) {
+    CaptureIfDue();
+  }
+}
+
+inline void PositionCheckpointer::ProcessUpdate(Trade<Bond> &data)
+{
+  CaptureIfDue();
+}
+
+void PositionCheckpointer::Run()
+{
+  unique_lock<mutex> lock(pendingMutex);
+  auto nextDue = chrono::steady_clock::now() + interval;
+  for (;;) {
+    wake.wait_until(lock, nextDue, [this] { return stopping || pending; });
+
+    if (pending) {
+      unique_ptr<PositionCheckpoint> checkpoint = move(pending);
+      writing = true;
+      lock.unlock();
+      if (!Write(path, *checkpoint)) {
+        cerr << "could not write position checkpoint " << path << endl;
+      }
+      lock.lock();
+      writing = false;
+      written.notify_all();
+      continue;
+    }
+    if (stopping) {
+      return;
+    }
+    if (chrono::steady_clock::now() >= nextDue) {
+      due.store(true, memory_order_relaxed);
+      nextDue = chrono::steady_clock::now() + interval;
+    }
+  }
+}
+
+namespace checkpoint_io
+{
+
+template<typename V>
+inline void WriteValue(ofstream &out, const V &value)
+{
+  out.write(reinterpret_cast<const char*>(&value), sizeof(V));
+}
+
+template<typename V>
+inline bool ReadValue(ifstream &in, V &value)
+{
+  return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(V)));
+}
+
+inline void WriteString(ofstream &out, const string &value)
+{
+  WriteValue(out, static_cast<uint32_t>(value.size()));
+  out.write(value.data(), value.size());
+}
+
+inline bool ReadString(ifstream &in, string &value)
+{
+  uint32_t size;
+  if (!ReadValue(in, size)) return false;
+  value.resize(size);
+  return static_cast<bool>(in.read(&value[0], size));
+}
+
+const char MAGIC[8] = {'B', 'T', 'P', 'O', 'S', 'C', 'P', '1'};
+
+// fsync a file, or the directory holding it so a rename within it is durable
+inline bool SyncPath(const string &path, bool directory)
+{
+  string target = path;
+  if (directory) {
+    size_t slash = path.rfind('/');
+    target = (slash == string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+  }
+  int fd = open(target.c_str(), O_RDONLY | (directory ? O_DIRECTORY : 0));
+  if (fd < 0) return false;
+  bool synced = (fsync(fd) == 0);
+  close(fd);
+  return synced;
+}
+
+}
+
+bool PositionCheckpointer::Write(const string &path, const PositionCheckpoint &checkpoint)
+{
+  using namespace checkpoint_io;
+  string tmpPath = path + ".tmp";
+  {
+    ofstream out(tmpPath, ios::binary | ios::trunc);
+    if (!out) return false;
+
+    out.write(MAGIC, sizeof(MAGIC));
+    WriteValue(out, checkpoint.sequence);
+    WriteValue(out, static_cast<uint32_t>(checkpoint.books.size()));
+    WriteValue(out, static_cast<uint32_t>(checkpoint.products.size()));
+    WriteValue(out, static_cast<uint32_t>(checkpoint.riskProducts.size()));
+    for (const string &book : checkpoint.books) {
+      WriteString(out, book);
+    }
+    for (const string &product : checkpoint.products) {
+      WriteString(out, product);
+    }
+    out.write(reinterpret_cast<const char*>(checkpoint.quantities.data()), checkpoint.quantities.size() * sizeof(long));
+    out.write(reinterpret_cast<const char*>(checkpoint.touched.data()), checkpoint.touched.size());
+    for (size_t i = 0; i < checkpoint.riskProducts.size(); ++i) {
+      WriteString(out, checkpoint.riskProducts[i]);
+      WriteValue(out, checkpoint.riskPV01[i]);
+      WriteValue(out, checkpoint.riskQuantities[i]);
+    }
+    out.flush();
+    if (!out) return false;
+  }
+  if (!SyncPath(tmpPath, false) || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    return false;
+  }
+  return SyncPath(path, true);
+}
+
+bool PositionCheckpointer::Read(const string &path, PositionCheckpoint &checkpoint)
+{
+  using namespace checkpoint_io;
+  ifstream in(path, ios::binary);
+  char magic[sizeof(MAGIC)];
+  uint32_t bookCount, instrumentCount, riskCount;
+  if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      !ReadValue(in, checkpoint.sequence) || !ReadValue(in, bookCount) ||
+      !ReadValue(in, instrumentCount) || !ReadValue(in, riskCount)) {
+    return false;
+  }
+
+  checkpoint.books.resize(bookCount);
+  for (string &book : checkpoint.books) {
+    if (!ReadString(in, book)) return false;
+  }
+  checkpoint.products.resize(instrumentCount);
+  for (string &product : checkpoint.products) {
+    if (!ReadString(in, product)) return false;
+  }
+  size_t cells = static_cast<size_t>(bookCount) * instrumentCount;
+  checkpoint.quantities.resize(cells);
+  checkpoint.touched.resize(cells);
+  in.read(reinterpret_cast<char*>(checkpoint.quantities.data()), cells * sizeof(long));
+  in.read(reinterpret_cast<char*>(checkpoint.touched.data()), cells);
+  checkpoint.riskProducts.resize(riskCount);
+  checkpoint.riskPV01.resize(riskCount);
+  checkpoint.riskQuantities.resize(riskCount);
+  for (uint32_t i = 0; i < riskCount; ++i) {
+    if (!ReadString(in, checkpoint.riskProducts[i]) || !ReadValue(in, checkpoint.riskPV01[i]) ||
+        !ReadValue(in, checkpoint.riskQuantities[i])) {
+      return false;
+    }
+  }
+  return static_cast<bool>(in);
+}
+
+uint64_t PositionCheckpointer::Restore(const string &path, const BondProductService &productService,
+                                       BondTradeBookingService &tradeBookingService,
+                                       BondPositionService &positionService, BondRiskService &riskService,
+                                       BondPnLService *pnlService)
+{
+  uint64_t journalSize = tradeBookingService.GetJournal().Size();
+  PositionCheckpoint checkpoint;
+  if (!Read(path, checkpoint)) {
+    cerr << "No usable position checkpoint at " << path << ", replaying the whole journal" << endl;
+    checkpoint = PositionCheckpoint();
+  }
+  else if (checkpoint.sequence > journalSize) {
+    cerr << "Position checkpoint at " << path << " is ahead of the trade journal (" << checkpoint.sequence << " > "
+         << journalSize << "), replaying the whole journal" << endl;
+    checkpoint = PositionCheckpoint();
+  }
+
+  // Risk first, so restored positions are re-risked at the checkpoint's PV01 per unit
+  for (size_t i = 0; i < checkpoint.riskProducts.size(); ++i) {
+    const Bond *product = productService.Find(checkpoint.riskProducts[i]);
+    if (product) {
+      riskService.RestoreRisk(*product, checkpoint.riskPV01[i], checkpoint.riskQuantities[i]);
+    }
+  }
+
+  size_t bookCount = checkpoint.books.size();
+  for (size_t instrument = 0; instrument < checkpoint.products.size(); ++instrument) {
+    const Bond *product = productService.Find(checkpoint.products[instrument]);
+    if (!product) {
+      cerr << "Skipping checkpointed position in unknown product " << checkpoint.products[instrument] << endl;
+      continue;
+    }
+    for (size_t book = 0; book < bookCount; ++book) {
+      if (checkpoint.touched[instrument * bookCount + book]) {
+        positionService.RestorePosition(*product, checkpoint.books[book], checkpoint.quantities[instrument * bookCount + book]);
+      }
+    }
+  }
+
+  tradeBookingService.Replay(checkpoint.sequence);
+  if (pnlService) {
+    pnlService->Rebuild();
+  }
+  return journalSize - checkpoint.sequence;
+}
+
+#endif
@@ -9,14 +9,140 @@
 
 #include <string>
 #include <map>
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
 #include "soa.hpp"
 #include "tradebookingservice.hpp"
 #include "products.hpp"
+#include "snapshot.hpp"
 
 using namespace std;
 
+/**
+ * Dense matrix of positions indexed by instrument id and book id.
+ * Book names are interned to small ids on first use; each instrument row keeps
+ * one cell per book and a running aggregate, so applying a trade and reading an
+ * aggregate are both O(1) and only a new book or instrument allocates.
+ */
+class PositionMatrix
+{
+
+public:
+
+  static constexpr uint32_t NPOS = ~static_cast<uint32_t>(0);
+
+  // ctor for a matrix with room for bookCapacity books and instrumentCapacity instruments before it grows
+  explicit PositionMatrix(size_t bookCapacity = 16, size_t instrumentCapacity = 64);
+
+  // Add an empty instrument row; returns its id
+  uint32_t AddInstrument();
+
+  // Get the id for a book, interning it on first use
+  uint32_t InternBook(const string &book);
+
+  // Get the id for a book, or NPOS if it has never been used
+  uint32_t FindBook(const string &book) const;
+
+  const string& GetBookName(uint32_t book) const;
+
+  // Book ids ordered by book name
+  const vector<uint32_t>& GetBooksByName() const;
+
+  size_t GetBookCount() const;
+  size_t GetInstrumentCount() const;
+
+  // Add a signed quantity to a cell; returns the new book quantity
+  long Add(uint32_t instrument, uint32_t book, long quantity);
+
+  // Get a cell, and whether the instrument has ever traded in that book
+  long Get(uint32_t instrument, uint32_t book) const;
+  bool IsTouched(uint32_t instrument, uint32_t book) const;
+
+  // Get the sum of an instrument's row
+  long GetAggregate(uint32_t instrument) const;
+
+private:
+  void Resize(size_t newStride);
+
+  vector<long> cells;
+  vector<uint8_t> touched;
+  vector<long> aggregates;
+  size_t stride;
+  vector<string> bookNames;
+  unordered_map<string, uint32_t> bookIds;
+  vector<uint32_t> booksByName;
+
+};
+
+/**
+ * Lock-free copy of a PositionMatrix for threads other than the booking thread.
+ * The owning thread publishes each cell it changes together with the row
+ * aggregate under a per-instrument sequence lock; readers see a consistent row
+ * without taking a lock, retrying only if they overlap a publish of that row.
+ * Capacity is fixed up front so readers never see storage move. Instruments
+ * and books beyond it are still booked in the matrix but are not published:
+ * Add returns false for them and the owner skips their publishes.
+ */
+class PositionBoard
+{
+
+public:
+
+  static constexpr uint32_t NPOS = PositionMatrix::NPOS;
+
+  // ctor for a board with room for instrumentCapacity instruments and bookCapacity books
+  explicit PositionBoard(size_t instrumentCapacity = 4096, size_t bookCapacity = 64);
+  ~PositionBoard();
+
+  PositionBoard(const PositionBoard &) = delete;
+  PositionBoard& operator=(const PositionBoard &) = delete;
+
+  // Name an instrument or book id from the matrix; false if it is past capacity (owning thread only)
+  bool AddInstrument(uint32_t instrument, const string &productId);
+  bool AddBook(uint32_t book, const string &name);
+
+  // Whether a cell has room on the board
+  bool Covers(uint32_t instrument, uint32_t book) const;
+
+  // Publish a book quantity and the instrument's aggregate; the cell must be covered (owning thread only)
+  void Publish(uint32_t instrument, uint32_t book, long bookQuantity, long aggregate);
+
+  // Find an instrument or book id by name, or NPOS (any thread)
+  uint32_t FindInstrument(const string &productId) const;
+  uint32_t FindBook(const string &name) const;
+
+  // Number of books named so far, and a book's name (any thread)
+  size_t GetBookCount() const;
+  const string& GetBookName(uint32_t book) const;
+
+  // Read one book quantity (any thread)
+  long GetQuantity(uint32_t instrument, uint32_t book) const;
+
+  // Read a consistent aggregate and version for a row (any thread)
+  long GetAggregate(uint32_t instrument, uint64_t &version) const;
+
+  // Read a consistent row: the aggregate, the version and every book quantity indexed by book id (any thread)
+  long ReadRow(uint32_t instrument, vector<long> &books, uint64_t &version) const;
+
+private:
+  size_t instrumentCapacity;
+  size_t bookCapacity;
+  size_t stride;
+  atomic<uint64_t> *sequences;
+  atomic<long> *cells;
+  string *bookNames;
+  atomic<size_t> bookCount;
+  SnapshotTable<uint64_t> instrumentIds;
+  SnapshotTable<uint64_t> bookIds;
+
+};
+
 /**
  * Position class in a particular book.
+ * A position is a view of one instrument row in a PositionMatrix.
  * Type T is the product type.
  */
 template<typename T>
@@ -25,23 +151,35 @@ class Position
 
 public:
 
-  // ctor for a position
+  // ctor for a position with no books
   Position(const T &_product);
 
+  // ctor for the position on an instrument row of a matrix
+  Position(const T &_product, const PositionMatrix *_matrix, uint32_t _instrument);
+
   // Get the product
   const T& GetProduct() const;
 
   // Get the position quantity
-  long& GetPosition(string &book);
+  long GetPosition(const string &book) const;
 
-  const std::map<std::string, long>& GetPositions() const;
+  // Get the name of a book id
+  const string& GetBookName(uint32_t book) const;
+
+  // Call f(book, quantity) for each book the product has traded in, ordered by book name
+  template<typename F>
+  void ForEachBook(F f) const;
 
   // Get the aggregate position
   long GetAggregatePosition() const;
 
+  // Get the instrument row in the matrix
+  uint32_t GetInstrumentId() const;
+
 private:
   T product;
-  map<string,long> positions;
+  const PositionMatrix *matrix;
+  uint32_t instrument;
 
 };
 
@@ -61,9 +199,233 @@ public:
 
 };
 
+PositionMatrix::PositionMatrix(size_t bookCapacity, size_t instrumentCapacity) :
+  stride(bookCapacity == 0 ? 1 : bookCapacity)
+{
+  cells.reserve(stride * instrumentCapacity);
+  touched.reserve(stride * instrumentCapacity);
+  aggregates.reserve(instrumentCapacity);
+}
+
+inline uint32_t PositionMatrix::AddInstrument()
+{
+  cells.resize(cells.size() + stride, 0);
+  touched.resize(touched.size() + stride, 0);
+  aggregates.push_back(0);
+  return static_cast<uint32_t>(aggregates.size() - 1);
+}
+
+inline uint32_t PositionMatrix::InternBook(const string &book)
+{
+  auto it = bookIds.find(book);
+  if (it != bookIds.end()) {
+    return it->second;
+  }
+
+  uint32_t id = static_cast<uint32_t>(bookNames.size());
+  if (id == stride) {
+    Resize(stride * 2);
+  }
+  bookNames.push_back(book);
+  bookIds.emplace(book, id);
+  auto position = lower_bound(booksByName.begin(), booksByName.end(), book,
+                              [this](uint32_t other, const string &name) { return bookNames[other] < name; });
+  booksByName.insert(position, id);
+  return id;
+}
+
+inline uint32_t PositionMatrix::FindBook(const string &book) const
+{
+  auto it = bookIds.find(book);
+  return (it != bookIds.end()) ? it->second : NPOS;
+}
+
+inline const string& PositionMatrix::GetBookName(uint32_t book) const
+{
+  return bookNames[book];
+}
+
+inline const vector<uint32_t>& PositionMatrix::GetBooksByName() const
+{
+  return booksByName;
+}
+
+inline size_t PositionMatrix::GetBookCount() const
+{
+  return bookNames.size();
+}
+
+inline size_t PositionMatrix::GetInstrumentCount() const
+{
+  return aggregates.size();
+}
+
+void PositionMatrix::Resize(size_t newStride)
+{
+  size_t rows = aggregates.size();
+  vector<long> newCells(newStride * rows, 0);
+  vector<uint8_t> newTouched(newStride * rows, 0);
+  for (size_t row = 0; row < rows; ++row) {
+    copy_n(cells.begin() + row * stride, stride, newCells.begin() + row * newStride);
+    copy_n(touched.begin() + row * stride, stride, newTouched.begin() + row * newStride);
+  }
+  cells.swap(newCells);
+  touched.swap(newTouched);
+  stride = newStride;
+}
+
+inline long PositionMatrix::Add(uint32_t instrument, uint32_t book, long quantity)
+{
+  size_t cell = instrument * stride + book;
+  touched[cell] = 1;
+  aggregates[instrument] += quantity;
+  return cells[cell] += quantity;
+}
+
+inline long PositionMatrix::Get(uint32_t instrument, uint32_t book) const
+{
+  return cells[instrument * stride + book];
+}
+
+inline bool PositionMatrix::IsTouched(uint32_t instrument, uint32_t book) const
+{
+  return touched[instrument * stride + book] != 0;
+}
+
+inline long PositionMatrix::GetAggregate(uint32_t instrument) const
+{
+  return aggregates[instrument];
+}
+
+PositionBoard::PositionBoard(size_t _instrumentCapacity, size_t _bookCapacity) :
+  instrumentCapacity(_instrumentCapacity), bookCapacity(_bookCapacity), stride(_bookCapacity + 1),
+  bookCount(0), instrumentIds(_instrumentCapacity), bookIds(_bookCapacity)
+{
+  // Each row is the aggregate followed by one cell per book
+  sequences = new atomic<uint64_t>[instrumentCapacity];
+  cells = new atomic<long>[instrumentCapacity * stride];
+  bookNames = new string[bookCapacity];
+  for (size_t i = 0; i < instrumentCapacity; ++i) {
+    sequences[i].store(0, memory_order_relaxed);
+  }
+  for (size_t i = 0; i < instrumentCapacity * stride; ++i) {
+    cells[i].store(0, memory_order_relaxed);
+  }
+}
+
+PositionBoard::~PositionBoard()
+{
+  delete[] sequences;
+  delete[] cells;
+  delete[] bookNames;
+}
+
+bool PositionBoard::AddInstrument(uint32_t instrument, const string &productId)
+{
+  if (instrument >= instrumentCapacity) {
+    return false;
+  }
+  instrumentIds.Publish(productId, instrument);
+  return true;
+}
+
+bool PositionBoard::AddBook(uint32_t book, const string &name)
+{
+  if (book >= bookCapacity) {
+    return false;
+  }
+  bookNames[book] = name;
+  bookIds.Publish(name, book);
+  bookCount.store(book + 1, memory_order_release);
+  return true;
+}
+
+inline bool PositionBoard::Covers(uint32_t instrument, uint32_t book) const
+{
+  return instrument < instrumentCapacity && book < bookCapacity;
+}
+
+inline void PositionBoard::Publish(uint32_t instrument, uint32_t book, long bookQuantity, long aggregate)
+{
+  atomic<long> *row = cells + instrument * stride;
+  uint64_t s = sequences[instrument].load(memory_order_relaxed);
+  sequences[instrument].store(s + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  row[0].store(aggregate, memory_order_relaxed);
+  row[book + 1].store(bookQuantity, memory_order_relaxed);
+  sequences[instrument].store(s + 2, memory_order_release);
+}
+
+inline uint32_t PositionBoard::FindInstrument(const string &productId) const
+{
+  uint64_t instrument;
+  return instrumentIds.Read(productId, instrument) ? static_cast<uint32_t>(instrument) : NPOS;
+}
+
+inline uint32_t PositionBoard::FindBook(const string &name) const
+{
+  uint64_t book;
+  return bookIds.Read(name, book) ? static_cast<uint32_t>(book) : NPOS;
+}
+
+inline size_t PositionBoard::GetBookCount() const
+{
+  return bookCount.load(memory_order_acquire);
+}
+
+inline const string& PositionBoard::GetBookName(uint32_t book) const
+{
+  return bookNames[book];
+}
+
+inline long PositionBoard::GetQuantity(uint32_t instrument, uint32_t book) const
+{
+  return cells[instrument * stride + book + 1].load(memory_order_acquire);
+}
+
+inline long PositionBoard::GetAggregate(uint32_t instrument, uint64_t &version) const
+{
+  for (;;) {
+    uint64_t before = sequences[instrument].load(memory_order_acquire);
+    if (before & 1) continue;
+    long aggregate = cells[instrument * stride].load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (sequences[instrument].load(memory_order_relaxed) == before) {
+      version = before / 2;
+      return aggregate;
+    }
+  }
+}
+
+long PositionBoard::ReadRow(uint32_t instrument, vector<long> &books, uint64_t &version) const
+{
+  const atomic<long> *row = cells + instrument * stride;
+  for (;;) {
+    size_t count = GetBookCount();
+    books.resize(count);
+    uint64_t before = sequences[instrument].load(memory_order_acquire);
+    if (before & 1) continue;
+    long aggregate = row[0].load(memory_order_relaxed);
+    for (size_t book = 0; book < count; ++book) {
+      books[book] = row[book + 1].load(memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (sequences[instrument].load(memory_order_relaxed) == before) {
+      version = before / 2;
+      return aggregate;
+    }
+  }
+}
+
 template<typename T>
 Position<T>::Position(const T &_product) :
-  product(_product)
+  product(_product), matrix(nullptr), instrument(PositionMatrix::NPOS)
+{
+}
+
+template<typename T>
+Position<T>::Position(const T &_product, const PositionMatrix *_matrix, uint32_t _instrument) :
+  product(_product), matrix(_matrix), instrument(_instrument)
 {
 }
 
@@ -74,34 +436,102 @@ const T& Position<T>::GetProduct() const
 }
 
 template<typename T>
-long& Position<T>::GetPosition(string &book)
+long Position<T>::GetPosition(const string &book) const
 {
-  return positions[book];
+  uint32_t bookId = matrix ? matrix->FindBook(book) : PositionMatrix::NPOS;
+  return (bookId == PositionMatrix::NPOS) ? 0 : matrix->Get(instrument, bookId);
 }
 
 template<typename T>
-const std::map<std::string, long>& Position<T>::GetPositions() const {
-    return positions;
+const string& Position<T>::GetBookName(uint32_t book) const
+{
+  return matrix->GetBookName(book);
 }
 
 template<typename T>
-long Position<T>::GetAggregatePosition() const
+template<typename F>
+void Position<T>::ForEachBook(F f) const
 {
-  // No-op implementation - should be filled out for implementations
-  long aggregate = 0;
-  for (auto &kv : positions) {
-    aggregate += kv.second;
+  if (!matrix) return;
+  for (uint32_t book : matrix->GetBooksByName()) {
+    if (matrix->IsTouched(instrument, book)) {
+      f(matrix->GetBookName(book), matrix->Get(instrument, book));
+    }
   }
-  return aggregate;
 }
 
+template<typename T>
+long Position<T>::GetAggregatePosition() const
+{
+  return matrix ? matrix->GetAggregate(instrument) : 0;
+}
+
+template<typename T>
+uint32_t Position<T>::GetInstrumentId() const
+{
+  return instrument;
+}
+
+/**
+ * A single change to one cell of the position matrix: the instrument and book,
+ * the signed quantity traded, and the book and aggregate positions after it.
+ */
+struct PositionDelta
+{
+  uint32_t instrument;
+  uint32_t book;
+  long change;
+  long bookPosition;
+  long aggregate;
+};
+
+/**
+ * Listener for position deltas, registered next to the ServiceListener on a
+ * position service. Each trade produces exactly one delta; the position passed
+ * alongside it gives access to the product and the other books if needed.
+ * Type T is the product type.
+ */
+template<typename T>
+class PositionDeltaListener
+{
+
+public:
+
+  virtual ~PositionDeltaListener() = default;
+
+  // Listener callback to process a change to one book of a position
+  virtual void ProcessDelta(const Position<T> &position, const PositionDelta &delta) = 0;
+
+};
+
+/**
+ * Latest aggregate position for a product, read from the position board.
+ * The version counts the position changes for the product.
+ */
+struct PositionSnapshot
+{
+  long aggregate;
+  uint64_t version;
+};
+
 class BondPositionService : public PositionService<Bond>, public ServiceListener<Trade<Bond>>
 {
 private: 
-  map<string, Position<Bond>> positionMap;
+  PositionMatrix matrix;
+  deque<Position<Bond>> positions;
+  unordered_map<string, uint32_t> instrumentIds;
   vector<ServiceListener<Position<Bond>>*> listeners;
+  vector<PositionDeltaListener<Bond>*> deltaListeners;
+  PositionBoard board;
+
+  void ApplyTrade(const Trade<Bond> &trade, long quantity);
+  void Apply(uint32_t instrument, bool isNew, uint32_t book, long quantity);
+  uint32_t InstrumentFor(const Bond &product, bool &isNew);
+  uint32_t BookFor(const string &book);
+  void PublishToBoard(uint32_t instrument, uint32_t book, long bookPosition);
 
 public:
+  // Get the position on a product; the position reads the matrix, so only use it on the booking thread
   Position<Bond>& GetData(string key) override;
   void OnMessage(Position<Bond> &data) override;
   void AddListener(ServiceListener<Position<Bond>> *listener) override;
@@ -111,14 +541,32 @@ public:
   void ProcessAdd(Trade<Bond> &data) override;
   void ProcessRemove(Trade<Bond> &data) override;
   void ProcessUpdate(Trade<Bond> &data) override;
+
+  // Lock-free read of the aggregate position for a product; false if it was never traded or is not on the board
+  bool GetSnapshot(const string &productId, PositionSnapshot &snapshot) const;
+
+  // The product x book matrix behind every position (booking thread only)
+  const PositionMatrix& GetMatrix() const;
+
+  // Lock-free copy of the matrix for other threads
+  const PositionBoard& GetBoard() const;
+
+  // Add a listener for per-trade position deltas
+  void AddDeltaListener(PositionDeltaListener<Bond> *listener);
+
+  // Get the position on an instrument row of the matrix
+  const Position<Bond>& GetPosition(uint32_t instrument) const;
+
+  // Set a book position from a checkpoint; listeners see the change as if it had been traded
+  void RestorePosition(const Bond &product, const string &book, long quantity);
 };
 
 
 inline Position<Bond>& BondPositionService::GetData(string key) 
 {
-  auto it = positionMap.find(key);
-  if (it != positionMap.end()) {
-    return it->second;
+  auto it = instrumentIds.find(key);
+  if (it != instrumentIds.end()) {
+    return positions[it->second];
   }
   throw runtime_error("Position key not found: " + key);
 }
@@ -137,26 +585,96 @@ inline const vector<ServiceListener<Position<Bond>>*>& BondPositionService::GetL
   return listeners;
 }
 
-inline void BondPositionService::AddTrade(const Trade<Bond> &trade) 
+inline bool BondPositionService::GetSnapshot(const string &productId, PositionSnapshot &snapshot) const
 {
-  string productId = trade.GetProduct().GetProductId();
-  auto it = positionMap.find(productId);
-  bool isNew = (it == positionMap.end());
+  uint32_t instrument = board.FindInstrument(productId);
+  if (instrument == PositionBoard::NPOS) {
+    return false;
+  }
+  snapshot.aggregate = board.GetAggregate(instrument, snapshot.version);
+  return true;
+}
+
+inline const PositionMatrix& BondPositionService::GetMatrix() const
+{
+  return matrix;
+}
+
+inline const PositionBoard& BondPositionService::GetBoard() const
+{
+  return board;
+}
+
+inline void BondPositionService::AddDeltaListener(PositionDeltaListener<Bond> *listener)
+{
+  deltaListeners.push_back(listener);
+}
+
+inline uint32_t BondPositionService::InstrumentFor(const Bond &product, bool &isNew)
+{
+  auto it = instrumentIds.find(product.GetProductId());
+  isNew = (it == instrumentIds.end());
   if (isNew) {
-    Position<Bond> pos(trade.GetProduct());
-    positionMap.insert(make_pair(productId, pos));
-    it = positionMap.find(productId);
+    uint32_t instrument = matrix.AddInstrument();
+    positions.emplace_back(product, &matrix, instrument);
+    it = instrumentIds.emplace(product.GetProductId(), instrument).first;
+    if (!board.AddInstrument(instrument, product.GetProductId())) {
+      cerr << "Position board is full, " << product.GetProductId() << " is booked but not published" << endl;
+    }
   }
+  return it->second;
+}
 
-  Position<Bond> &pos = it->second;
+inline uint32_t BondPositionService::BookFor(const string &book)
+{
+  size_t bookCount = matrix.GetBookCount();
+  uint32_t bookId = matrix.InternBook(book);
+  if (matrix.GetBookCount() != bookCount && !board.AddBook(bookId, book)) {
+    cerr << "Position board is full, book " << book << " is booked but not published" << endl;
+  }
+  return bookId;
+}
 
-  long quantity = trade.GetQuantity();
-  if (trade.GetSide() == SELL) {
-    quantity = -quantity;
+inline void BondPositionService::PublishToBoard(uint32_t instrument, uint32_t book, long bookPosition)
+{
+  if (board.Covers(instrument, book)) {
+    board.Publish(instrument, book, bookPosition, matrix.GetAggregate(instrument));
   }
+}
+
+inline const Position<Bond>& BondPositionService::GetPosition(uint32_t instrument) const
+{
+  return positions[instrument];
+}
+
+void BondPositionService::RestorePosition(const Bond &product, const string &book, long quantity)
+{
+  bool isNew;
+  uint32_t instrument = InstrumentFor(product, isNew);
+  uint32_t bookId = BookFor(book);
+  Apply(instrument, isNew, bookId, quantity - matrix.Get(instrument, bookId));
+}
+
+inline void BondPositionService::ApplyTrade(const Trade<Bond> &trade, long quantity)
+{
+  bool isNew;
+  uint32_t instrument = InstrumentFor(trade.GetProduct(), isNew);
+  uint32_t book = BookFor(trade.GetBook());
+  Apply(instrument, isNew, book, quantity);
+}
 
-  string book = trade.GetBook();
-  pos.GetPosition(book) += quantity;
+inline void BondPositionService::Apply(uint32_t instrument, bool isNew, uint32_t book, long quantity)
+{
+  Position<Bond> &pos = positions[instrument];
+  long bookPosition = matrix.Add(instrument, book, quantity);
+  PublishToBoard(instrument, book, bookPosition);
+
+  if (!deltaListeners.empty()) {
+    PositionDelta delta{instrument, book, quantity, bookPosition, matrix.GetAggregate(instrument)};
+    for (auto listener : deltaListeners) {
+      listener->ProcessDelta(pos, delta);
+    }
+  }
 
   for (auto listener : listeners) {
     if (isNew) {
@@ -166,7 +684,15 @@ inline void BondPositionService::AddTrade(const Trade<Bond> &trade)
       listener->ProcessUpdate(pos);
     }
   }
+}
 
+inline void BondPositionService::AddTrade(const Trade<Bond> &trade) 
+{
+  long quantity = trade.GetQuantity();
+  if (trade.GetSide() == SELL) {
+    quantity = -quantity;
+  }
+  ApplyTrade(trade, quantity);
 }
 
 inline void BondPositionService::ProcessAdd(Trade<Bond> &data)
@@ -176,19 +702,13 @@ inline void BondPositionService::ProcessAdd(Trade<Bond> &data)
 
 inline void BondPositionService::ProcessRemove(Trade<Bond> &data)
 {
-  string productId = data.GetProduct().GetProductId();
-  auto it = positionMap.find(productId);
-  if (it != positionMap.end()) {
-    Position<Bond> &pos = it->second;
+  // Unwind a trade on a product we hold
+  if (instrumentIds.find(data.GetProduct().GetProductId()) != instrumentIds.end()) {
     long quantity = data.GetQuantity();
     if (data.GetSide() == BUY) {
       quantity = -quantity;
     }
-    string book = data.GetBook();
-    pos.GetPosition(book) += quantity;
-    for (auto listener : listeners) {
-      listener->ProcessUpdate(pos);
-    }
+    ApplyTrade(data, quantity);
   }
 }
 
@@ -15,6 +15,7 @@
 #include "productservice.hpp"
 #include "soa.hpp"
 #include "products.hpp"
+#include "snapshot.hpp"
 
 
 /**
@@ -87,11 +88,51 @@ double Price<T>::GetBidOfferSpread() const
   return bidOfferSpread;
 }
 
+/**
+ * Latest mid and spread for a product, readable from any thread.
+ * The version counts the prices received for the product.
+ */
+struct PriceSnapshot
+{
+  double mid;
+  double bidOfferSpread;
+  uint64_t version;
+};
+
+/**
+ * Listener for price ticks, registered next to the ServiceListener on a pricing
+ * service. Each tick carries the product's dense index, given in the order the
+ * products first ticked and never changed, so a listener can keep per-product
+ * state in a flat array instead of looking the product up on every tick.
+ * Type T is the product type.
+ */
+template<typename T>
+class PriceTickListener
+{
+
+public:
+
+  virtual ~PriceTickListener() = default;
+
+  // Listener callback to process a tick on the product at a dense index
+  virtual void ProcessTick(const Price<T> &price, uint32_t index) = 0;
+
+};
+
 class BondPricingService : public PricingService<Bond>
 {
 private: 
-  unordered_map<string, Price<Bond>> bondPriceMap;
+  // Latest price for a product and the dense index it was given on its first tick
+  struct PriceEntry
+  {
+    Price<Bond> price;
+    uint32_t index;
+  };
+
+  unordered_map<string, PriceEntry> bondPriceMap;
   vector<ServiceListener<Price<Bond>>*> listeners;
+  vector<PriceTickListener<Bond>*> tickListeners;
+  SnapshotTable<PriceSnapshot> snapshots;
 
 public:
   Price<Bond>& GetData(string key) override;
@@ -102,13 +143,19 @@ public:
 
   const vector<ServiceListener<Price<Bond>>*>& GetListeners() const override;
 
+  // Add a listener for ticks with the product's dense index
+  void AddTickListener(PriceTickListener<Bond> *listener);
+
+  // Lock-free read of the latest price for a product; false if none has arrived
+  bool GetSnapshot(const string &productId, PriceSnapshot &snapshot) const;
+
 };
 
 inline Price<Bond>& BondPricingService::GetData(string key)
   {
     auto it = bondPriceMap.find(key);
     if (it != bondPriceMap.end()) {
-      return it->second;
+      return it->second.price;
     }
     throw runtime_error("Price key not found: " + key);
   }
@@ -117,26 +164,46 @@ inline void BondPricingService::OnMessage(Price<Bond> &data)
 {
   string productId = data.GetProduct().GetProductId();
 
+  PriceSnapshot snapshot{data.GetMid(), data.GetBidOfferSpread(), 1};
+  size_t slot = snapshots.Find(productId);
+  if (slot == SnapshotTable<PriceSnapshot>::NPOS) {
+    snapshots.Publish(productId, snapshot);
+  }
+  else {
+    snapshot.version = snapshots.Read(slot).version + 1;
+    snapshots.Publish(slot, snapshot);
+  }
+
   auto it = bondPriceMap.find(productId);
-  if (it == bondPriceMap.end()) 
+  bool isNew = (it == bondPriceMap.end());
+  if (isNew) 
   {
-    bondPriceMap.insert(make_pair(productId, data));
-    for (auto listener : listeners) 
-    {
-      listener->ProcessAdd(data);
-    }
+    uint32_t index = static_cast<uint32_t>(bondPriceMap.size());
+    it = bondPriceMap.emplace(productId, PriceEntry{data, index}).first;
   }
   else 
   {
-    bondPriceMap.erase(it);
-    bondPriceMap.insert(make_pair(productId, data));
-    for (auto listener : listeners) 
-    {
+    it->second.price = data;
+  }
+
+  for (auto listener : listeners) 
+  {
+    if (isNew) {
+      listener->ProcessAdd(data);
+    }
+    else {
       listener->ProcessUpdate(data);
     }
   }
+  for (auto listener : tickListeners) 
+  {
+    listener->ProcessTick(data, it->second.index);
+  }
+}
 
-    
+inline bool BondPricingService::GetSnapshot(const string &productId, PriceSnapshot &snapshot) const
+{
+  return snapshots.Read(productId, snapshot);
 }
 
 inline void BondPricingService::AddListener(ServiceListener<Price<Bond>> *listener) 
@@ -149,6 +216,11 @@ inline const vector<ServiceListener<Price<Bond>>*>& BondPricingService::GetListe
   return listeners;
 }
 
+inline void BondPricingService::AddTickListener(PriceTickListener<Bond> *listener) 
+{
+  tickListeners.push_back(listener);
+}
+
 
 class BondPricingConnector : public Connector<Price<Bond>>
 {
@@ -10,6 +10,10 @@
 #include <iostream>
 #include <string>
 #include <cmath>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include "boost/date_time/gregorian/gregorian.hpp"
 
@@ -43,6 +47,44 @@ private:
 
 enum BondIdType { CUSIP, ISIN };
 
+/**
+ * The business date that bond cashflow schedules are built for. It starts as
+ * today's date and only moves when rolled, so valuations stay on one date
+ * until the start-of-day roll.
+ */
+class BusinessDate
+{
+
+public:
+
+  // Get the current business date, or its day number
+  static date Get();
+  static uint32_t GetDayNumber();
+
+  // Move to a new business date; schedules built for the old one are rebuilt on next use
+  static void Roll(const date &businessDate);
+
+private:
+  static inline atomic<uint32_t> dayNumber{day_clock::local_day().day_number()};
+
+};
+
+/**
+ * Remaining cashflows of a bond as of a business date, as flat arrays.
+ * times[i] is in coupon periods from the business date and amounts[i] is the
+ * cash paid then, the last one including the redemption.
+ */
+struct CashflowSchedule
+{
+  uint32_t businessDay;
+  int payments;
+  int periods;
+  double couponPerPeriod;
+  double faceValue;
+  vector<double> times;
+  vector<double> amounts;
+};
+
 /**
  * Bond product class
  */
@@ -69,16 +111,38 @@ public:
   // Get the bond identifier type
   BondIdType GetBondIdType() const;
 
+  // Macaulay duration in years at a yield
   double CalculateDuration(double yield, double faceValue, int payments) const;
 
+  // Price at a yield
   double ComputeBondPrice(double yield, int payments) const;
 
+  // Yield at a price, within [0%, 20%]
   double ComputeYield(double price, int payments) const;
 
+  // Cashflow schedule for the current business date, built on first use after a roll
+  const CashflowSchedule& GetSchedule(int payments) const;
+
   // Print the bond
   friend ostream& operator<<(ostream &output, const Bond &bond);
 
 private:
+  // Schedules shared by every copy of a bond; the current one is swapped on a date roll
+  // and older ones are kept until the last copy goes, since readers may still hold them
+  struct ScheduleCache
+  {
+    atomic<const CashflowSchedule*> current{nullptr};
+    mutex buildMutex;
+    vector<unique_ptr<const CashflowSchedule>> built;
+  };
+
+  // Build the schedule as of the current business date
+  const CashflowSchedule& BuildSchedule(int payments) const;
+
+  // Closed-form price of a schedule's cashflows, and its derivative with respect to the periodic yield
+  double PriceAndSlope(double periodicYield, const CashflowSchedule &schedule, double faceValue, double &slope) const;
+
+  shared_ptr<ScheduleCache> schedules;
   string productId;
   BondIdType bondIdType;
   string ticker;
@@ -191,9 +255,10 @@ Bond::Bond(string _productId, BondIdType _bondIdType, string _ticker, float _cou
   ticker = _ticker;
   coupon = _coupon;
   maturityDate =_maturityDate;
+  schedules = make_shared<ScheduleCache>();
 }
 
-Bond::Bond() : Product(0, BOND)
+Bond::Bond() : Product(0, BOND), schedules(make_shared<ScheduleCache>())
 {
 }
 
@@ -217,42 +282,156 @@ BondIdType Bond::GetBondIdType() const
   return bondIdType;
 }
 
-double Bond::CalculateDuration(double yield, double faceValue, int payments) const 
+inline date BusinessDate::Get()
 {
-  date today = day_clock::local_day();
-  long daysToMat = (maturityDate - today).days();
-  double yearsToMat = static_cast<double>(daysToMat) / 365.0;
+  return date(gregorian_calendar::from_day_number(dayNumber.load(memory_order_acquire)));
+}
 
-  int totalPeriods = static_cast<int>(round(yearsToMat * payments));
+inline uint32_t BusinessDate::GetDayNumber()
+{
+  return dayNumber.load(memory_order_acquire);
+}
 
-  double periodicCoupon = (coupon / 100.0) * faceValue / payments;
+inline void BusinessDate::Roll(const date &businessDate)
+{
+  dayNumber.store(businessDate.day_number(), memory_order_release);
+}
 
-  double periodicYield = yield / payments;
+inline const CashflowSchedule& Bond::GetSchedule(int payments) const
+{
+  const CashflowSchedule *schedule = schedules->current.load(memory_order_acquire);
+  if (schedule && schedule->businessDay == BusinessDate::GetDayNumber() && schedule->payments == payments) {
+    return *schedule;
+  }
+  return BuildSchedule(payments);
+}
 
-  double discountedCash = 0.0;
-  double totalPresentValue = 0.0;
-  for (int t = 1; t <= totalPeriods; ++t) {
-    double timeInPeriods = static_cast<double>(t);
+const CashflowSchedule& Bond::BuildSchedule(int payments) const
+{
+  uint32_t businessDay = BusinessDate::GetDayNumber();
+  long daysToMaturity = static_cast<long>(maturityDate.day_number()) - static_cast<long>(businessDay);
+  double yearsToMaturity = static_cast<double>(daysToMaturity) / 365.0;
 
-    double discountFactor = pow(1.0 + periodicYield, -timeInPeriods);
+  CashflowSchedule *schedule = new CashflowSchedule();
+  schedule->businessDay = businessDay;
+  schedule->payments = payments;
+  schedule->periods = static_cast<int>(round(yearsToMaturity * payments));
+  schedule->couponPerPeriod = (coupon / 100.0) * faceValue / payments;
+  schedule->faceValue = faceValue;
+  for (int t = 1; t <= schedule->periods; ++t) {
+    schedule->times.push_back(static_cast<double>(t));
+    schedule->amounts.push_back(schedule->couponPerPeriod);
+  }
+  if (schedule->periods > 0) {
+    schedule->amounts.back() += faceValue;
+  }
 
-    double couponPV = periodicCoupon * discountFactor;
+  lock_guard<mutex> lock(schedules->buildMutex);
+  schedules->built.emplace_back(schedule);
+  schedules->current.store(schedule, memory_order_release);
+  return *schedule;
+}
+
+namespace bond_math
+{
+
+// Yields are solved within [LOW_YIELD, HIGH_YIELD]
+constexpr double LOW_YIELD = 0.0;
+constexpr double HIGH_YIELD = 0.20;
+
+// Price of n periods of coupon c plus redemption f at periodic yield r, and dP/dr;
+// n <= 0 prices the redemption alone
+inline double PriceAndSlope(double r, double c, double n, double f, double &slope)
+{
+  // With v = 1 / (1 + r), the coupons are an annuity c * (1 - v^n) / r and the
+  // redemption is f * v^n; near r = 0 that form cancels badly, so use its series
+  double v = 1.0 / (1.0 + r);
+  double vn = pow(v, n);
+
+  double price = f * vn;
+  slope = -n * f * vn * v;
+  if (n > 0.0) {
+    if (fabs(r) * n < 1e-2) {
+      // sum of (1 + r)^-t for t = 1..n is sum over k of (-r)^k * s[k], with s[k] = C(n + k, k + 1)
+      double sk = n;
+      double rk = 1.0;
+      double rkLess = 0.0;
+      double series = 0.0;
+      double seriesSlope = 0.0;
+      for (int k = 0; k <= 5; ++k) {
+        double sign = (k % 2 == 0) ? 1.0 : -1.0;
+        series += sign * rk * sk;
+        seriesSlope += sign * k * rkLess * sk;
+        rkLess = rk;
+        rk *= r;
+        sk *= (n + k + 1.0) / (k + 2.0);
+      }
+      price += c * series;
+      slope += c * seriesSlope;
+    }
+    else {
+      price += c * (1.0 - vn) / r;
+      slope += c * (n * vn * v / r - (1.0 - vn) / (r * r));
+    }
+  }
+  return price;
+}
+
+// Annual yield at which the same cashflows price to target, with payments periods a year
+inline double SolveYield(double target, double c, double n, double f, int payments)
+{
+  // Newton on the closed-form price, kept inside a bracket that shrinks with
+  // every step and falling back to bisection when a step would leave it
+  double p = static_cast<double>(payments);
+  double slope;
+  if (n <= 0.0 || target >= PriceAndSlope(LOW_YIELD / p, c, n, f, slope)) return LOW_YIELD;
+  if (target <= PriceAndSlope(HIGH_YIELD / p, c, n, f, slope)) return HIGH_YIELD;
 
-    discountedCash += timeInPeriods * couponPV;
-    totalPresentValue += couponPV;
+  // Start from the usual approximate yield to maturity
+  double lowYield = LOW_YIELD;
+  double highYield = HIGH_YIELD;
+  double yield = (c * p + (f - target) / (n / p)) / ((f + target) / 2.0);
+  if (!(yield > lowYield && yield < highYield)) {
+    yield = 0.5 * (lowYield + highYield);
   }
 
-  {
-    double discountFactor = pow(1.0 + periodicYield, -static_cast<double>(totalPeriods));
-    double redemptionPV = faceValue * discountFactor;
-    discountedCash += (static_cast<double>(totalPeriods) * redemptionPV);
-    totalPresentValue += redemptionPV;
+  for (int i = 0; i < 50; ++i) {
+    double error = PriceAndSlope(yield / p, c, n, f, slope) - target;
+    if (error > 0.0) {
+      lowYield = yield;
+    }
+    else {
+      highYield = yield;
+    }
+
+    double next = yield - error * p / slope;
+    if (!(next > lowYield && next < highYield)) {
+      next = 0.5 * (lowYield + highYield);
+    }
+    if (fabs(next - yield) < 1e-14) {
+      return next;
+    }
+    yield = next;
   }
+  return yield;
+}
 
-  double macaulayDurationPeriods = discountedCash / totalPresentValue;
+}
+
+inline double Bond::PriceAndSlope(double periodicYield, const CashflowSchedule &schedule, double faceValue, double &slope) const
+{
+  double couponPerPeriod = schedule.couponPerPeriod * faceValue / schedule.faceValue;
+  return bond_math::PriceAndSlope(periodicYield, couponPerPeriod, static_cast<double>(schedule.periods), faceValue, slope);
+}
 
-  double macaulayDurationYears = macaulayDurationPeriods / static_cast<double>(payments);
-  return macaulayDurationYears;
+double Bond::CalculateDuration(double yield, double faceValue, int payments) const 
+{
+  // Macaulay duration in periods is -(1 + r) * (dP/dr) / P
+  double periodicYield = yield / payments;
+  double slope;
+  double price = PriceAndSlope(periodicYield, GetSchedule(payments), faceValue, slope);
+  double macaulayDurationPeriods = -(1.0 + periodicYield) * slope / price;
+  return macaulayDurationPeriods / static_cast<double>(payments);
 }
 
 double Bond::GetFaceValue() const
@@ -262,66 +441,17 @@ double Bond::GetFaceValue() const
 
 double Bond::ComputeBondPrice(double yield, int payments) const
 {
-  
-    date today = day_clock::local_day();
-    long daysToMaturity = (maturityDate - today).days();
-    if (daysToMaturity <= 0) return 0.0; // Already matured
-    double yearsToMaturity = static_cast<double>(daysToMaturity) / 365.0;
-    int totalPeriods = static_cast<int>(round(yearsToMaturity * payments));
-
-    double couponRate     = coupon / 100.0;   // e.g. 5.0 => 0.05
-    double couponPerPeriod = (couponRate * faceValue) / payments;
-    double periodicYield   = yield / payments;
-
-    double price = 0.0;
-    for (int t = 1; t <= totalPeriods; ++t)
-    {
-        double discountFactor = pow(1.0 + periodicYield, -static_cast<double>(t));
-        double couponPV = couponPerPeriod * discountFactor;
-        price += couponPV;
-    }
-    
-    if (totalPeriods > 0)
-    {
-        double discountFactor = pow(1.0 + periodicYield, -static_cast<double>(totalPeriods));
-        price += faceValue * discountFactor;
-    }
-    return price;
+  const CashflowSchedule &schedule = GetSchedule(payments);
+  if (schedule.periods <= 0) return 0.0; // Already matured
+
+  double slope;
+  return PriceAndSlope(yield / payments, schedule, faceValue, slope);
 }
 
 double Bond::ComputeYield(double price, int payments) const
 {
-  double tolerance = 1e-7;
-    double lowYield  = 0.0;    // 0%
-    double highYield = 0.20;   // 20%
-    double midYield  = 0.0;
-
-    double bondPriceAtLow  = ComputeBondPrice(lowYield, payments);
-    double bondPriceAtHigh = ComputeBondPrice(highYield, payments);
-
-    for (int i = 0; i < 100; ++i) 
-    {
-        midYield = 0.5 * (lowYield + highYield);
-        double midPrice = ComputeBondPrice(midYield, payments);
-
-        if (fabs(midPrice - price) < tolerance)
-        {
-            
-            return midYield;
-        }
-
-        if (midPrice > price)
-        {
-            
-            lowYield = midYield;
-        }
-        else
-        {
-            // If computed price is too low, we need a lower yield
-            highYield = midYield;
-        }
-    }
-    return midYield; 
+  const CashflowSchedule &schedule = GetSchedule(payments);
+  return bond_math::SolveYield(price, schedule.couponPerPeriod, static_cast<double>(schedule.periods), schedule.faceValue, payments);
 }
 
 
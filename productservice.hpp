@@ -25,9 +25,15 @@ public:
   // Return the bond data for a particular bond product identifier
   Bond& GetData(string productId);
 
+  // Return the bond for a product identifier, or nullptr if it is unknown (never adds one)
+  const Bond* Find(const string &productId) const;
+
   // Add a bond to the service (convenience method)
   void Add(const Bond &bond);
 
+  // Roll to a new business date and rebuild every bond's cashflow schedule
+  void RollBusinessDate(const date &businessDate = day_clock::local_day());
+
 private:
   map<string,Bond> bondMap; // cache of bond products
 
@@ -64,9 +70,24 @@ Bond& BondProductService::GetData(string productId)
   return bondMap[productId];
 }
 
+const Bond* BondProductService::Find(const string &productId) const
+{
+  auto it = bondMap.find(productId);
+  return (it != bondMap.end()) ? &it->second : nullptr;
+}
+
 void BondProductService::Add(const Bond &bond)
 {
-  bondMap.insert(pair<string,Bond>(bond.GetProductId(), bond));
+  auto it = bondMap.insert(pair<string,Bond>(bond.GetProductId(), bond)).first;
+  it->second.GetSchedule(2); // semiannual, as every bond is priced
+}
+
+void BondProductService::RollBusinessDate(const date &businessDate)
+{
+  BusinessDate::Roll(businessDate);
+  for (auto &entry : bondMap) {
+    entry.second.GetSchedule(2);
+  }
 }
 
 IRSwapProductService::IRSwapProductService()
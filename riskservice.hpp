@@ -7,9 +7,18 @@
 #ifndef RISK_SERVICE_HPP
 #define RISK_SERVICE_HPP
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include "soa.hpp"
 #include "positionservice.hpp"
 #include "pricingservice.hpp"
+#include "bondanalytics.hpp"
 
 /**
  * PV01 risk.
@@ -33,6 +42,9 @@ public:
   // Get the quantity that this risk value is associated with
   long GetQuantity() const;
 
+  // Set the PV01 value and quantity, keeping the product
+  void Update(double _pv01, long _quantity);
+
 private:
   T product;
   double pv01;
@@ -43,6 +55,7 @@ private:
 /**
  * A bucket sector to bucket a group of securities.
  * We can then aggregate bucketed risk to this bucket.
+ * Copies share the product list, so passing a sector around is cheap.
  * Type T is the product type.
  */
 template<typename T>
@@ -61,7 +74,7 @@ public:
   const string& GetName() const;
 
 private:
-  vector<T> products;
+  shared_ptr<const vector<T>> products;
   string name;
 
 };
@@ -111,10 +124,17 @@ long PV01<T>::GetQuantity() const
   return quantity;
 }
 
+template<typename T>
+void PV01<T>::Update(double _pv01, long _quantity)
+{
+  pv01 = _pv01;
+  quantity = _quantity;
+}
+
 
 template<typename T>
 BucketedSector<T>::BucketedSector(const vector<T>& _products, string _name) :
-  products(_products)
+  products(make_shared<const vector<T>>(_products))
 {
   name = _name;
 }
@@ -122,7 +142,7 @@ BucketedSector<T>::BucketedSector(const vector<T>& _products, string _name) :
 template<typename T>
 const vector<T>& BucketedSector<T>::GetProducts() const
 {
-  return products;
+  return *products;
 }
 
 template<typename T>
@@ -131,15 +151,90 @@ const string& BucketedSector<T>::GetName() const
   return name;
 }
 
-class BondRiskService : public RiskService<Bond>, public ServiceListener<Position<Bond>>
+/**
+ * Latest risk for a product, readable from any thread: the position PV01, the
+ * PV01 of one unit at the last price, and the quantity it was computed on.
+ */
+struct RiskSnapshot
+{
+  double pv01;
+  double pv01PerUnit;
+  long quantity;
+  uint64_t version;
+};
+
+/**
+ * Bond risk service. Risk follows both positions and prices: a position event
+ * re-risks its product at once, while a price tick only marks the product
+ * dirty. Dirty products are re-marked together through the batch kernel at
+ * most once per remark interval, checked as events arrive, and a remark thread
+ * wakes every interval to flush whatever a burst left dirty once input goes
+ * quiet. Every entry point and the remark thread serialize on one lock, so
+ * listeners may be called from the remark thread but never concurrently with
+ * another risk event; they must outlive the service, as must the pricing service.
+ */
+class BondRiskService : public RiskService<Bond>, public ServiceListener<Position<Bond>>, public ServiceListener<Price<Bond>>
 {
 private: 
+  typedef chrono::steady_clock Clock;
+
+  // PV01 of one unit of a product, and the price version and business day it was computed on
+  struct UnitRisk
+  {
+    double pv01PerUnit;
+    uint64_t priceVersion;
+    uint32_t businessDay;
+    bool dirty;
+  };
+
   map<string, PV01<Bond>> riskMap;
   vector<ServiceListener<PV01<Bond>>*> listeners;
-  PricingService<Bond> &pricingService;
+  BondPricingService &pricingService;
+
+  // Registered buckets with running totals, and the buckets each product belongs to
+  deque<PV01<BucketedSector<Bond>>> buckets;
+  unordered_map<string, uint32_t> bucketIds;
+  unordered_map<string, vector<uint32_t>> productBuckets;
+  vector<ServiceListener<PV01<BucketedSector<Bond>>>*> bucketListeners;
+
+  SnapshotTable<RiskSnapshot> snapshots;
+  unordered_map<string, UnitRisk> unitRisks;
+  vector<string> dirtyProducts;
+  Clock::duration remarkInterval;
+  Clock::time_point lastRemark;
+
+  // Held by every entry point and the remark thread; recursive since entry points call each other
+  mutable recursive_mutex riskMutex;
+
+  // Remark thread state
+  thread remarker;
+  mutex remarkerMutex;
+  condition_variable remarkerCv;
+  bool stopping;
+
+  // Remark thread body: re-mark dirty products every remark interval until stopped
+  void RunRemarker();
+
+  void PublishSnapshot(const string &productId, RiskSnapshot snapshot);
+
+  // Re-mark a set of risks at their current prices in one batch and notify listeners
+  void Remark(const vector<PV01<Bond>*> &risks);
+
+  // Run the remark pass if products are dirty and the interval has passed
+  void RemarkIfDue();
+
+  // Move a product's buckets by the change in its risk and notify bucket listeners
+  void AdjustBuckets(const string &productId, double pv01Change, long quantityChange);
+
+  // PV01 of one unit at the current price, solved only when the price or business date has moved
+  double GetPV01PerUnit(const Bond &product);
 
 public: 
-  BondRiskService(BondPricingService &pricingService) : pricingService(pricingService) {}
+  // ctor for a risk service re-marking at most every remarkInterval; a zero interval
+  // re-marks on every event and starts no remark thread
+  BondRiskService(BondPricingService &pricingService, Clock::duration remarkInterval = chrono::milliseconds(250));
+  ~BondRiskService();
+
   PV01<Bond>& GetData(string key) override;
   void OnMessage(PV01<Bond> &data) override;
   void AddListener(ServiceListener<PV01<Bond>> *listener) override;
@@ -151,11 +246,75 @@ public:
   void ProcessRemove(Position<Bond> &data) override;
   void ProcessUpdate(Position<Bond> &data) override;
 
+  // Price ticks mark the product dirty for the next remark pass
+  void ProcessAdd(Price<Bond> &data) override;
+  void ProcessRemove(Price<Bond> &data) override;
+  void ProcessUpdate(Price<Bond> &data) override;
+
+  // Lock-free read of the latest risk for a product; false if it has no position yet
+  bool GetSnapshot(const string &productId, RiskSnapshot &snapshot) const;
+
+  // Call f(const PV01<Bond>&) for the risk on every product
+  template<typename F>
+  void ForEachRisk(F f) const;
+
+  // Set the risk on a product from a checkpoint, without notifying listeners; until the
+  // product's first price tick, positions in it are risked at the checkpoint's PV01 per unit
+  void RestoreRisk(const Bond &product, double pv01, long quantity);
+
+  // Revalue every product at its current price in one batch and notify listeners
+  void RecomputeAll();
+
+  // Re-mark the products whose price moved since they were last risked
+  void RemarkDirty();
+
+  // Register a bucket once; its total then follows every PV01 change. Returns its id
+  uint32_t AddBucket(const BucketedSector<Bond> &sector);
+
+  // Add a listener for bucket total changes
+  void AddBucketListener(ServiceListener<PV01<BucketedSector<Bond>>> *listener);
+
 };
 
 
+BondRiskService::BondRiskService(BondPricingService &_pricingService, Clock::duration _remarkInterval) :
+  pricingService(_pricingService), remarkInterval(_remarkInterval), lastRemark(Clock::now()), stopping(false)
+{
+  if (remarkInterval > Clock::duration::zero()) {
+    remarker = thread(&BondRiskService::RunRemarker, this);
+  }
+}
+
+BondRiskService::~BondRiskService()
+{
+  {
+    lock_guard<mutex> lock(remarkerMutex);
+    stopping = true;
+  }
+  remarkerCv.notify_one();
+  if (remarker.joinable()) {
+    remarker.join();
+  }
+}
+
+void BondRiskService::RunRemarker()
+{
+  unique_lock<mutex> lock(remarkerMutex);
+  while (!remarkerCv.wait_for(lock, remarkInterval, [this] { return stopping; })) {
+    lock.unlock();
+    {
+      lock_guard<recursive_mutex> riskLock(riskMutex);
+      if (!dirtyProducts.empty()) {
+        RemarkDirty();
+      }
+    }
+    lock.lock();
+  }
+}
+
 inline PV01<Bond>& BondRiskService::GetData(string key) 
 {
+  lock_guard<recursive_mutex> lock(riskMutex);
   auto it = riskMap.find(key);
   if (it != riskMap.end()) {
     return it->second;
@@ -169,6 +328,7 @@ inline void BondRiskService::OnMessage(PV01<Bond> &data)
 
 inline void BondRiskService::AddListener(ServiceListener<PV01<Bond>> *listener) 
 {
+  lock_guard<recursive_mutex> lock(riskMutex);
   listeners.push_back(listener);
 }
 
@@ -179,19 +339,10 @@ inline const vector<ServiceListener<PV01<Bond>>*>& BondRiskService::GetListeners
 
 inline void BondRiskService::AddPosition(Position<Bond> &position) 
 {
+  lock_guard<recursive_mutex> lock(riskMutex);
   string productId = position.GetProduct().GetProductId();
 
-  Price<Bond> bondPrice = pricingService.GetData(productId);
-  double midPrice = bondPrice.GetMid();
-
-  double yield = (position.GetProduct()).ComputeYield(midPrice, 2);
-  //cout << "computed yield for " << position.GetProduct().GetProductId() << ": " << yield << endl;
-
-  double modifiedDuration = position.GetProduct().CalculateDuration(yield, position.GetProduct().GetFaceValue(), 2);
-  //cout << "Modified Duration for " << position.GetProduct().GetProductId() << ": " << modifiedDuration << endl;
-  //double modifiedDuration = 1;
-  
-  double pv01PerUnit = modifiedDuration * midPrice * 0.0001; // fix this value 
+  double pv01PerUnit = GetPV01PerUnit(position.GetProduct());
   
   double pv01Risk = pv01PerUnit * position.GetAggregatePosition();
   // cout << "Aggregate Position for " << position.GetProduct().GetProductId() << ": " << position.GetAggregatePosition() << endl;
@@ -199,6 +350,8 @@ inline void BondRiskService::AddPosition(Position<Bond> &position)
 
   auto it = riskMap.find(productId);
   bool isNew = (it == riskMap.end());
+  double previousPV01 = isNew ? 0.0 : it->second.GetPV01();
+  long previousQuantity = isNew ? 0 : it->second.GetQuantity();
   if (isNew) {
     PV01<Bond> pv01(position.GetProduct(), pv01Risk, position.GetAggregatePosition());
     it = riskMap.insert(make_pair(productId, pv01)).first;
@@ -208,6 +361,8 @@ inline void BondRiskService::AddPosition(Position<Bond> &position)
     riskMap.emplace(productId, it->second);
   }
 
+  PublishSnapshot(productId, RiskSnapshot{pv01Risk, pv01PerUnit, position.GetAggregatePosition(), 1});
+
   // cout << "Storing in riskMap - product " << productId
   //     << ", pv01: " << pv01Risk 
   //     << ", Quantity: " << position.GetAggregatePosition() << endl;
@@ -222,10 +377,19 @@ inline void BondRiskService::AddPosition(Position<Bond> &position)
       listener->ProcessUpdate(it->second);
     }
   }
+
+  AdjustBuckets(productId, pv01Risk - previousPV01, position.GetAggregatePosition() - previousQuantity);
 }
 
 inline PV01<BucketedSector<Bond>> BondRiskService::GetBucketedRisk(const BucketedSector<Bond> &sector) const 
 {
+  lock_guard<recursive_mutex> lock(riskMutex);
+  auto bucket = bucketIds.find(sector.GetName());
+  if (bucket != bucketIds.end()) {
+    return buckets[bucket->second];
+  }
+
+  // Unregistered sectors are summed on the spot
   //static PV01<BucketedSector<Bond>> bucketedPV01(sector, 0.0, 0);
   double totalPV01 = 0.0;
   long totalQuantity = 0;
@@ -244,30 +408,246 @@ inline PV01<BucketedSector<Bond>> BondRiskService::GetBucketedRisk(const Buckete
 
 }
 
+double BondRiskService::GetPV01PerUnit(const Bond &product)
+{
+  const string &productId = product.GetProductId();
+  PriceSnapshot price;
+  if (!pricingService.GetSnapshot(productId, price)) {
+    // Price versions start at 1, so version 0 is a PV01 per unit restored from a checkpoint
+    auto restored = unitRisks.find(productId);
+    if (restored != unitRisks.end() && restored->second.priceVersion == 0) {
+      return restored->second.pv01PerUnit;
+    }
+    throw runtime_error("Price key not found: " + productId);
+  }
+
+  UnitRisk &cached = unitRisks[productId];
+  uint32_t businessDay = BusinessDate::GetDayNumber();
+  if (cached.priceVersion != price.version || cached.businessDay != businessDay) {
+    double yield = product.ComputeYield(price.mid, 2);
+    double duration = product.CalculateDuration(yield, product.GetFaceValue(), 2);
+    cached = UnitRisk{duration * price.mid * 0.0001, price.version, businessDay, cached.dirty};
+  }
+  return cached.pv01PerUnit;
+}
+
+uint32_t BondRiskService::AddBucket(const BucketedSector<Bond> &sector)
+{
+  lock_guard<recursive_mutex> lock(riskMutex);
+  auto existing = bucketIds.find(sector.GetName());
+  if (existing != bucketIds.end()) {
+    return existing->second;
+  }
+
+  // Start from the risk already held, then follow changes
+  uint32_t id = static_cast<uint32_t>(buckets.size());
+  double totalPV01 = 0.0;
+  long totalQuantity = 0;
+  for (const Bond &bond : sector.GetProducts()) {
+    vector<uint32_t> &memberOf = productBuckets[bond.GetProductId()];
+    if (find(memberOf.begin(), memberOf.end(), id) != memberOf.end()) {
+      continue;
+    }
+    memberOf.push_back(id);
+    auto it = riskMap.find(bond.GetProductId());
+    if (it != riskMap.end()) {
+      totalPV01 += it->second.GetPV01();
+      totalQuantity += it->second.GetQuantity();
+    }
+  }
+  buckets.emplace_back(sector, totalPV01, totalQuantity);
+  bucketIds.emplace(sector.GetName(), id);
+  return id;
+}
+
+inline void BondRiskService::AddBucketListener(ServiceListener<PV01<BucketedSector<Bond>>> *listener)
+{
+  lock_guard<recursive_mutex> lock(riskMutex);
+  bucketListeners.push_back(listener);
+}
+
+inline void BondRiskService::AdjustBuckets(const string &productId, double pv01Change, long quantityChange)
+{
+  if (buckets.empty()) return;
+  auto it = productBuckets.find(productId);
+  if (it == productBuckets.end()) return;
+
+  for (uint32_t id : it->second) {
+    PV01<BucketedSector<Bond>> &bucket = buckets[id];
+    bucket.Update(bucket.GetPV01() + pv01Change, bucket.GetQuantity() + quantityChange);
+    for (auto listener : bucketListeners) {
+      listener->ProcessUpdate(bucket);
+    }
+  }
+}
+
+inline bool BondRiskService::GetSnapshot(const string &productId, RiskSnapshot &snapshot) const
+{
+  return snapshots.Read(productId, snapshot);
+}
+
+inline void BondRiskService::PublishSnapshot(const string &productId, RiskSnapshot snapshot)
+{
+  size_t slot = snapshots.Find(productId);
+  if (slot == SnapshotTable<RiskSnapshot>::NPOS) {
+    snapshots.Publish(productId, snapshot);
+  }
+  else {
+    snapshot.version = snapshots.Read(slot).version + 1;
+    snapshots.Publish(slot, snapshot);
+  }
+}
+
+template<typename F>
+void BondRiskService::ForEachRisk(F f) const
+{
+  lock_guard<recursive_mutex> lock(riskMutex);
+  for (const auto &entry : riskMap) {
+    f(entry.second);
+  }
+}
+
+void BondRiskService::RestoreRisk(const Bond &product, double pv01, long quantity)
+{
+  lock_guard<recursive_mutex> lock(riskMutex);
+  const string &productId = product.GetProductId();
+  auto it = riskMap.find(productId);
+  if (it == riskMap.end()) {
+    riskMap.insert(make_pair(productId, PV01<Bond>(product, pv01, quantity)));
+    AdjustBuckets(productId, pv01, quantity);
+  }
+  else {
+    AdjustBuckets(productId, pv01 - it->second.GetPV01(), quantity - it->second.GetQuantity());
+    it->second = PV01<Bond>(product, pv01, quantity);
+  }
+
+  double pv01PerUnit = (quantity != 0) ? pv01 / quantity : 0.0;
+  PriceSnapshot price;
+  if (!pricingService.GetSnapshot(productId, price)) {
+    UnitRisk &cached = unitRisks[productId];
+    cached = UnitRisk{pv01PerUnit, 0, BusinessDate::GetDayNumber(), cached.dirty};
+  }
+  PublishSnapshot(productId, RiskSnapshot{pv01, pv01PerUnit, quantity, 1});
+}
+
+void BondRiskService::Remark(const vector<PV01<Bond>*> &risks)
+{
+  BondBatch batch;
+  vector<uint64_t> priceVersions;
+  for (PV01<Bond> *risk : risks) {
+    const string &productId = risk->GetProduct().GetProductId();
+    PriceSnapshot price;
+    if (!pricingService.GetSnapshot(productId, price)) {
+      throw runtime_error("Price key not found: " + productId);
+    }
+    batch.Add(risk->GetProduct(), price.mid);
+    priceVersions.push_back(price.version);
+  }
+  batch.Compute();
+
+  uint32_t businessDay = BusinessDate::GetDayNumber();
+  for (size_t i = 0; i < risks.size(); ++i) {
+    PV01<Bond> &risk = *risks[i];
+    unitRisks[risk.GetProduct().GetProductId()] = UnitRisk{batch.pv01PerUnit[i], priceVersions[i], businessDay, false};
+    long quantity = risk.GetQuantity();
+    double pv01Risk = batch.pv01PerUnit[i] * quantity;
+    double pv01Change = pv01Risk - risk.GetPV01();
+    risk = PV01<Bond>(risk.GetProduct(), pv01Risk, quantity);
+    PublishSnapshot(risk.GetProduct().GetProductId(), RiskSnapshot{pv01Risk, batch.pv01PerUnit[i], quantity, 1});
+    for (auto listener : listeners) {
+      listener->ProcessUpdate(risk);
+    }
+    AdjustBuckets(risk.GetProduct().GetProductId(), pv01Change, 0);
+  }
+}
+
+void BondRiskService::RecomputeAll()
+{
+  lock_guard<recursive_mutex> lock(riskMutex);
+  vector<PV01<Bond>*> risks;
+  for (auto &entry : riskMap) {
+    risks.push_back(&entry.second);
+  }
+  Remark(risks);
+  dirtyProducts.clear();
+  lastRemark = Clock::now();
+}
+
+void BondRiskService::RemarkDirty()
+{
+  lock_guard<recursive_mutex> lock(riskMutex);
+  // Skip products re-risked by a position event since their tick, and ones no longer held
+  vector<PV01<Bond>*> risks;
+  uint32_t businessDay = BusinessDate::GetDayNumber();
+  for (const string &productId : dirtyProducts) {
+    UnitRisk &cached = unitRisks[productId];
+    cached.dirty = false;
+    auto it = riskMap.find(productId);
+    PriceSnapshot price;
+    if (it == riskMap.end() || !pricingService.GetSnapshot(productId, price) ||
+        (cached.priceVersion == price.version && cached.businessDay == businessDay)) {
+      continue;
+    }
+    risks.push_back(&it->second);
+  }
+  dirtyProducts.clear();
+  lastRemark = Clock::now();
+
+  if (!risks.empty()) {
+    Remark(risks);
+  }
+}
+
+inline void BondRiskService::ProcessAdd(Price<Bond> &data)
+{
+  lock_guard<recursive_mutex> lock(riskMutex);
+  const string &productId = data.GetProduct().GetProductId();
+  if (riskMap.find(productId) != riskMap.end()) {
+    UnitRisk &cached = unitRisks[productId];
+    if (!cached.dirty) {
+      cached.dirty = true;
+      dirtyProducts.push_back(productId);
+    }
+  }
+  RemarkIfDue();
+}
+
+inline void BondRiskService::RemarkIfDue()
+{
+  if (!dirtyProducts.empty() && Clock::now() - lastRemark >= remarkInterval) {
+    RemarkDirty();
+  }
+}
+
+inline void BondRiskService::ProcessRemove(Price<Bond> &data)
+{
+}
+
+inline void BondRiskService::ProcessUpdate(Price<Bond> &data)
+{
+  ProcessAdd(data);
+}
+
 inline void BondRiskService::ProcessAdd(Position<Bond> &data) 
 {
+  lock_guard<recursive_mutex> lock(riskMutex);
   AddPosition(data);
+  RemarkIfDue();
 }
 inline void BondRiskService::ProcessRemove(Position<Bond> &data) 
 {
+  lock_guard<recursive_mutex> lock(riskMutex);
   string productId = data.GetProduct().GetProductId();
   auto it = riskMap.find(productId);
   if (it != riskMap.end()) {
-    Price<Bond> bondPrice = pricingService.GetData(productId);
-    double midPrice = bondPrice.GetMid();
-
-    double yield = data.GetProduct().ComputeYield(midPrice, 2);
-
-    double modifiedDuration = data.GetProduct().CalculateDuration(yield, 1000, 2);
-    //double modifiedDuration = 1;
-    
-    double pv01PerUnit = modifiedDuration * midPrice * 0.0001; // fix this value 
+    double pv01PerUnit = GetPV01PerUnit(data.GetProduct());
 
     double pv01Risk = pv01PerUnit * (-data.GetAggregatePosition());
 
     double updatedPV01 = it->second.GetPV01() + pv01Risk;
     long updatedQuant = it->second.GetQuantity() + (-data.GetAggregatePosition());
     
+    AdjustBuckets(productId, updatedPV01 - it->second.GetPV01(), updatedQuant - it->second.GetQuantity());
     if (updatedQuant == 0) {
       riskMap.erase(it);  
     }
@@ -284,7 +664,9 @@ inline void BondRiskService::ProcessRemove(Position<Bond> &data)
 }
 inline void BondRiskService::ProcessUpdate(Position<Bond> &data) 
 {
+  lock_guard<recursive_mutex> lock(riskMutex);
   AddPosition(data);
+  RemarkIfDue();
 }
 
 #endif
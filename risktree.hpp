@@ -0,0 +1,293 @@
+/**
+ * risktree.hpp
+ * Hierarchical PV01 aggregation from instrument/book leaves up through books
+ * and desks to the firm.
+ */
+#ifndef RISK_TREE_HPP
+#define RISK_TREE_HPP
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "soa.hpp"
+#include "positionservice.hpp"
+#include "riskservice.hpp"
+
+using namespace std;
+
+/**
+ * A node of the risk tree with its running PV01 and quantity.
+ */
+struct RiskNode
+{
+  string name;
+  uint32_t parent;
+  double pv01;
+  long quantity;
+};
+
+/**
+ * Risk tree over the position and risk services. Leaves are instrument/book
+ * cells; each leaf hangs under its book's node, books hang under desks, and
+ * desks under the firm root. Any number of levels can sit between a book and
+ * the firm, since nodes are added with AddNode under any existing parent.
+ *
+ * Every node keeps a running sum, so a change to one leaf walks one path of
+ * O(depth) nodes and any node reads in O(1). Position deltas move a leaf's
+ * quantity at the instrument's last PV01 per unit; a risk update that changes
+ * the PV01 per unit revalues only the books holding that instrument. Books not
+ * assigned with AssignBook sit under DEFAULT_DESK.
+ *
+ * Risk updates can arrive from the risk service's remark thread while position
+ * deltas arrive on the booking thread, so both take the tree's lock, as do the
+ * readers, which return nodes by value.
+ */
+class BondRiskTree : public PositionDeltaListener<Bond>, public ServiceListener<PV01<Bond>>
+{
+
+public:
+
+  static constexpr uint32_t NONE = ~static_cast<uint32_t>(0);
+  static constexpr const char *FIRM = "FIRM";
+  static constexpr const char *DEFAULT_DESK = "UNASSIGNED";
+
+  // ctor for a tree reading PV01 per unit from a risk service
+  explicit BondRiskTree(const BondRiskService *_riskService);
+
+  // Add a node under an existing one (the firm by default); returns its id
+  uint32_t AddNode(const string &name, const string &parent = FIRM);
+
+  // Put a book under a node, moving its risk along with it
+  void AssignBook(const string &book, const string &parent);
+
+  // Get a node by name, or nullptr
+  const RiskNode* GetNode(const string &name) const;
+
+  // Get a node by id, and the root
+  RiskNode GetNode(uint32_t node) const;
+  RiskNode GetFirm() const;
+
+  // PV01 of one product in one book
+  double GetPV01(const string &productId, const string &book) const;
+
+  // Position deltas move one leaf
+  void ProcessDelta(const Position<Bond> &position, const PositionDelta &delta) override;
+
+  // Risk updates revalue an instrument's leaves when its PV01 per unit moves
+  void ProcessAdd(PV01<Bond> &data) override;
+  void ProcessRemove(PV01<Bond> &data) override;
+  void ProcessUpdate(PV01<Bond> &data) override;
+
+private:
+  struct Leaf
+  {
+    long quantity;
+    double pv01;
+  };
+
+  static uint64_t LeafKey(uint32_t instrument, uint32_t book);
+
+  uint32_t FindNode(const string &name) const;
+  uint32_t BookNode(uint32_t book, const string &name);
+  void Propagate(uint32_t node, double pv01Change, long quantityChange);
+  void Revalue(uint32_t instrument, double pv01PerUnit);
+
+  const BondRiskService *riskService;
+
+  // Held by every public method; recursive since adding a book's node goes through AddNode
+  mutable recursive_mutex treeMutex;
+
+  vector<RiskNode> nodes;
+  unordered_map<string, uint32_t> nodeIds;
+
+  // Leaves by instrument and book id from the position matrix
+  unordered_map<uint64_t, Leaf> leaves;
+  vector<uint32_t> bookNodes;
+  vector<vector<uint32_t>> instrumentBooks;
+  vector<double> unitPV01s;
+  vector<uint8_t> instrumentSeen;
+  unordered_map<string, uint32_t> instrumentIds;
+  unordered_map<string, uint32_t> bookIds;
+
+};
+
+BondRiskTree::BondRiskTree(const BondRiskService *_riskService) : riskService(_riskService)
+{
+  nodes.push_back(RiskNode{FIRM, NONE, 0.0, 0});
+  nodeIds.emplace(FIRM, 0);
+  AddNode(DEFAULT_DESK);
+}
+
+inline uint64_t BondRiskTree::LeafKey(uint32_t instrument, uint32_t book)
+{
+  return (static_cast<uint64_t>(instrument) << 32) | book;
+}
+
+inline uint32_t BondRiskTree::FindNode(const string &name) const
+{
+  auto it = nodeIds.find(name);
+  return (it != nodeIds.end()) ? it->second : NONE;
+}
+
+uint32_t BondRiskTree::AddNode(const string &name, const string &parent)
+{
+  lock_guard<recursive_mutex> lock(treeMutex);
+  uint32_t existing = FindNode(name);
+  if (existing != NONE) {
+    return existing;
+  }
+  uint32_t parentId = FindNode(parent);
+  if (parentId == NONE) {
+    throw invalid_argument("Risk tree has no node " + parent);
+  }
+  uint32_t id = static_cast<uint32_t>(nodes.size());
+  nodes.push_back(RiskNode{name, parentId, 0.0, 0});
+  nodeIds.emplace(name, id);
+  return id;
+}
+
+void BondRiskTree::AssignBook(const string &book, const string &parent)
+{
+  lock_guard<recursive_mutex> lock(treeMutex);
+  uint32_t parentId = FindNode(parent);
+  if (parentId == NONE) {
+    throw invalid_argument("Risk tree has no node " + parent);
+  }
+  uint32_t node = FindNode(book);
+  if (node == NONE) {
+    AddNode(book, parent);
+    return;
+  }
+  for (uint32_t ancestor = parentId; ancestor != NONE; ancestor = nodes[ancestor].parent) {
+    if (ancestor == node) {
+      throw invalid_argument("Cannot put " + book + " under itself or its own descendant " + parent);
+    }
+  }
+
+  // Take the book's totals off its old path and onto the new one
+  RiskNode &bookNode = nodes[node];
+  Propagate(bookNode.parent, -bookNode.pv01, -bookNode.quantity);
+  bookNode.parent = parentId;
+  Propagate(parentId, bookNode.pv01, bookNode.quantity);
+}
+
+inline uint32_t BondRiskTree::BookNode(uint32_t book, const string &name)
+{
+  if (book >= bookNodes.size()) {
+    bookNodes.resize(book + 1, NONE);
+  }
+  if (bookNodes[book] == NONE) {
+    bookIds.emplace(name, book);
+    uint32_t node = FindNode(name);
+    bookNodes[book] = (node != NONE) ? node : AddNode(name, DEFAULT_DESK);
+  }
+  return bookNodes[book];
+}
+
+inline const RiskNode* BondRiskTree::GetNode(const string &name) const
+{
+  lock_guard<recursive_mutex> lock(treeMutex);
+  uint32_t node = FindNode(name);
+  return (node != NONE) ? &nodes[node] : nullptr;
+}
+
+inline RiskNode BondRiskTree::GetNode(uint32_t node) const
+{
+  lock_guard<recursive_mutex> lock(treeMutex);
+  return nodes[node];
+}
+
+inline RiskNode BondRiskTree::GetFirm() const
+{
+  lock_guard<recursive_mutex> lock(treeMutex);
+  return nodes[0];
+}
+
+double BondRiskTree::GetPV01(const string &productId, const string &book) const
+{
+  lock_guard<recursive_mutex> lock(treeMutex);
+  auto instrument = instrumentIds.find(productId);
+  auto bookId = bookIds.find(book);
+  if (instrument == instrumentIds.end() || bookId == bookIds.end()) {
+    return 0.0;
+  }
+  auto leaf = leaves.find(LeafKey(instrument->second, bookId->second));
+  return (leaf != leaves.end()) ? leaf->second.pv01 : 0.0;
+}
+
+inline void BondRiskTree::Propagate(uint32_t node, double pv01Change, long quantityChange)
+{
+  for (; node != NONE; node = nodes[node].parent) {
+    nodes[node].pv01 += pv01Change;
+    nodes[node].quantity += quantityChange;
+  }
+}
+
+void BondRiskTree::ProcessDelta(const Position<Bond> &position, const PositionDelta &delta)
+{
+  lock_guard<recursive_mutex> lock(treeMutex);
+  uint32_t instrument = delta.instrument;
+  if (instrument >= unitPV01s.size()) {
+    unitPV01s.resize(instrument + 1, 0.0);
+    instrumentBooks.resize(instrument + 1);
+    instrumentSeen.resize(instrument + 1, 0);
+  }
+  if (!instrumentSeen[instrument]) {
+    instrumentSeen[instrument] = 1;
+    instrumentIds.emplace(position.GetProduct().GetProductId(), instrument);
+
+    // Start a new instrument from whatever risk already has for it
+    RiskSnapshot risk;
+    if (riskService && riskService->GetSnapshot(position.GetProduct().GetProductId(), risk)) {
+      unitPV01s[instrument] = risk.pv01PerUnit;
+    }
+  }
+
+  uint32_t node = BookNode(delta.book, position.GetBookName(delta.book));
+  auto inserted = leaves.emplace(LeafKey(instrument, delta.book), Leaf{0, 0.0});
+  if (inserted.second) {
+    instrumentBooks[instrument].push_back(delta.book);
+  }
+
+  Leaf &leaf = inserted.first->second;
+  double pv01 = unitPV01s[instrument] * delta.bookPosition;
+  Propagate(node, pv01 - leaf.pv01, delta.bookPosition - leaf.quantity);
+  leaf.quantity = delta.bookPosition;
+  leaf.pv01 = pv01;
+}
+
+void BondRiskTree::Revalue(uint32_t instrument, double pv01PerUnit)
+{
+  unitPV01s[instrument] = pv01PerUnit;
+  for (uint32_t book : instrumentBooks[instrument]) {
+    Leaf &leaf = leaves[LeafKey(instrument, book)];
+    double pv01 = pv01PerUnit * leaf.quantity;
+    Propagate(bookNodes[book], pv01 - leaf.pv01, 0);
+    leaf.pv01 = pv01;
+  }
+}
+
+void BondRiskTree::ProcessAdd(PV01<Bond> &data)
+{
+  lock_guard<recursive_mutex> lock(treeMutex);
+  auto it = instrumentIds.find(data.GetProduct().GetProductId());
+  RiskSnapshot risk;
+  if (it == instrumentIds.end() || !riskService || !riskService->GetSnapshot(it->first, risk)) {
+    return;
+  }
+  if (risk.pv01PerUnit != unitPV01s[it->second]) {
+    Revalue(it->second, risk.pv01PerUnit);
+  }
+}
+
+inline void BondRiskTree::ProcessRemove(PV01<Bond> &data)
+{
+}
+
+inline void BondRiskTree::ProcessUpdate(PV01<Bond> &data)
+{
+  ProcessAdd(data);
+}
+
+#endif
@@ -0,0 +1,277 @@
+/**
+ * shardedinquiryservice.hpp
+ * Multi-threaded inquiry service: inquiries are sharded by id across worker
+ * threads, each running its own InquiryBook.
+ */
+#ifndef SHARDED_INQUIRY_SERVICE_HPP
+#define SHARDED_INQUIRY_SERVICE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include "inquiryservice.hpp"
+
+enum InquiryCommandType { INQUIRY_MESSAGE, INQUIRY_QUOTE, INQUIRY_REJECT };
+
+/**
+ * A unit of work for an inquiry shard: a client message, or a quote/reject
+ * decision for an inquiry already owned by the shard.
+ */
+struct InquiryCommand
+{
+  InquiryCommandType type;
+  string inquiryId;
+  optional<Inquiry<Bond>> inquiry;
+  double price;
+};
+
+/**
+ * One worker thread with its own command queue and InquiryBook. Every command for
+ * a given inquiry id lands on the same shard, so each lifecycle stays ordered.
+ */
+class InquiryShard
+{
+
+public:
+
+  InquiryShard(const InquiryQuoter &quoter, const InquiryTimeouts &timeouts,
+               const vector<ServiceListener<Inquiry<Bond>>*> &listeners, mutex *notifyMutex);
+  ~InquiryShard();
+
+  // Queue a command for the worker
+  void Submit(InquiryCommand &&command);
+
+  // Block until the queue is empty and the worker is idle
+  void Flush();
+
+  // The shard's book; only safe to use while the shard is flushed
+  InquiryBook& GetBook();
+
+private:
+  void Run();
+
+  InquiryBook book;
+  chrono::milliseconds tick;
+  mutex queueMutex;
+  condition_variable workAvailable;
+  condition_variable idle;
+  deque<InquiryCommand> queue;
+  bool busy;
+  bool stopping;
+  thread worker;
+
+};
+
+/**
+ * Bond inquiry service running InquiryBooks on a pool of worker threads, one per
+ * shard. OnMessage, SendQuote and RejectInquiry hash the inquiry id to a shard and
+ * return immediately. Listener and connector callbacks are serialized under one
+ * mutex because the listeners in this system are not thread-safe; quoting and the
+ * state machine run outside it. Listeners must be added before traffic starts.
+ * Each worker also wakes once per timeout tick to expire stale inquiries.
+ */
+class BondShardedInquiryService : public InquiryService<Bond>
+{
+
+public:
+
+  BondShardedInquiryService(BondPricingService *pricingService, BondPositionService *positionService = nullptr,
+                            BondRiskService *riskService = nullptr,
+                            size_t shardCount = thread::hardware_concurrency(),
+                            const InquiryQuoteParameters &parameters = InquiryQuoteParameters(),
+                            const InquiryTimeouts &timeouts = InquiryTimeouts());
+  ~BondShardedInquiryService();
+
+  // Get a live inquiry; flushes its shard first, so call only when traffic is quiet
+  Inquiry<Bond>& GetData(string key) override;
+  void OnMessage(Inquiry<Bond> &data) override;
+  void AddListener(ServiceListener<Inquiry<Bond>>* listener) override;
+  const vector<ServiceListener<Inquiry<Bond>>*>& GetListeners() const override;
+  void SendQuote(const string& inquiryId, double price) override;
+  void RejectInquiry(const string& inquiryId) override;
+  void SetConnector(Connector<Inquiry<Bond>>* connector) override;
+  void Flush() override;
+
+  size_t GetShardCount() const;
+
+  // Archive of a shard; only safe to use after Flush
+  const InquiryArchive& GetArchive(size_t shard);
+
+private:
+  InquiryShard& ShardFor(const string &inquiryId);
+
+  vector<ServiceListener<Inquiry<Bond>>*> listeners;
+  mutex notifyMutex;
+  vector<InquiryShard*> shards;
+
+};
+
+InquiryShard::InquiryShard(const InquiryQuoter &quoter, const InquiryTimeouts &timeouts,
+                           const vector<ServiceListener<Inquiry<Bond>>*> &listeners, mutex *notifyMutex) :
+  book(quoter, timeouts, listeners, notifyMutex), tick(timeouts.tick), busy(false), stopping(false)
+{
+  worker = thread(&InquiryShard::Run, this);
+}
+
+InquiryShard::~InquiryShard()
+{
+  {
+    lock_guard<mutex> lock(queueMutex);
+    stopping = true;
+  }
+  workAvailable.notify_one();
+  worker.join();
+}
+
+inline void InquiryShard::Submit(InquiryCommand &&command)
+{
+  {
+    lock_guard<mutex> lock(queueMutex);
+    queue.push_back(move(command));
+  }
+  workAvailable.notify_one();
+}
+
+inline void InquiryShard::Flush()
+{
+  unique_lock<mutex> lock(queueMutex);
+  idle.wait(lock, [this] { return queue.empty() && !busy; });
+}
+
+inline InquiryBook& InquiryShard::GetBook()
+{
+  return book;
+}
+
+void InquiryShard::Run()
+{
+  deque<InquiryCommand> batch;
+  unique_lock<mutex> lock(queueMutex);
+  for (;;) {
+    workAvailable.wait_for(lock, tick, [this] { return stopping || !queue.empty(); });
+    if (queue.empty() && stopping) {
+      return;
+    }
+
+    // Take the whole backlog at once so producers only contend on the swap
+    batch.swap(queue);
+    busy = true;
+    lock.unlock();
+
+    try {
+      book.ExpireInquiries(TimerWheel::Clock::now());
+    }
+    catch (const exception &e) {
+      cerr << "Inquiry shard failed expiring inquiries: " << e.what() << endl;
+    }
+
+    for (InquiryCommand &command : batch) {
+      try {
+        switch (command.type) {
+          case INQUIRY_MESSAGE: book.OnMessage(*command.inquiry); break;
+          case INQUIRY_QUOTE: book.SendQuote(command.inquiryId, command.price); break;
+          case INQUIRY_REJECT: book.RejectInquiry(command.inquiryId); break;
+        }
+      }
+      catch (const exception &e) {
+        cerr << "Inquiry shard failed on " << command.inquiryId << ": " << e.what() << endl;
+      }
+    }
+    batch.clear();
+
+    lock.lock();
+    busy = false;
+    if (queue.empty()) {
+      idle.notify_all();
+    }
+  }
+}
+
+BondShardedInquiryService::BondShardedInquiryService(BondPricingService *pricingService, BondPositionService *positionService,
+                                                     BondRiskService *riskService, size_t shardCount,
+                                                     const InquiryQuoteParameters &parameters,
+                                                     const InquiryTimeouts &timeouts)
+{
+  InquiryQuoter quoter(pricingService, positionService, riskService, parameters);
+  if (shardCount == 0) {
+    shardCount = 1;
+  }
+  for (size_t i = 0; i < shardCount; ++i) {
+    shards.push_back(new InquiryShard(quoter, timeouts, listeners, &notifyMutex));
+  }
+}
+
+BondShardedInquiryService::~BondShardedInquiryService()
+{
+  for (InquiryShard *shard : shards) {
+    delete shard;
+  }
+}
+
+inline InquiryShard& BondShardedInquiryService::ShardFor(const string &inquiryId)
+{
+  return *shards[hash<string>()(inquiryId) % shards.size()];
+}
+
+inline Inquiry<Bond>& BondShardedInquiryService::GetData(string key)
+{
+  InquiryShard &shard = ShardFor(key);
+  shard.Flush();
+  return shard.GetBook().GetData(key);
+}
+
+inline void BondShardedInquiryService::OnMessage(Inquiry<Bond> &data)
+{
+  ShardFor(data.GetInquiryId()).Submit(InquiryCommand{INQUIRY_MESSAGE, data.GetInquiryId(), data, 0.0});
+}
+
+inline void BondShardedInquiryService::AddListener(ServiceListener<Inquiry<Bond>>* listener)
+{
+  lock_guard<mutex> lock(notifyMutex);
+  listeners.push_back(listener);
+}
+
+inline const vector<ServiceListener<Inquiry<Bond>>*>& BondShardedInquiryService::GetListeners() const
+{
+  return listeners;
+}
+
+inline void BondShardedInquiryService::SendQuote(const string& inquiryId, double price)
+{
+  ShardFor(inquiryId).Submit(InquiryCommand{INQUIRY_QUOTE, inquiryId, nullopt, price});
+}
+
+inline void BondShardedInquiryService::RejectInquiry(const string& inquiryId)
+{
+  ShardFor(inquiryId).Submit(InquiryCommand{INQUIRY_REJECT, inquiryId, nullopt, 0.0});
+}
+
+inline void BondShardedInquiryService::SetConnector(Connector<Inquiry<Bond>>* connector)
+{
+  Flush();
+  for (InquiryShard *shard : shards) {
+    shard->GetBook().SetConnector(connector);
+  }
+}
+
+inline void BondShardedInquiryService::Flush()
+{
+  for (InquiryShard *shard : shards) {
+    shard->Flush();
+  }
+}
+
+inline size_t BondShardedInquiryService::GetShardCount() const
+{
+  return shards.size();
+}
+
+inline const InquiryArchive& BondShardedInquiryService::GetArchive(size_t shard)
+{
+  shards[shard]->Flush();
+  return shards[shard]->GetBook().GetArchive();
+}
+
+#endif
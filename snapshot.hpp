@@ -0,0 +1,244 @@
+/**
+ * snapshot.hpp
+ * Lock-free latest-value containers for publishing state from the thread that
+ * owns it to any number of reader threads.
+ */
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+using namespace std;
+
+/**
+ * Single-writer sequence lock around a small trivially copyable value.
+ * The value is held as relaxed atomic words so torn reads are detected by the
+ * sequence check rather than being undefined behaviour.
+ * Type T is the value type; its size must be a multiple of 8 bytes.
+ */
+template<typename T>
+class SeqLock
+{
+
+public:
+
+  SeqLock();
+
+  // Publish a new value (owning thread only)
+  void Store(const T &value);
+
+  // Read a consistent copy of the value (any thread)
+  T Load() const;
+
+  // Number of values published so far
+  uint64_t GetVersion() const;
+
+private:
+  static_assert(is_trivially_copyable<T>::value, "SeqLock values must be trivially copyable");
+  static_assert(sizeof(T) % sizeof(uint64_t) == 0, "SeqLock values must be a whole number of 64-bit words");
+  static constexpr size_t WORDS = sizeof(T) / sizeof(uint64_t);
+
+  atomic<uint64_t> sequence;
+  atomic<uint64_t> words[WORDS];
+
+};
+
+/**
+ * Fixed-capacity, string-keyed table of SeqLock values.
+ * Keys are only ever added, and only by the owning thread; readers on other
+ * threads probe the table without locks.
+ * Type T is the value type, with the same requirements as SeqLock.
+ */
+template<typename T>
+class SnapshotTable
+{
+
+public:
+
+  static constexpr size_t NPOS = ~static_cast<size_t>(0);
+
+  // ctor for a table holding up to capacity keys
+  explicit SnapshotTable(size_t capacity = 4096);
+  ~SnapshotTable();
+
+  SnapshotTable(const SnapshotTable &) = delete;
+  SnapshotTable& operator=(const SnapshotTable &) = delete;
+
+  // Publish a value under a key, adding the key on first use (owning thread only)
+  size_t Publish(const string &key, const T &value);
+
+  // Publish a value on a slot returned by Publish or Find (owning thread only)
+  void Publish(size_t slot, const T &value);
+
+  // Find the slot for a key, or NPOS (any thread)
+  size_t Find(const string &key) const;
+
+  // Read the value for a key; false if the key was never published (any thread)
+  bool Read(const string &key, T &value) const;
+
+  // Read the value on a slot (any thread)
+  T Read(size_t slot) const;
+
+private:
+  struct Slot
+  {
+    atomic<uint64_t> hash;
+    const string *key;
+    SeqLock<T> value;
+  };
+
+  static uint64_t Hash(const string &key);
+
+  Slot *slots;
+  size_t mask;
+  size_t capacity;
+  size_t size;
+
+};
+
+template<typename T>
+SeqLock<T>::SeqLock() : sequence(0)
+{
+  for (size_t i = 0; i < WORDS; ++i) {
+    words[i].store(0, memory_order_relaxed);
+  }
+}
+
+template<typename T>
+inline void SeqLock<T>::Store(const T &value)
+{
+  uint64_t buffer[WORDS];
+  memcpy(buffer, &value, sizeof(T));
+
+  uint64_t s = sequence.load(memory_order_relaxed);
+  sequence.store(s + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (size_t i = 0; i < WORDS; ++i) {
+    words[i].store(buffer[i], memory_order_relaxed);
+  }
+  sequence.store(s + 2, memory_order_release);
+}
+
+template<typename T>
+inline T SeqLock<T>::Load() const
+{
+  uint64_t buffer[WORDS];
+  for (;;) {
+    uint64_t before = sequence.load(memory_order_acquire);
+    if (before & 1) continue;
+    for (size_t i = 0; i < WORDS; ++i) {
+      buffer[i] = words[i].load(memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (sequence.load(memory_order_relaxed) == before) break;
+  }
+
+  T value;
+  memcpy(&value, buffer, sizeof(T));
+  return value;
+}
+
+template<typename T>
+inline uint64_t SeqLock<T>::GetVersion() const
+{
+  return sequence.load(memory_order_acquire) / 2;
+}
+
+template<typename T>
+SnapshotTable<T>::SnapshotTable(size_t _capacity) : size(0)
+{
+  size_t buckets = 16;
+  while (buckets < _capacity * 2) buckets <<= 1;
+  slots = new Slot[buckets];
+  for (size_t i = 0; i < buckets; ++i) {
+    slots[i].hash.store(0, memory_order_relaxed);
+    slots[i].key = nullptr;
+  }
+  mask = buckets - 1;
+  capacity = _capacity;
+}
+
+template<typename T>
+SnapshotTable<T>::~SnapshotTable()
+{
+  for (size_t i = 0; i <= mask; ++i) {
+    delete slots[i].key;
+  }
+  delete[] slots;
+}
+
+template<typename T>
+inline uint64_t SnapshotTable<T>::Hash(const string &key)
+{
+  // Zero marks an empty slot
+  return static_cast<uint64_t>(hash<string>()(key)) | 1;
+}
+
+template<typename T>
+size_t SnapshotTable<T>::Publish(const string &key, const T &value)
+{
+  size_t slot = Find(key);
+  if (slot != NPOS) {
+    slots[slot].value.Store(value);
+    return slot;
+  }
+
+  if (size == capacity) {
+    throw runtime_error("Snapshot table is full, cannot add " + key);
+  }
+
+  uint64_t h = Hash(key);
+  for (slot = h & mask; slots[slot].hash.load(memory_order_relaxed) != 0; slot = (slot + 1) & mask) {
+  }
+  slots[slot].key = new string(key);
+  slots[slot].value.Store(value);
+  slots[slot].hash.store(h, memory_order_release);
+  ++size;
+  return slot;
+}
+
+template<typename T>
+inline void SnapshotTable<T>::Publish(size_t slot, const T &value)
+{
+  slots[slot].value.Store(value);
+}
+
+template<typename T>
+inline size_t SnapshotTable<T>::Find(const string &key) const
+{
+  uint64_t h = Hash(key);
+  for (size_t slot = h & mask; ; slot = (slot + 1) & mask) {
+    uint64_t slotHash = slots[slot].hash.load(memory_order_acquire);
+    if (slotHash == 0) {
+      return NPOS;
+    }
+    if (slotHash == h && *slots[slot].key == key) {
+      return slot;
+    }
+  }
+}
+
+template<typename T>
+inline bool SnapshotTable<T>::Read(const string &key, T &value) const
+{
+  size_t slot = Find(key);
+  if (slot == NPOS) {
+    return false;
+  }
+  value = slots[slot].value.Load();
+  return true;
+}
+
+template<typename T>
+inline T SnapshotTable<T>::Read(size_t slot) const
+{
+  return slots[slot].value.Load();
+}
+
+#endif
@@ -7,6 +7,7 @@
 #ifndef STREAMING_SERVICE_HPP
 #define STREAMING_SERVICE_HPP
 
+#include <stdexcept>
 #include "soa.hpp"
 #include "marketdataservice.hpp"
 
@@ -71,6 +72,36 @@ private:
 
 };
 
+/**
+ * Price Stream carrying a full size ladder for one product.
+ * Tier 0 is the tightest tier and is also exposed through the PriceStream
+ * bid/offer orders, so listeners that only know about PriceStream keep working.
+ * Type T is the product type.
+ */
+template<typename T>
+class PriceStreamLadder : public PriceStream<T>
+{
+
+public:
+
+  // ctor for a ladder; both stacks must be non-empty and of the same depth
+  PriceStreamLadder(const T &_product, const vector<PriceStreamOrder> &_bidOrders, const vector<PriceStreamOrder> &_offerOrders);
+
+  // Get the number of tiers on the ladder
+  size_t GetTierCount() const;
+
+  // Get the bid orders, tightest tier first
+  const vector<PriceStreamOrder>& GetBidOrders() const;
+
+  // Get the offer orders, tightest tier first
+  const vector<PriceStreamOrder>& GetOfferOrders() const;
+
+private:
+  vector<PriceStreamOrder> bidOrders;
+  vector<PriceStreamOrder> offerOrders;
+
+};
+
 /**
  * Streaming service to publish two-way prices.
  * Keyed on product identifier.
@@ -134,6 +165,33 @@ const PriceStreamOrder& PriceStream<T>::GetOfferOrder() const
   return offerOrder;
 }
 
+template<typename T>
+PriceStreamLadder<T>::PriceStreamLadder(const T &_product, const vector<PriceStreamOrder> &_bidOrders, const vector<PriceStreamOrder> &_offerOrders) :
+  PriceStream<T>(_product, _bidOrders.at(0), _offerOrders.at(0)), bidOrders(_bidOrders), offerOrders(_offerOrders)
+{
+  if (bidOrders.size() != offerOrders.size()) {
+    throw invalid_argument("PriceStreamLadder bid and offer stacks differ in depth");
+  }
+}
+
+template<typename T>
+size_t PriceStreamLadder<T>::GetTierCount() const
+{
+  return bidOrders.size();
+}
+
+template<typename T>
+const vector<PriceStreamOrder>& PriceStreamLadder<T>::GetBidOrders() const
+{
+  return bidOrders;
+}
+
+template<typename T>
+const vector<PriceStreamOrder>& PriceStreamLadder<T>::GetOfferOrders() const
+{
+  return offerOrders;
+}
+
 class BondStreamingService : public StreamingService<Bond>, public ServiceListener<PriceStream<Bond>>
 {
 private: 
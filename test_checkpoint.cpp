@@ -0,0 +1,137 @@
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include "tradebookingservice.hpp"
+#include "positionservice.hpp"
+#include "riskservice.hpp"
+#include "risktree.hpp"
+#include "positioncheckpoint.hpp"
+#include "products.hpp"
+#include "productservice.hpp"
+#include "pricingservice.hpp"
+
+// Sums the position deltas sent for each product and book
+class DeltaTally : public PositionDeltaListener<Bond>
+{
+public:
+    map<pair<string, string>, long> changes;
+    long deltas = 0;
+
+    void ProcessDelta(const Position<Bond> &position, const PositionDelta &delta) override
+    {
+        changes[{position.GetProduct().GetProductId(), position.GetBookName(delta.book)}] += delta.change;
+        ++deltas;
+    }
+};
+
+// One run of the booking chain, as a process would build it
+struct Session
+{
+    BondTradeBookingService booking;
+    BondPricingService pricing;
+    BondPositionService positions;
+    BondRiskTree tree;
+    DeltaTally tally;
+    // Declared last so its remark thread stops before the tree it notifies goes
+    BondRiskService risk;
+
+    Session(BondProductService &products, const string &journalPath, bool recover)
+        : booking(0, journalPath, recover ? &products : nullptr), tree(&risk), risk(pricing)
+    {
+        booking.AddListener(&positions);
+        positions.AddListener(&risk);
+        positions.AddDeltaListener(&tree);
+        positions.AddDeltaListener(&tally);
+        risk.AddListener(&tree);
+    }
+};
+
+static const char *PRODUCTS[] = {"T2Y", "T3Y", "T5Y", "T7Y", "T10Y", "T20Y", "T30Y"};
+static const char *BOOKS[] = {"TRSY1", "TRSY2", "TRSY3"};
+
+static Trade<Bond> MakeTrade(BondProductService &products, int i)
+{
+    return Trade<Bond>(products.GetData(PRODUCTS[i % 7]), "CT" + to_string(i), 99.0 + (i % 4) * 0.25,
+                       BOOKS[i % 3], (i % 5 + 1) * 1000000L, (i % 2 == 0) ? BUY : SELL);
+}
+
+int main()
+{
+    BondProductService* bondProductService = new BondProductService();
+
+    bondProductService->Add(Bond("T2Y", CUSIP, "TICKER1", 0.02f, {2026, 12, 22}));
+    bondProductService->Add(Bond("T3Y", CUSIP, "TICKER2", 0.025f, {2027, 6, 15}));
+    bondProductService->Add(Bond("T5Y", CUSIP, "TICKER3", 0.03f, {2029, 9, 30}));
+    bondProductService->Add(Bond("T7Y", CUSIP, "TICKER4", 0.035f, {2031, 3, 10}));
+    bondProductService->Add(Bond("T10Y", CUSIP, "TICKER5", 0.04f, {2034, 1, 20}));
+    bondProductService->Add(Bond("T20Y", CUSIP, "TICKER6", 0.045f, {2044, 7, 25}));
+    bondProductService->Add(Bond("T30Y", CUSIP, "TICKER7", 0.05f, {2054, 5, 10}));
+
+    const string journalPath = "checkpoint_test.journal";
+    const string checkpointPath = "checkpoint_test.checkpoint";
+    remove(checkpointPath.c_str());
+
+    // First run: book 50 trades, checkpoint, then book, amend and cancel more
+    Session* first = new Session(*bondProductService, journalPath, false);
+    for (const char *productId : PRODUCTS) {
+        Price<Bond> price(bondProductService->GetData(productId), 99.5, 1.0 / 128.0);
+        first->pricing.OnMessage(price);
+    }
+    PositionCheckpointer* checkpointer = new PositionCheckpointer(&first->booking, &first->positions, &first->risk, checkpointPath);
+    first->booking.AddListener(checkpointer);
+    for (int i = 0; i < 50; ++i) {
+        first->booking.BookTrade(MakeTrade(*bondProductService, i));
+    }
+    checkpointer->Checkpoint();
+    checkpointer->Flush();
+    for (int i = 50; i < 61; ++i) {
+        first->booking.BookTrade(MakeTrade(*bondProductService, i));
+    }
+    first->booking.BookTrade(Trade<Bond>(bondProductService->GetData("T5Y"), "CT2", 99.0, "TRSY3", 7000000L, SELL));
+    first->booking.CancelTrade("CT10");
+    first->booking.SyncJournal();
+    delete checkpointer;
+
+    // Second run: restore from the checkpoint and the journal after it
+    Session* second = new Session(*bondProductService, journalPath, true);
+    for (const char *productId : PRODUCTS) {
+        Price<Bond> price(bondProductService->GetData(productId), 99.5, 1.0 / 128.0);
+        second->pricing.OnMessage(price);
+    }
+    uint64_t replayed = PositionCheckpointer::Restore(checkpointPath, *bondProductService, second->booking,
+                                                      second->positions, second->risk);
+    std::cout << "Replayed " << replayed << " of " << second->booking.GetJournal().Size() << " journal records, "
+              << second->tally.deltas << " position deltas" << std::endl;
+
+    bool match = true;
+    for (const char *productId : PRODUCTS) {
+        Position<Bond> &before = first->positions.GetData(productId);
+        Position<Bond> &after = second->positions.GetData(productId);
+        for (const char *book : BOOKS) {
+            long sent = second->tally.changes[{productId, book}];
+            std::cout << productId << " " << book << ": " << after.GetPosition(book) << " (expected " << before.GetPosition(book)
+                      << ", deltas sum to " << sent << ")" << std::endl;
+            match = match && after.GetPosition(book) == before.GetPosition(book) && sent == before.GetPosition(book);
+        }
+        double pv01Before = first->risk.GetData(productId).GetPV01();
+        double pv01After = second->risk.GetData(productId).GetPV01();
+        std::cout << productId << " PV01: " << pv01After << " (expected " << pv01Before << ")" << std::endl;
+        match = match && fabs(pv01After - pv01Before) <= 1e-6 * max(1.0, fabs(pv01Before));
+    }
+    double firmBefore = first->tree.GetFirm().pv01;
+    double firmAfter = second->tree.GetFirm().pv01;
+    std::cout << "Firm PV01: " << firmAfter << " (expected " << firmBefore << ")" << std::endl;
+    match = match && fabs(firmAfter - firmBefore) <= 1e-6 * max(1.0, fabs(firmBefore));
+
+    std::cout << (match ? "Restart matches the first run." : "RESTART MISMATCH") << std::endl;
+
+    delete first;
+    delete second;
+    delete bondProductService;
+    remove(checkpointPath.c_str());
+    remove((journalPath + ".records").c_str());
+    remove((journalPath + ".text").c_str());
+
+    return match ? 0 : 1;
+}
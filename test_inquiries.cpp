@@ -4,12 +4,14 @@
 #include "historicaldataservice.hpp"
 #include "products.hpp"  
 #include "productservice.hpp"
+#include "pricingservice.hpp"
 
 
 int main()
 {
     
-    BondInquiryService* inquiryService = new BondInquiryService();
+    BondPricingService* pricingService = new BondPricingService();
+    BondInquiryService* inquiryService = new BondInquiryService(pricingService);
 
     
     BondInquiryHistoricalDataService* hist_inq = new BondInquiryHistoricalDataService();
@@ -30,6 +32,9 @@ int main()
         bondProductService->Add(Bond("T10Y", CUSIP, "TICKER4", 0.035f, {2030, 1, 20}));
         bondProductService->Add(Bond("T20Y", CUSIP, "TICKER3", 0.03f, {2027, 9, 30}));
         bondProductService->Add(Bond("T30Y", CUSIP, "TICKER5", 0.04f, {2050, 5, 10}));
+    BondPricingConnector* pricingConnector = new BondPricingConnector(pricingService, "prices.txt", bondProductService);
+    pricingConnector->Subscribe();
+
     InquiryConnector* connector = new InquiryConnector(inquiryService, bondProductService, std::string("inquiries.txt"));
 
     
@@ -41,6 +46,8 @@ int main()
     delete hist_inq;
     delete bondProductService;
     delete connector;
+    delete pricingConnector;
+    delete pricingService;
 
     
     return 0;
@@ -31,7 +31,7 @@ int main()
     
     bondStreamingService->AddListener(bondStreamingHistoricalService);
 
-    bondPricingService->AddListener(gui);
+    bondPricingService->AddTickListener(gui);
     
     
     BondProductService* bondProductService = new BondProductService(); 
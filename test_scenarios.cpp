@@ -0,0 +1,127 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include "tradebookingservice.hpp"
+#include "positionservice.hpp"
+#include "pricingservice.hpp"
+#include "products.hpp"
+#include "productservice.hpp"
+#include "scenarioengine.hpp"
+#include "workstealingpool.hpp"
+
+static const char *PRODUCTS[] = {"T2Y", "T3Y", "T5Y", "T7Y", "T10Y", "T20Y", "T30Y"};
+static const char *BOOKS[] = {"TRSY1", "TRSY2", "TRSY3"};
+
+// Price change of one bond when its continuously compounded yield moves by shift.
+// With semiannual coupons that is (1 + y'/2) = (1 + y/2) * exp(shift / 2)
+static double RepriceChange(const Bond &bond, double mid, double shift)
+{
+    double yield = bond.ComputeYield(mid * bond.GetFaceValue() / 100.0, 2);
+    double shifted = 2.0 * ((1.0 + yield / 2.0) * exp(shift / 2.0) - 1.0);
+    return bond.ComputeBondPrice(shifted, 2) - bond.ComputeBondPrice(yield, 2);
+}
+
+int main()
+{
+    BondProductService* bondProductService = new BondProductService();
+
+    bondProductService->Add(Bond("T2Y", CUSIP, "TICKER1", 0.02f, {2026, 12, 22}));
+    bondProductService->Add(Bond("T3Y", CUSIP, "TICKER2", 0.025f, {2027, 6, 15}));
+    bondProductService->Add(Bond("T5Y", CUSIP, "TICKER3", 0.03f, {2029, 9, 30}));
+    bondProductService->Add(Bond("T7Y", CUSIP, "TICKER4", 0.035f, {2031, 3, 10}));
+    bondProductService->Add(Bond("T10Y", CUSIP, "TICKER5", 0.04f, {2034, 1, 20}));
+    bondProductService->Add(Bond("T20Y", CUSIP, "TICKER6", 0.045f, {2044, 7, 25}));
+    bondProductService->Add(Bond("T30Y", CUSIP, "TICKER7", 0.05f, {2054, 5, 10}));
+
+    // Book positions across books, leaving T7Y flat
+    BondTradeBookingService* bookingService = new BondTradeBookingService();
+    BondPositionService* positionService = new BondPositionService();
+    BondPricingService* pricingService = new BondPricingService();
+    bookingService->AddListener(positionService);
+
+    for (int i = 0; i < 7; ++i) {
+        Price<Bond> price(bondProductService->GetData(PRODUCTS[i]), 98.0 + 0.5 * i, 1.0 / 128.0);
+        pricingService->OnMessage(price);
+    }
+    for (int i = 0; i < 42; ++i) {
+        const char *productId = PRODUCTS[i % 7];
+        long quantity = (i % 5 + 1) * 1000000L;
+        bookingService->BookTrade(Trade<Bond>(bondProductService->GetData(productId), "ST" + to_string(i), 99.0,
+                                              BOOKS[i % 3], quantity, (i % 2 == 0) ? BUY : SELL));
+    }
+    bookingService->BookTrade(Trade<Bond>(bondProductService->GetData("T7Y"), "ST42", 99.0, "TRSY1",
+                                          positionService->GetData("T7Y").GetAggregatePosition(), SELL));
+
+    // Parallel shifts from -100bp to +100bp
+    const double shifts[] = {-0.01, -0.0025, -0.0001, 0.0001, 0.0025, 0.01};
+    WorkStealingPool pool(4);
+    BondScenarioEngine engine(pool);
+    size_t loaded = engine.LoadPositions(*positionService, *pricingService);
+    for (double shift : shifts) {
+        engine.AddScenario(CurveShock::Parallel("PAR" + to_string(static_cast<int>(round(shift * 10000))) + "BP", shift));
+    }
+    engine.Run();
+    std::cout << "Loaded " << loaded << " positions" << std::endl;
+
+    bool match = loaded == 6;
+    for (size_t s = 0; s < engine.GetScenarioCount(); ++s) {
+        double expectedTotal = 0.0;
+        double worst = 0.0;
+        for (size_t i = 0; i < engine.GetInstrumentCount(); ++i) {
+            const string &productId = engine.GetProductId(i);
+            const Bond &bond = bondProductService->GetData(productId);
+            PriceSnapshot price;
+            if (!pricingService->GetSnapshot(productId, price)) {
+                match = false;
+                continue;
+            }
+            long quantity = positionService->GetData(productId).GetAggregatePosition();
+            double expected = quantity / bond.GetFaceValue() * RepriceChange(bond, price.mid, shifts[s]);
+            expectedTotal += expected;
+            worst = max(worst, fabs(engine.GetPnL(s, i) - expected) / max(1.0, fabs(expected)));
+        }
+        std::cout << engine.GetScenario(s).name << ": " << engine.GetScenarioTotal(s) << " (expected " << expectedTotal
+                  << ", worst relative error " << worst << ")" << std::endl;
+        match = match && worst < 1e-9;
+    }
+
+    // A larger book, to check the result does not depend on the thread count
+    vector<Bond> bonds;
+    for (int i = 0; i < 10000; ++i) {
+        bonds.push_back(Bond("B" + to_string(i), CUSIP, "B", 0.5f + (i % 40) * 0.1f, date(2027 + i % 30, 1 + i % 12, 1 + i % 28)));
+    }
+    vector<double> totals[2];
+    size_t threadCounts[2] = {1, 4};
+    for (int run = 0; run < 2; ++run) {
+        WorkStealingPool runPool(threadCounts[run]);
+        BondScenarioEngine grid(runPool);
+        for (size_t i = 0; i < bonds.size(); ++i) {
+            grid.AddPosition(bonds[i], (static_cast<long>(i % 7) - 3) * 1000000L, 95.0 + i % 10);
+        }
+        for (int k = 0; k < 93; ++k) {
+            grid.AddScenario(k % 2 ? CurveShock::Parallel("PAR", (k - 46) * 0.0001) : CurveShock::Twist("TWIST", -k * 0.00005, k * 0.00005));
+        }
+        grid.AddKeyRateScenarios(0.0001);
+        auto start = chrono::steady_clock::now();
+        grid.Run();
+        double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        for (size_t s = 0; s < grid.GetScenarioCount(); ++s) {
+            totals[run].push_back(grid.GetScenarioTotal(s));
+        }
+        std::cout << grid.GetScenarioCount() << " scenarios x " << grid.GetInstrumentCount() << " bonds on "
+                  << threadCounts[run] << " threads: " << elapsed << " ms" << std::endl;
+    }
+    bool deterministic = memcmp(totals[0].data(), totals[1].data(), totals[0].size() * sizeof(double)) == 0;
+    std::cout << "Totals " << (deterministic ? "match" : "DIFFER") << " across thread counts" << std::endl;
+    match = match && deterministic;
+
+    std::cout << (match ? "Scenario P&L matches repricing." : "SCENARIO MISMATCH") << std::endl;
+
+    delete bookingService;
+    delete positionService;
+    delete pricingService;
+    delete bondProductService;
+
+    return match ? 0 : 1;
+}
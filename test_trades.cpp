@@ -55,13 +55,14 @@ int main()
     std::cout << "Finished processing trades. Check positions.txt and risk.txt for output." << std::endl;
 
     
+    // Stop the risk service's remark thread before the prices and history it uses
+    delete bondRiskService;
     delete hist_pos;
     delete hist_risk;
     delete pricingService;
     //delete riskHistoricalConnector;
     delete tradeBookingConnector;
     delete bondProductService;
-    delete bondRiskService;
     delete bondPositionService;
     delete bondTradeBookingService;
 
@@ -6,6 +6,24 @@
 #include "products.hpp"  
 #include "productservice.hpp"
 #include "tradebookingservice.hpp"
+#include "positionservice.hpp"
+#include <map>
+
+// Sums the executions sent to trade booking, to check positions against
+class ExecutionTally : public ServiceListener<Trade<Bond>>
+{
+public:
+    map<string, long> fills;
+    map<pair<string, string>, long> quantities;
+
+    void ProcessAdd(Trade<Bond> &data) override
+    {
+        fills[data.GetProduct().GetProductId()]++;
+        quantities[{data.GetProduct().GetProductId(), data.GetBook()}] += (data.GetSide() == BUY) ? data.GetQuantity() : -data.GetQuantity();
+    }
+    void ProcessRemove(Trade<Bond> &data) override {}
+    void ProcessUpdate(Trade<Bond> &data) override { ProcessAdd(data); }
+};
 
 int main()
 {
@@ -32,6 +50,10 @@ int main()
     bondExec->AddListener(hist_exec);
 
     bondExec->AddListener(tradeBook);
+    BondPositionService* positions = new BondPositionService();
+    tradeBook->AddListener(positions);
+    ExecutionTally* tally = new ExecutionTally();
+    bondExec->AddListener(tally);
     BondPricingService* pricingService = new BondPricingService();
     
     
@@ -52,17 +74,38 @@ int main()
     pricingConnector->Subscribe();
 
     
-    marketConnector->Subscribe();
+    // Run the market data three times so every product executes repeatedly
+    for (int pass = 0; pass < 3; ++pass) {
+        marketConnector->Subscribe();
+    }
 
 
     std::cout << "Finished processing market data. Check executions.txt for output." << std::endl;
 
+    // Every execution must add to the position, not replace the previous fill
+    bool positionsMatch = true;
+    for (const auto& cell : tally->quantities) {
+        const string& productId = cell.first.first;
+        const string& book = cell.first.second;
+        long position = positions->GetData(productId).GetPosition(book);
+        if (position != cell.second) {
+            positionsMatch = false;
+        }
+        std::cout << productId << " " << book << ": position " << position << ", expected " << cell.second << std::endl;
+    }
+    for (const auto& product : tally->fills) {
+        std::cout << product.first << ": " << product.second << " fills" << std::endl;
+    }
+    std::cout << (positionsMatch ? "Positions match executions." : "POSITION MISMATCH") << std::endl;
+
     
     delete bondmd;
     delete bondProductService;
     delete algoExec;
     delete bondExec;
     delete tradeBook;
+    delete positions;
+    delete tally;
     delete hist_exec;
 
     
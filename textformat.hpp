@@ -0,0 +1,199 @@
+/**
+ * textformat.hpp
+ * Allocation-free formatting shared by the text outputs: timestamps, fractional
+ * (32nds) prices and plain numbers, all written into caller-provided buffers.
+ */
+#ifndef TEXT_FORMAT_HPP
+#define TEXT_FORMAT_HPP
+
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+using namespace std;
+
+/**
+ * Formats wall-clock timestamps as "YYYY-MM-DD HH:MM:SS.fff" (or .ffffff).
+ * The date/time part is only rebuilt when the second changes; every other call
+ * just rewrites the sub-second digits. One formatter per sink, not thread-safe.
+ */
+class TimestampFormatter
+{
+
+public:
+
+  // Longest timestamp Format can write, in chars
+  static constexpr size_t MAX_LENGTH = 32;
+
+  // ctor with the date/time separator (' ' or 'T') and 3 or 6 fractional digits
+  TimestampFormatter(char _separator = ' ', int _fractionDigits = 3);
+
+  // Format the current time into buf; returns the number of chars written
+  size_t Format(char *buf);
+
+  // Format the given time into buf; returns the number of chars written
+  size_t Format(char *buf, chrono::system_clock::time_point now);
+
+private:
+  char separator;
+  int fractionDigits;
+  long long cachedSecond;
+  char cachedPrefix[24];
+  size_t cachedLength;
+
+};
+
+/**
+ * Formats prices in the 32nds notation used on the desk ("99-16+", "100-047").
+ * The 256 possible fractional suffixes are precomputed once.
+ */
+class FractionalPriceFormatter
+{
+
+public:
+
+  // Longest fractional price FormatPrice can write, in chars
+  static constexpr size_t MAX_LENGTH = 32;
+
+  // Format a price into buf; returns the number of chars written
+  static size_t FormatPrice(char *buf, double price);
+
+private:
+  struct SuffixTable
+  {
+    char suffix[256][5];
+    unsigned char length[256];
+    SuffixTable();
+  };
+
+  static const SuffixTable& Table();
+
+};
+
+// Write a double as ostream would by default (6 significant digits); returns the end pointer
+char* FormatNumber(char *first, char *last, double value);
+
+// Write an integer; returns the end pointer
+char* FormatNumber(char *first, char *last, long value);
+
+// Append a number to a reusable string buffer
+void AppendNumber(string &out, double value);
+void AppendNumber(string &out, long value);
+
+TimestampFormatter::TimestampFormatter(char _separator, int _fractionDigits) :
+  separator(_separator), fractionDigits(_fractionDigits == 6 ? 6 : 3), cachedSecond(-1), cachedLength(0)
+{
+}
+
+inline size_t TimestampFormatter::Format(char *buf)
+{
+  return Format(buf, chrono::system_clock::now());
+}
+
+inline size_t TimestampFormatter::Format(char *buf, chrono::system_clock::time_point now)
+{
+  long long micros = chrono::duration_cast<chrono::microseconds>(now.time_since_epoch()).count();
+  long long second = micros / 1000000;
+  long long fraction = micros % 1000000;
+  if (fraction < 0) {
+    fraction += 1000000;
+    --second;
+  }
+
+  if (second != cachedSecond) {
+    time_t timeT = static_cast<time_t>(second);
+    tm bt;
+#ifdef _WIN32
+    localtime_s(&bt, &timeT);
+#else
+    localtime_r(&timeT, &bt);
+#endif
+    char format[] = "%Y-%m-%d %H:%M:%S.";
+    format[8] = separator;
+    cachedLength = strftime(cachedPrefix, sizeof(cachedPrefix), format, &bt);
+    cachedSecond = second;
+  }
+
+  memcpy(buf, cachedPrefix, cachedLength);
+  if (fractionDigits == 3) {
+    fraction /= 1000;
+  }
+  for (int i = fractionDigits - 1; i >= 0; --i) {
+    buf[cachedLength + i] = static_cast<char>('0' + fraction % 10);
+    fraction /= 10;
+  }
+  return cachedLength + fractionDigits;
+}
+
+inline FractionalPriceFormatter::SuffixTable::SuffixTable()
+{
+  for (int ticks256 = 0; ticks256 < 256; ++ticks256) {
+    int ticks32 = ticks256 / 8;
+    int subTicks = ticks256 % 8;
+    char *s = suffix[ticks256];
+    int n = 0;
+    s[n++] = '-';
+    s[n++] = static_cast<char>('0' + ticks32 / 10);
+    s[n++] = static_cast<char>('0' + ticks32 % 10);
+    if (subTicks == 4) {
+      s[n++] = '+';
+    }
+    else if (subTicks != 0) {
+      s[n++] = static_cast<char>('0' + subTicks);
+    }
+    s[n] = '\0';
+    length[ticks256] = static_cast<unsigned char>(n);
+  }
+}
+
+inline const FractionalPriceFormatter::SuffixTable& FractionalPriceFormatter::Table()
+{
+  static const SuffixTable table;
+  return table;
+}
+
+inline size_t FractionalPriceFormatter::FormatPrice(char *buf, double price)
+{
+  long whole = static_cast<long>(price);
+  double frac = price - static_cast<double>(whole);
+  int ticks256 = static_cast<int>(round(frac * 256.0));
+  if (ticks256 == 256) {
+    ticks256 = 0;
+    ++whole;
+  }
+  else if (ticks256 < 0) {
+    ticks256 = 0;
+  }
+
+  char *end = to_chars(buf, buf + 24, whole).ptr;
+  const SuffixTable &table = Table();
+  memcpy(end, table.suffix[ticks256], table.length[ticks256]);
+  return static_cast<size_t>(end - buf) + table.length[ticks256];
+}
+
+inline char* FormatNumber(char *first, char *last, double value)
+{
+  return to_chars(first, last, value, chars_format::general, 6).ptr;
+}
+
+inline char* FormatNumber(char *first, char *last, long value)
+{
+  return to_chars(first, last, value).ptr;
+}
+
+inline void AppendNumber(string &out, double value)
+{
+  char buf[32];
+  out.append(buf, FormatNumber(buf, buf + sizeof(buf), value));
+}
+
+inline void AppendNumber(string &out, long value)
+{
+  char buf[24];
+  out.append(buf, FormatNumber(buf, buf + sizeof(buf), value));
+}
+
+#endif
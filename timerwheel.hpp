@@ -0,0 +1,178 @@
+/**
+ * timerwheel.hpp
+ * Hashed timer wheel with O(1) schedule and cancel.
+ */
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Hashed timer wheel. Timers hash into slotCount buckets by their expiry tick;
+ * each bucket is an intrusive doubly-linked list over a node pool, so scheduling
+ * and cancelling are O(1) and advancing one tick only visits one bucket.
+ * Timers further out than one revolution stay in their bucket until their tick.
+ * Each timer carries a 64-bit payload handed back when it fires.
+ */
+class TimerWheel
+{
+
+public:
+
+  typedef chrono::steady_clock Clock;
+
+  static constexpr uint32_t NONE = ~static_cast<uint32_t>(0);
+
+  // ctor for a wheel of slotCount buckets (rounded up to a power of two), each tick long
+  TimerWheel(Clock::duration _tick, size_t slotCount = 512, Clock::time_point _start = Clock::now());
+
+  // Schedule a timer delay from the wheel's current tick; returns its handle
+  uint32_t Schedule(Clock::duration delay, uint64_t payload);
+
+  // Cancel a pending timer
+  void Cancel(uint32_t handle);
+
+  // Fire every timer due up to now, calling onExpire(payload) for each
+  template<typename F>
+  void Advance(Clock::time_point now, F onExpire);
+
+  // Number of pending timers
+  size_t Size() const;
+
+  // Length of one tick
+  Clock::duration GetTick() const;
+
+private:
+  struct Node
+  {
+    uint64_t payload;
+    uint64_t expiryTick;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t slot;
+  };
+
+  void Unlink(uint32_t handle);
+
+  vector<Node> nodes;
+  vector<uint32_t> freeNodes;
+  vector<uint32_t> heads;
+  vector<uint32_t> due;
+  size_t mask;
+  size_t pending;
+  uint64_t currentTick;
+  Clock::time_point start;
+  Clock::duration tick;
+
+};
+
+TimerWheel::TimerWheel(Clock::duration _tick, size_t slotCount, Clock::time_point _start) :
+  pending(0), currentTick(0), start(_start), tick(_tick)
+{
+  if (tick <= Clock::duration::zero()) {
+    throw invalid_argument("TimerWheel tick must be positive");
+  }
+  size_t slots = 1;
+  while (slots < slotCount) slots <<= 1;
+  heads.assign(slots, NONE);
+  mask = slots - 1;
+}
+
+inline uint32_t TimerWheel::Schedule(Clock::duration delay, uint64_t payload)
+{
+  uint64_t ticks = static_cast<uint64_t>((delay + tick - Clock::duration(1)) / tick);
+  if (ticks == 0) ticks = 1;
+
+  uint32_t handle;
+  if (!freeNodes.empty()) {
+    handle = freeNodes.back();
+    freeNodes.pop_back();
+  }
+  else {
+    handle = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(Node());
+  }
+
+  Node &node = nodes[handle];
+  node.payload = payload;
+  node.expiryTick = currentTick + ticks;
+  node.slot = static_cast<uint32_t>(node.expiryTick & mask);
+  node.prev = NONE;
+  node.next = heads[node.slot];
+  if (node.next != NONE) {
+    nodes[node.next].prev = handle;
+  }
+  heads[node.slot] = handle;
+  ++pending;
+  return handle;
+}
+
+inline void TimerWheel::Unlink(uint32_t handle)
+{
+  Node &node = nodes[handle];
+  if (node.prev != NONE) {
+    nodes[node.prev].next = node.next;
+  }
+  else {
+    heads[node.slot] = node.next;
+  }
+  if (node.next != NONE) {
+    nodes[node.next].prev = node.prev;
+  }
+  node.slot = NONE;
+  freeNodes.push_back(handle);
+  --pending;
+}
+
+inline void TimerWheel::Cancel(uint32_t handle)
+{
+  if (handle < nodes.size() && nodes[handle].slot != NONE) {
+    Unlink(handle);
+  }
+}
+
+template<typename F>
+void TimerWheel::Advance(Clock::time_point now, F onExpire)
+{
+  if (now < start) return;
+  uint64_t target = static_cast<uint64_t>((now - start) / tick);
+
+  while (currentTick < target) {
+    ++currentTick;
+    if (pending == 0) {
+      currentTick = target;
+      break;
+    }
+
+    // Collect first so callbacks can schedule or cancel timers safely
+    due.clear();
+    for (uint32_t handle = heads[currentTick & mask]; handle != NONE; handle = nodes[handle].next) {
+      if (nodes[handle].expiryTick <= currentTick) {
+        due.push_back(handle);
+      }
+    }
+    for (uint32_t handle : due) {
+      if (nodes[handle].slot == NONE) continue;
+      uint64_t payload = nodes[handle].payload;
+      Unlink(handle);
+      onExpire(payload);
+    }
+  }
+}
+
+inline size_t TimerWheel::Size() const
+{
+  return pending;
+}
+
+inline TimerWheel::Clock::duration TimerWheel::GetTick() const
+{
+  return tick;
+}
+
+#endif
@@ -14,6 +14,17 @@
 #include "productservice.hpp"
 #include <fstream>
 #include <unordered_map>
+#include <charconv>
+#include <deque>
+#include <optional>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 //#include "executionservice.hpp"
 
 // Trade sides
@@ -131,52 +142,589 @@ void TradeBookingService<T>::BookTrade(const Trade<T> &trade)
 {
 }
 
+enum JournalEntryType { JOURNAL_NEW, JOURNAL_AMEND, JOURNAL_CANCEL };
+
+/**
+ * One version of a trade in a TradeJournal. Records never change once written;
+ * an amend or cancel appends a new record linked back to the one it replaces.
+ * Strings live in the journal's text pages; the product and book are also
+ * interned to ids, and the previousIn* links chain every record for the same
+ * instrument or book, newest first. A zero version marks unused space.
+ */
+struct JournalRecord
+{
+  uint64_t idHash;
+  uint64_t idOffset;
+  uint64_t productOffset;
+  uint64_t bookOffset;
+  uint64_t previousVersion;
+  uint64_t previousInInstrument;
+  uint64_t previousInBook;
+  double price;
+  long quantity;
+  uint32_t instrument;
+  uint32_t book;
+  uint32_t version;
+  uint16_t idLength;
+  uint16_t productLength;
+  uint16_t bookLength;
+  uint8_t side;
+  uint8_t type;
+};
+
+/**
+ * Append-only journal of trade versions. Records and text are stored in
+ * fixed-size arena pages addressed by sequence number and offset; an open
+ * addressing index maps each trade id to its latest version.
+ * With a path, the journal is also kept on disk in <path>.records and
+ * <path>.text: each page is written once it fills, Sync writes the partial
+ * pages, and pages beyond maxResidentPages are dropped from memory oldest first
+ * and mapped back read-only, so resident memory stays bounded. A journal opened
+ * with recoveryProducts reloads those files instead of starting empty.
+ * Single-threaded.
+ */
+class TradeJournal
+{
+
+public:
+
+  static constexpr uint64_t NONE = ~static_cast<uint64_t>(0);
+  static constexpr size_t PAGE_BYTES = 1 << 20;
+  static constexpr size_t RECORDS_PER_PAGE = PAGE_BYTES / sizeof(JournalRecord);
+
+  // ctor for a journal keeping at most maxResidentPages pages of each kind in memory (0 for no limit)
+  TradeJournal(size_t _maxResidentPages = 0, const string &_path = "", const BondProductService *recoveryProducts = nullptr);
+  ~TradeJournal();
+
+  TradeJournal(const TradeJournal &) = delete;
+  TradeJournal& operator=(const TradeJournal &) = delete;
+
+  // Append a version of a trade, linking it to the trade's previous version; returns its sequence number
+  uint64_t Append(const Trade<Bond> &trade, JournalEntryType type);
+
+  // Write the partially filled pages to disk and fsync, so every record appended so far survives a crash
+  void Sync();
+
+  // Sequence number of the latest version of a trade, or NONE
+  uint64_t Find(const string &tradeId) const;
+
+  // Get the record at a sequence number
+  const JournalRecord& Get(uint64_t sequence) const;
+
+  // Rebuild the trade a record describes
+  Trade<Bond> Materialize(uint64_t sequence) const;
+
+  string_view GetTradeId(const JournalRecord &record) const;
+  const Bond& GetProduct(const JournalRecord &record) const;
+  const string& GetBook(const JournalRecord &record) const;
+
+  // Whether a record is the latest version of its trade
+  bool IsCurrent(uint64_t sequence) const;
+
+  // Call f(sequence, record) for every record of a product or book, newest first
+  template<typename F>
+  void ForEachInInstrument(const string &productId, F f) const;
+  template<typename F>
+  void ForEachInBook(const string &book, F f) const;
+
+  // Number of records, and of distinct trade ids
+  uint64_t Size() const;
+  size_t GetTradeCount() const;
+
+  size_t GetResidentPages() const;
+  size_t GetSpilledPages() const;
+
+private:
+  struct IndexEntry
+  {
+    uint64_t hash;
+    uint64_t sequence;
+  };
+
+  struct Pages
+  {
+    vector<char*> pages;
+    size_t firstResident = 0;
+    int fd = -1;
+  };
+
+  JournalRecord& RecordAt(uint64_t sequence) const;
+  string_view TextAt(uint64_t offset, uint16_t length) const;
+  uint64_t AppendText(const string &text);
+  char* NewPage(Pages &pages);
+  void WritePage(Pages &pages, size_t page);
+  void Spill(Pages &pages);
+  void LoadPages(Pages &pages);
+  void Recover(const BondProductService &productService);
+  uint32_t InternInstrument(const string &productId, const Bond &product, uint64_t offset);
+  uint32_t InternBook(const string &book, uint64_t offset);
+  void Index(uint64_t h, size_t slot, uint64_t sequence, uint64_t previous);
+  size_t FindSlot(string_view tradeId, uint64_t h) const;
+  void Rehash(size_t bucketCount);
+
+  Pages recordPages;
+  Pages textPages;
+  uint64_t recordCount;
+  uint64_t textSize;
+  size_t maxResidentPages;
+  size_t spilledPages;
+
+  vector<IndexEntry> index;
+  size_t tradeCount;
+
+  unordered_map<string, uint32_t> instrumentIds;
+  deque<Bond> products;
+  vector<uint64_t> productOffsets;
+  vector<uint64_t> instrumentHeads;
+  unordered_map<string, uint32_t> bookIds;
+  vector<string> books;
+  vector<uint64_t> bookOffsets;
+  vector<uint64_t> bookHeads;
+
+};
+
+TradeJournal::TradeJournal(size_t _maxResidentPages, const string &_path, const BondProductService *recoveryProducts) :
+  recordCount(0), textSize(0), maxResidentPages(_maxResidentPages), spilledPages(0),
+  index(1024, IndexEntry{0, NONE}), tradeCount(0)
+{
+  if (_path.empty()) {
+    return;
+  }
+
+  int flags = O_RDWR | O_CREAT | (recoveryProducts ? 0 : O_TRUNC);
+  recordPages.fd = open((_path + ".records").c_str(), flags, 0644);
+  textPages.fd = open((_path + ".text").c_str(), flags, 0644);
+  if (recordPages.fd < 0 || textPages.fd < 0) {
+    throw runtime_error("could not open trade journal " + _path);
+  }
+  if (recoveryProducts) {
+    Recover(*recoveryProducts);
+  }
+}
+
+TradeJournal::~TradeJournal()
+{
+  for (Pages *kind : {&recordPages, &textPages}) {
+    for (size_t i = 0; i < kind->pages.size(); ++i) {
+      if (i < kind->firstResident) {
+        munmap(kind->pages[i], PAGE_BYTES);
+      }
+      else {
+        delete[] kind->pages[i];
+      }
+    }
+    if (kind->fd >= 0) {
+      close(kind->fd);
+    }
+  }
+}
+
+inline JournalRecord& TradeJournal::RecordAt(uint64_t sequence) const
+{
+  char *page = recordPages.pages[sequence / RECORDS_PER_PAGE];
+  return reinterpret_cast<JournalRecord*>(page)[sequence % RECORDS_PER_PAGE];
+}
+
+inline string_view TradeJournal::TextAt(uint64_t offset, uint16_t length) const
+{
+  return string_view(textPages.pages[offset / PAGE_BYTES] + offset % PAGE_BYTES, length);
+}
+
+char* TradeJournal::NewPage(Pages &pages)
+{
+  // The current last page is full from here on
+  if (!pages.pages.empty()) {
+    WritePage(pages, pages.pages.size() - 1);
+  }
+  pages.pages.push_back(new char[PAGE_BYTES]());
+  if (maxResidentPages > 0 && pages.fd >= 0 && pages.pages.size() - pages.firstResident > maxResidentPages) {
+    Spill(pages);
+  }
+  return pages.pages.back();
+}
+
+void TradeJournal::WritePage(Pages &pages, size_t page)
+{
+  if (pages.fd < 0 || page < pages.firstResident) {
+    return;
+  }
+  off_t offset = static_cast<off_t>(page * PAGE_BYTES);
+  if (pwrite(pages.fd, pages.pages[page], PAGE_BYTES, offset) != static_cast<ssize_t>(PAGE_BYTES)) {
+    throw runtime_error("could not write trade journal page");
+  }
+}
+
+void TradeJournal::Spill(Pages &pages)
+{
+  // Spilled pages are full and already on disk, so the mapping can be read-only
+  size_t page = pages.firstResident;
+  void *mem = mmap(nullptr, PAGE_BYTES, PROT_READ, MAP_SHARED, pages.fd, static_cast<off_t>(page * PAGE_BYTES));
+  if (mem == MAP_FAILED) {
+    cerr << "could not map spilled trade journal page" << endl;
+    return;
+  }
+  delete[] pages.pages[page];
+  pages.pages[page] = static_cast<char*>(mem);
+  ++pages.firstResident;
+  ++spilledPages;
+}
+
+void TradeJournal::LoadPages(Pages &pages)
+{
+  struct stat st;
+  if (fstat(pages.fd, &st) != 0) {
+    throw runtime_error("could not read trade journal");
+  }
+  size_t count = (static_cast<size_t>(st.st_size) + PAGE_BYTES - 1) / PAGE_BYTES;
+
+  // Full pages are mapped read-only; only the last one stays writable in memory
+  for (size_t page = 0; page + 1 < count; ++page) {
+    void *mem = mmap(nullptr, PAGE_BYTES, PROT_READ, MAP_SHARED, pages.fd, static_cast<off_t>(page * PAGE_BYTES));
+    if (mem == MAP_FAILED) {
+      throw runtime_error("could not map trade journal page");
+    }
+    pages.pages.push_back(static_cast<char*>(mem));
+    ++spilledPages;
+  }
+  pages.firstResident = pages.pages.size();
+  if (count > 0) {
+    char *last = new char[PAGE_BYTES]();
+    if (pread(pages.fd, last, PAGE_BYTES, static_cast<off_t>((count - 1) * PAGE_BYTES)) < 0) {
+      delete[] last;
+      throw runtime_error("could not read trade journal page");
+    }
+    pages.pages.push_back(last);
+  }
+}
+
+void TradeJournal::Recover(const BondProductService &productService)
+{
+  LoadPages(recordPages);
+  LoadPages(textPages);
+
+  uint64_t capacity = recordPages.pages.size() * RECORDS_PER_PAGE;
+  string productId;
+  for (uint64_t sequence = 0; sequence < capacity && RecordAt(sequence).version != 0; ++sequence) {
+    const JournalRecord &record = RecordAt(sequence);
+    productId.assign(TextAt(record.productOffset, record.productLength));
+    if (instrumentIds.find(productId) == instrumentIds.end()) {
+      const Bond *product = productService.Find(productId);
+      if (!product) {
+        throw runtime_error("Trade journal refers to unknown product " + productId);
+      }
+      InternInstrument(productId, *product, record.productOffset);
+    }
+    InternBook(string(TextAt(record.bookOffset, record.bookLength)), record.bookOffset);
+
+    instrumentHeads[record.instrument] = sequence;
+    bookHeads[record.book] = sequence;
+    Index(record.idHash, FindSlot(GetTradeId(record), record.idHash), sequence, record.previousVersion);
+    textSize = max(textSize, max(record.idOffset + record.idLength,
+                                 max(record.productOffset + record.productLength, record.bookOffset + record.bookLength)));
+    recordCount = sequence + 1;
+  }
+}
+
+uint64_t TradeJournal::AppendText(const string &text)
+{
+  if (text.size() > 0xFFFF) {
+    throw invalid_argument("Trade journal text too long: " + text.substr(0, 32));
+  }
+  // Strings never straddle a page
+  if (textSize + text.size() > textPages.pages.size() * PAGE_BYTES) {
+    textSize = textPages.pages.size() * PAGE_BYTES;
+    NewPage(textPages);
+  }
+  uint64_t offset = textSize;
+  memcpy(textPages.pages[offset / PAGE_BYTES] + offset % PAGE_BYTES, text.data(), text.size());
+  textSize += text.size();
+  return offset;
+}
+
+inline uint32_t TradeJournal::InternInstrument(const string &productId, const Bond &product, uint64_t offset)
+{
+  auto it = instrumentIds.find(productId);
+  if (it != instrumentIds.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(products.size());
+  instrumentIds.emplace(productId, id);
+  products.push_back(product);
+  productOffsets.push_back(offset == NONE ? AppendText(productId) : offset);
+  instrumentHeads.push_back(NONE);
+  return id;
+}
+
+inline uint32_t TradeJournal::InternBook(const string &book, uint64_t offset)
+{
+  auto it = bookIds.find(book);
+  if (it != bookIds.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(books.size());
+  bookIds.emplace(book, id);
+  books.push_back(book);
+  bookOffsets.push_back(offset == NONE ? AppendText(book) : offset);
+  bookHeads.push_back(NONE);
+  return id;
+}
+
+inline size_t TradeJournal::FindSlot(string_view tradeId, uint64_t h) const
+{
+  size_t mask = index.size() - 1;
+  for (size_t i = h & mask; ; i = (i + 1) & mask) {
+    const IndexEntry &entry = index[i];
+    if (entry.sequence == NONE || (entry.hash == h && GetTradeId(RecordAt(entry.sequence)) == tradeId)) {
+      return i;
+    }
+  }
+}
+
+inline void TradeJournal::Index(uint64_t h, size_t slot, uint64_t sequence, uint64_t previous)
+{
+  if (previous != NONE) {
+    index[slot].sequence = sequence;
+    return;
+  }
+  index[slot] = IndexEntry{h, sequence};
+  ++tradeCount;
+  if (tradeCount * 10 > index.size() * 7) {
+    Rehash(index.size() * 2);
+  }
+}
+
+void TradeJournal::Rehash(size_t bucketCount)
+{
+  vector<IndexEntry> old(bucketCount, IndexEntry{0, NONE});
+  old.swap(index);
+  size_t mask = index.size() - 1;
+  for (const IndexEntry &entry : old) {
+    if (entry.sequence != NONE) {
+      size_t i = entry.hash & mask;
+      while (index[i].sequence != NONE) i = (i + 1) & mask;
+      index[i] = entry;
+    }
+  }
+}
+
+uint64_t TradeJournal::Append(const Trade<Bond> &trade, JournalEntryType type)
+{
+  const string &tradeId = trade.GetTradeId();
+  uint64_t h = hash<string_view>()(tradeId);
+  size_t slot = FindSlot(tradeId, h);
+  uint64_t previous = index[slot].sequence;
+
+  const string &productId = trade.GetProduct().GetProductId();
+  uint32_t instrument = InternInstrument(productId, trade.GetProduct(), NONE);
+  uint32_t book = InternBook(trade.GetBook(), NONE);
+  uint64_t idOffset = (previous == NONE) ? AppendText(tradeId) : RecordAt(previous).idOffset;
+
+  if (recordCount % RECORDS_PER_PAGE == 0 && recordCount / RECORDS_PER_PAGE == recordPages.pages.size()) {
+    NewPage(recordPages);
+  }
+  uint64_t sequence = recordCount++;
+  JournalRecord &record = RecordAt(sequence);
+  record.idHash = h;
+  record.idOffset = idOffset;
+  record.productOffset = productOffsets[instrument];
+  record.bookOffset = bookOffsets[book];
+  record.previousVersion = previous;
+  record.previousInInstrument = instrumentHeads[instrument];
+  record.previousInBook = bookHeads[book];
+  record.price = trade.GetPrice();
+  record.quantity = trade.GetQuantity();
+  record.instrument = instrument;
+  record.book = book;
+  record.version = (previous == NONE) ? 1 : RecordAt(previous).version + 1;
+  record.idLength = static_cast<uint16_t>(tradeId.size());
+  record.productLength = static_cast<uint16_t>(productId.size());
+  record.bookLength = static_cast<uint16_t>(trade.GetBook().size());
+  record.side = static_cast<uint8_t>(trade.GetSide());
+  record.type = static_cast<uint8_t>(type);
+
+  instrumentHeads[instrument] = sequence;
+  bookHeads[book] = sequence;
+  Index(h, slot, sequence, previous);
+  return sequence;
+}
+
+void TradeJournal::Sync()
+{
+  for (Pages *kind : {&recordPages, &textPages}) {
+    if (!kind->pages.empty()) {
+      WritePage(*kind, kind->pages.size() - 1);
+    }
+    if (kind->fd >= 0 && fsync(kind->fd) != 0) {
+      throw runtime_error("could not sync trade journal");
+    }
+  }
+}
+
+inline uint64_t TradeJournal::Find(const string &tradeId) const
+{
+  return index[FindSlot(tradeId, hash<string_view>()(tradeId))].sequence;
+}
+
+inline const JournalRecord& TradeJournal::Get(uint64_t sequence) const
+{
+  return RecordAt(sequence);
+}
+
+inline Trade<Bond> TradeJournal::Materialize(uint64_t sequence) const
+{
+  const JournalRecord &record = RecordAt(sequence);
+  return Trade<Bond>(GetProduct(record), string(GetTradeId(record)), record.price, GetBook(record),
+                     record.quantity, static_cast<Side>(record.side));
+}
+
+inline string_view TradeJournal::GetTradeId(const JournalRecord &record) const
+{
+  return TextAt(record.idOffset, record.idLength);
+}
+
+inline const Bond& TradeJournal::GetProduct(const JournalRecord &record) const
+{
+  return products[record.instrument];
+}
+
+inline const string& TradeJournal::GetBook(const JournalRecord &record) const
+{
+  return books[record.book];
+}
+
+inline bool TradeJournal::IsCurrent(uint64_t sequence) const
+{
+  const JournalRecord &record = RecordAt(sequence);
+  return index[FindSlot(GetTradeId(record), record.idHash)].sequence == sequence;
+}
+
+template<typename F>
+void TradeJournal::ForEachInInstrument(const string &productId, F f) const
+{
+  auto it = instrumentIds.find(productId);
+  if (it == instrumentIds.end()) return;
+  for (uint64_t sequence = instrumentHeads[it->second]; sequence != NONE; ) {
+    const JournalRecord &record = RecordAt(sequence);
+    f(sequence, record);
+    sequence = record.previousInInstrument;
+  }
+}
+
+template<typename F>
+void TradeJournal::ForEachInBook(const string &book, F f) const
+{
+  auto it = bookIds.find(book);
+  if (it == bookIds.end()) return;
+  for (uint64_t sequence = bookHeads[it->second]; sequence != NONE; ) {
+    const JournalRecord &record = RecordAt(sequence);
+    f(sequence, record);
+    sequence = record.previousInBook;
+  }
+}
+
+inline uint64_t TradeJournal::Size() const
+{
+  return recordCount;
+}
+
+inline size_t TradeJournal::GetTradeCount() const
+{
+  return tradeCount;
+}
+
+inline size_t TradeJournal::GetResidentPages() const
+{
+  return (recordPages.pages.size() - recordPages.firstResident) + (textPages.pages.size() - textPages.firstResident);
+}
+
+inline size_t TradeJournal::GetSpilledPages() const
+{
+  return spilledPages;
+}
+
+/**
+ * Bond trade booking service. Every booking, amendment and cancellation is
+ * appended to a TradeJournal; a trade id seen before is an amendment, which
+ * listeners see as a remove of the old version followed by an update with the
+ * new one. After a restart, a recovered journal can be replayed to listeners
+ * from any sequence number. While listeners are notified, GetCurrentSequence
+ * is the journal record being booked or replayed.
+ */
 class BondTradeBookingService : public TradeBookingService<Bond>, public ServiceListener<Trade<Bond>>
 {
 private: 
-  unordered_map<string, Trade<Bond>> tradeMap;
+  TradeJournal journal;
+  uint64_t currentSequence;
+  optional<Trade<Bond>> lastRead;
   vector<ServiceListener<Trade<Bond>>*> listeners;
   //BondExecutionService* executionService;
 
 public: 
+  // ctor for a service whose journal is kept at journalPath (if set) with at most maxResidentPages pages in memory;
+  // with recoveryProducts the existing journal is reloaded rather than replaced
+  BondTradeBookingService(size_t maxResidentPages = 0, const string &journalPath = "",
+                          const BondProductService *recoveryProducts = nullptr);
+
+  // Get the latest version of a live trade; the reference is valid until the next GetData
   Trade<Bond>& GetData(string key) override;
   void OnMessage(Trade<Bond> &data) override;
   void AddListener(ServiceListener<Trade<Bond>> *listener) override;
   const vector<ServiceListener<Trade<Bond>>*>& GetListeners() const override;
   void BookTrade(const Trade<Bond> &trade) override; 
 
+  // Cancel a live trade; false if it is unknown or already cancelled
+  bool CancelTrade(const string &tradeId);
+
+  const TradeJournal& GetJournal() const;
+
+  // Sequence number of the journal record listeners are being notified of; on a remove, the record's
+  // previousVersion is the version being removed
+  uint64_t GetCurrentSequence() const;
+
+  // Write every journal record appended so far to disk
+  void SyncJournal();
+
+  // Notify listeners of every journal record from a sequence number on, as if it were being booked again
+  void Replay(uint64_t fromSequence);
+
   void ProcessAdd(Trade<Bond>& data) override;
   void ProcessRemove(Trade<Bond>& data) override;
   void ProcessUpdate(Trade<Bond> &data) override;
   
 };
 
+BondTradeBookingService::BondTradeBookingService(size_t maxResidentPages, const string &journalPath,
+                                                 const BondProductService *recoveryProducts) :
+  journal(maxResidentPages, journalPath, recoveryProducts), currentSequence(TradeJournal::NONE)
+{
+}
 
 inline Trade<Bond>& BondTradeBookingService::GetData(string key)
 {
-  auto it = tradeMap.find(key);
-  if (it != tradeMap.end()) {
-    return it->second;
+  uint64_t sequence = journal.Find(key);
+  if (sequence == TradeJournal::NONE || journal.Get(sequence).type == JOURNAL_CANCEL) {
+    throw runtime_error("Trade ID not found: " + key);
   }
-  throw runtime_error("Trade ID not found: " + key);
-  
+  lastRead.emplace(journal.Materialize(sequence));
+  return *lastRead;
 }
 
 inline void BondTradeBookingService::OnMessage(Trade<Bond> &data) 
 {
-  string tradeID = data.GetTradeId();
-  auto it = tradeMap.find(tradeID);
-  bool isNew = (it == tradeMap.end());
-
-  tradeMap.emplace(tradeID, data);
+  uint64_t previous = journal.Find(data.GetTradeId());
+  bool isNew = (previous == TradeJournal::NONE || journal.Get(previous).type == JOURNAL_CANCEL);
 
   if (isNew) {
+    currentSequence = journal.Append(data, JOURNAL_NEW);
     for (auto listener : listeners) {
       listener->ProcessAdd(data);
     }
   }
   else {
+    Trade<Bond> replaced = journal.Materialize(previous);
+    currentSequence = journal.Append(data, JOURNAL_AMEND);
     for (auto listener : listeners) {
+      listener->ProcessRemove(replaced);
       listener->ProcessUpdate(data);
     }
   }
@@ -198,6 +746,59 @@ inline void BondTradeBookingService::BookTrade(const Trade<Bond> &trade)
   OnMessage(t);
 }
 
+inline bool BondTradeBookingService::CancelTrade(const string &tradeId)
+{
+  uint64_t previous = journal.Find(tradeId);
+  if (previous == TradeJournal::NONE || journal.Get(previous).type == JOURNAL_CANCEL) {
+    return false;
+  }
+  Trade<Bond> cancelled = journal.Materialize(previous);
+  currentSequence = journal.Append(cancelled, JOURNAL_CANCEL);
+  for (auto listener : listeners) {
+    listener->ProcessRemove(cancelled);
+  }
+  return true;
+}
+
+inline const TradeJournal& BondTradeBookingService::GetJournal() const
+{
+  return journal;
+}
+
+inline uint64_t BondTradeBookingService::GetCurrentSequence() const
+{
+  return currentSequence;
+}
+
+inline void BondTradeBookingService::SyncJournal()
+{
+  journal.Sync();
+}
+
+void BondTradeBookingService::Replay(uint64_t fromSequence)
+{
+  for (uint64_t sequence = fromSequence; sequence < journal.Size(); ++sequence) {
+    const JournalRecord &record = journal.Get(sequence);
+    Trade<Bond> trade = journal.Materialize(sequence);
+    currentSequence = sequence;
+    if (record.type == JOURNAL_NEW) {
+      for (auto listener : listeners) {
+        listener->ProcessAdd(trade);
+      }
+      continue;
+    }
+
+    // Amends and cancels unwind the version they replaced
+    Trade<Bond> replaced = journal.Materialize(record.previousVersion);
+    for (auto listener : listeners) {
+      listener->ProcessRemove(replaced);
+      if (record.type == JOURNAL_AMEND) {
+        listener->ProcessUpdate(trade);
+      }
+    }
+  }
+}
+
 inline void BondTradeBookingService::ProcessAdd(Trade<Bond> &data)
 {
   // cout << "Execution add received - Trade ID: " 
@@ -211,13 +812,7 @@ inline void BondTradeBookingService::ProcessRemove(Trade<Bond> &data)
 {
   // cout << "Execution remove received - Trade ID: " 
   //       << data.GetTradeId() << endl;
-  auto it = tradeMap.find(data.GetTradeId());
-  if (it != tradeMap.end()) {
-    tradeMap.erase(it);
-    for (auto listener : listeners) {
-      listener->ProcessRemove(data);
-    }
-  }
+  CancelTrade(data.GetTradeId());
 
 }
 
@@ -229,6 +824,242 @@ inline void BondTradeBookingService::ProcessUpdate(Trade<Bond> &data)
   BookTrade(data);
 }
 
+/**
+ * Fields of one parsed trade line. The id and book point into the mapped file;
+ * the product is an index into the product ids seen by the chunk it came from.
+ */
+struct ParsedTrade
+{
+  string_view tradeId;
+  string_view book;
+  double price;
+  long quantity;
+  uint32_t product;
+  Side side;
+};
+
+/**
+ * Loader for trade files with lines of ProductId,TradeId,Price,Book,Quantity,Side.
+ * The file is memory-mapped and split on line boundaries into one chunk per
+ * thread. Chunks are parsed in parallel, without copying, into trade arrays
+ * sized from their line counts. Product ids are resolved once per chunk and the
+ * trades are then handed back on the calling thread in file order.
+ * Malformed lines and lines for unknown products are skipped and counted.
+ */
+class TradeFileLoader
+{
+
+public:
+
+  // ctor for a loader resolving products against the given product service
+  TradeFileLoader(BondProductService &_bondProductService, size_t _threadCount = thread::hardware_concurrency());
+
+  // Load a file, calling onTrade(Trade<Bond>&) for each trade in file order; returns the number of trades
+  template<typename F>
+  size_t Load(const string &filename, F onTrade);
+
+  // Lines skipped by the last Load
+  size_t GetSkippedLines() const;
+
+private:
+  // Files smaller than this per thread are not worth splitting
+  static constexpr size_t MIN_CHUNK_BYTES = 1 << 20;
+
+  struct Chunk
+  {
+    const char *begin;
+    const char *end;
+    vector<ParsedTrade> trades;
+    vector<string_view> productIds;
+    vector<const Bond*> products;
+    size_t skipped;
+  };
+
+  static void ParseChunk(Chunk &chunk);
+  static bool ParseLine(const char *begin, const char *end, string_view &productId, ParsedTrade &trade);
+
+  BondProductService &bondProductService;
+  size_t threadCount;
+  size_t skippedLines;
+
+};
+
+TradeFileLoader::TradeFileLoader(BondProductService &_bondProductService, size_t _threadCount) :
+  bondProductService(_bondProductService), threadCount(_threadCount == 0 ? 1 : _threadCount), skippedLines(0)
+{
+}
+
+inline size_t TradeFileLoader::GetSkippedLines() const
+{
+  return skippedLines;
+}
+
+inline bool TradeFileLoader::ParseLine(const char *begin, const char *end, string_view &productId, ParsedTrade &trade)
+{
+  if (end > begin && end[-1] == '\r') {
+    --end;
+  }
+
+  const char *fields[6];
+  const char *fieldEnds[6];
+  const char *p = begin;
+  for (int i = 0; i < 6; ++i) {
+    const char *comma = static_cast<const char*>(memchr(p, ',', end - p));
+    if (i < 5 && !comma) {
+      return false;
+    }
+    fields[i] = p;
+    fieldEnds[i] = (i < 5) ? comma : end;
+    p = (i < 5) ? comma + 1 : end;
+  }
+
+  productId = string_view(fields[0], fieldEnds[0] - fields[0]);
+  trade.tradeId = string_view(fields[1], fieldEnds[1] - fields[1]);
+  trade.book = string_view(fields[3], fieldEnds[3] - fields[3]);
+  // Numbers must take up their whole field; a partial parse is malformed
+  from_chars_result price = from_chars(fields[2], fieldEnds[2], trade.price);
+  from_chars_result quantity = from_chars(fields[4], fieldEnds[4], trade.quantity);
+  if (price.ec != errc() || price.ptr != fieldEnds[2] || quantity.ec != errc() || quantity.ptr != fieldEnds[4]) {
+    return false;
+  }
+  trade.side = (string_view(fields[5], fieldEnds[5] - fields[5]) == "BUY") ? BUY : SELL;
+  return !productId.empty() && !trade.tradeId.empty();
+}
+
+void TradeFileLoader::ParseChunk(Chunk &chunk)
+{
+  size_t lines = 0;
+  for (const char *p = chunk.begin; p < chunk.end; ++lines) {
+    const char *newline = static_cast<const char*>(memchr(p, '\n', chunk.end - p));
+    p = newline ? newline + 1 : chunk.end;
+  }
+  chunk.trades.reserve(lines);
+
+  // Files carry few distinct products, so remember the last one and index the rest
+  unordered_map<string_view, uint32_t> productIndex;
+  string_view lastProductId;
+  uint32_t lastProduct = 0;
+
+  for (const char *p = chunk.begin; p < chunk.end; ) {
+    const char *newline = static_cast<const char*>(memchr(p, '\n', chunk.end - p));
+    const char *lineEnd = newline ? newline : chunk.end;
+
+    string_view productId;
+    ParsedTrade trade;
+    if (lineEnd == p || (lineEnd - p == 1 && *p == '\r')) {
+      // Blank line
+    }
+    else if (!ParseLine(p, lineEnd, productId, trade)) {
+      ++chunk.skipped;
+    }
+    else {
+      if (productId != lastProductId) {
+        auto it = productIndex.emplace(productId, static_cast<uint32_t>(chunk.productIds.size())).first;
+        if (it->second == chunk.productIds.size()) {
+          chunk.productIds.push_back(productId);
+        }
+        lastProductId = productId;
+        lastProduct = it->second;
+      }
+      trade.product = lastProduct;
+      chunk.trades.push_back(trade);
+    }
+    p = lineEnd + 1;
+  }
+}
+
+template<typename F>
+size_t TradeFileLoader::Load(const string &filename, F onTrade)
+{
+  skippedLines = 0;
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    cerr << "Could not open file " << filename << endl;
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  void *mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    cerr << "Could not map file " << filename << endl;
+    return 0;
+  }
+  madvise(mem, size, MADV_SEQUENTIAL);
+  const char *data = static_cast<const char*>(mem);
+  const char *dataEnd = data + size;
+
+  // Split into chunks, moving each boundary forward to the start of a line
+  size_t chunkCount = min(threadCount, size / MIN_CHUNK_BYTES + 1);
+  vector<Chunk> chunks(chunkCount);
+  const char *begin = data;
+  for (size_t i = 0; i < chunkCount; ++i) {
+    const char *end = (i + 1 == chunkCount) ? dataEnd : max(begin, data + size * (i + 1) / chunkCount);
+    if (end < dataEnd) {
+      const char *newline = static_cast<const char*>(memchr(end, '\n', dataEnd - end));
+      end = newline ? newline + 1 : dataEnd;
+    }
+    chunks[i].begin = begin;
+    chunks[i].end = end;
+    chunks[i].skipped = 0;
+    begin = end;
+  }
+
+  if (chunkCount == 1) {
+    ParseChunk(chunks[0]);
+  }
+  else {
+    vector<thread> workers;
+    for (size_t i = 1; i < chunkCount; ++i) {
+      workers.emplace_back(&TradeFileLoader::ParseChunk, ref(chunks[i]));
+    }
+    ParseChunk(chunks[0]);
+    for (thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Book in file order on the calling thread
+  size_t booked = 0;
+  string productId;
+  for (Chunk &chunk : chunks) {
+    skippedLines += chunk.skipped;
+    chunk.products.reserve(chunk.productIds.size());
+    for (string_view id : chunk.productIds) {
+      productId.assign(id.data(), id.size());
+      const Bond *bond = bondProductService.Find(productId);
+      if (!bond) {
+        cerr << "Skipping trades for unknown product " << productId << " in " << filename << endl;
+      }
+      chunk.products.push_back(bond);
+    }
+
+    for (const ParsedTrade &parsed : chunk.trades) {
+      const Bond *bond = chunk.products[parsed.product];
+      if (!bond) {
+        ++skippedLines;
+        continue;
+      }
+      Trade<Bond> trade(*bond, string(parsed.tradeId), parsed.price, string(parsed.book), parsed.quantity, parsed.side);
+      onTrade(trade);
+      ++booked;
+    }
+  }
+
+  munmap(mem, size);
+  if (skippedLines > 0) {
+    cerr << "Skipped " << skippedLines << " malformed or unknown trade lines in " << filename << endl;
+  }
+  return booked;
+}
+
 class TradeBookingServiceConnector : public Connector<Trade<Bond>>
 {
 private: 
@@ -238,6 +1069,8 @@ private:
 public: 
   TradeBookingServiceConnector(BondTradeBookingService* _service, BondProductService &bondProductService)
     : tradeBookingService(_service), bondProductService(bondProductService) {}
+
+  // Load a trade file with TradeFileLoader and book every trade in file order
   void ReadFile(const string &filename);
   void Publish(Trade<Bond> &data) override {}
 
@@ -248,41 +1081,10 @@ public:
 
 void TradeBookingServiceConnector::ReadFile(const string& filename)
 {
-    ifstream file("/Users/joshlevine/Desktop/tradingsystem/trades.txt");
-    string line;
-
-    while (getline(file, line))
-    {
-        stringstream ss(line);
-        string productId, tradeId, book, sideStr;
-        double price;
-        long quantity;
-        Side side;
-
-        // Assuming trade.txt format: ProductId,TradeId,Price,Book,Quantity,Side (BUY/SELL)
-        getline(ss, productId, ',');
-        getline(ss, tradeId, ',');
-        ss >> price;
-        ss.ignore(); 
-        getline(ss, book, ',');
-        ss >> quantity;
-        ss.ignore(); 
-        getline(ss, sideStr, ',');
-
-        
-        side = (sideStr == "BUY") ? BUY : SELL;
-
-        // Create a Bond product (assuming Bond constructor takes a productId)
-        Bond bond = bondProductService.GetData(productId);
-
-        // Create the Trade object
-        Trade<Bond> trade(bond, tradeId, price, book, quantity, side);
-
-        // Publish the trade to the service
+    TradeFileLoader loader(bondProductService);
+    loader.Load(filename, [this](Trade<Bond> &trade) {
         tradeBookingService->OnMessage(trade);
-    }
-
-    file.close();
+    });
 }
 
 #endif
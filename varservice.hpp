@@ -0,0 +1,400 @@
+/**
+ * varservice.hpp
+ * Historical-simulation VaR and expected shortfall per book and for the firm,
+ * from a rolling window of daily yield changes.
+ */
+#ifndef VAR_SERVICE_HPP
+#define VAR_SERVICE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "soa.hpp"
+#include "products.hpp"
+#include "pricingservice.hpp"
+#include "positionservice.hpp"
+#include "workstealingpool.hpp"
+
+using namespace std;
+
+/**
+ * How a historical yield change is turned into P&L: from the bond's delta and
+ * gamma in yield, or by repricing the bond at the shifted yield.
+ */
+enum VaRMode { SENSITIVITY, FULL_REVALUATION };
+
+/**
+ * Value at risk and expected shortfall, as positive losses in currency, and the
+ * number of historical scenarios they were taken from.
+ */
+struct VaRResult
+{
+  double var = 0.0;
+  double expectedShortfall = 0.0;
+  size_t scenarios = 0;
+};
+
+/**
+ * Historical VaR service listening to prices and to position deltas. Each
+ * priced instrument keeps its yield at the last tick as the day's close; when a
+ * tick arrives on a new BusinessDate (or CloseDay is called) the day's change
+ * in yield for every instrument goes into a rolling window of window days.
+ * AddHistoricalDay seeds the window from stored history the same way. An
+ * instrument with no close on a day, or added after it, has no move that day.
+ *
+ * Every day in the window is a scenario. The service keeps the P&L of one unit
+ * of each instrument in each scenario, and from those the P&L of every book and
+ * of the firm in each scenario as running sums:
+ * - a position delta adds change x unit P&L to its book and the firm, O(window);
+ * - a price tick revalues that instrument, moving only the books holding it;
+ * - a new day replaces one scenario, O(instruments + positions).
+ * A full revaluation, when the mode changes, runs on the pool in parallel
+ * across scenarios. VaR and expected shortfall are read off the scenario P&Ls
+ * at the confidence level on request.
+ *
+ * Prices are quoted per 100 of face; P&L is in currency, quantity * change in
+ * price per unit of face, as in the P&L service.
+ */
+class BondVaRService : public ServiceListener<Price<Bond>>, public PositionDeltaListener<Bond>
+{
+
+public:
+
+  // ctor for a service over window days at a confidence level, revaluing on a pool
+  BondVaRService(WorkStealingPool &_pool, size_t _window = 250, double _confidence = 0.99, VaRMode _mode = SENSITIVITY);
+
+  // Switch between sensitivity and full revaluation, revaluing every scenario
+  void SetMode(VaRMode _mode);
+  VaRMode GetMode() const;
+
+  // Close the day: push every instrument's change since the last close
+  void CloseDay();
+
+  // Push one past day of yield changes by product id
+  void AddHistoricalDay(const unordered_map<string, double> &yieldChanges);
+
+  // Number of days in the window so far
+  size_t GetScenarioCount() const;
+
+  // VaR and expected shortfall of a book and of the firm
+  VaRResult GetBookVaR(const string &book) const;
+  VaRResult GetFirmVaR() const;
+
+  // Position deltas move one book's scenario P&Ls
+  void ProcessDelta(const Position<Bond> &position, const PositionDelta &delta) override;
+
+  // Prices move the instrument's close and its unit P&Ls
+  void ProcessAdd(Price<Bond> &data) override;
+  void ProcessRemove(Price<Bond> &data) override;
+  void ProcessUpdate(Price<Bond> &data) override;
+
+private:
+  static constexpr double BUMP = 0.0001;
+  static constexpr int PAYMENTS = 2;
+
+  struct Instrument
+  {
+    Bond bond;
+    bool priced;
+    double yield;
+    double price;
+    double delta;
+    double gamma;
+    bool hasPreviousClose;
+    double previousClose;
+    vector<uint32_t> books;
+  };
+
+  static uint64_t LeafKey(uint32_t instrument, uint32_t book);
+
+  uint32_t InternInstrument(const Bond &bond);
+  uint32_t InternBook(const string &book);
+  long GetQuantity(uint32_t instrument, uint32_t book) const;
+  double UnitPnL(const Instrument &instrument, double yieldChange) const;
+  void RevalueInstrument(uint32_t instrument);
+  void PushDay();
+  void RevalueScenario(size_t slot);
+  VaRResult Measure(const vector<double> &pnl) const;
+
+  WorkStealingPool &pool;
+  size_t window;
+  double confidence;
+  VaRMode mode;
+
+  vector<Instrument> instruments;
+  unordered_map<string, uint32_t> instrumentIds;
+
+  // Yield changes and unit P&Ls, instrument-major with window columns; column
+  // day % window holds day number day
+  vector<double> yieldChanges;
+  vector<double> unitPnLs;
+  vector<double> dayChanges;
+  size_t dayCount;
+  uint32_t businessDay;
+
+  // Quantities by instrument and book, and scenario P&Ls by book and for the firm
+  unordered_map<uint64_t, long> quantities;
+  unordered_map<string, uint32_t> bookIds;
+  vector<vector<double>> bookPnLs;
+  vector<double> firmPnLs;
+
+};
+
+BondVaRService::BondVaRService(WorkStealingPool &_pool, size_t _window, double _confidence, VaRMode _mode) :
+  pool(_pool), window(_window), confidence(_confidence), mode(_mode), dayCount(0),
+  businessDay(BusinessDate::GetDayNumber()), firmPnLs(_window, 0.0)
+{
+  if (window == 0 || !(confidence > 0.0 && confidence < 1.0)) {
+    throw invalid_argument("VaR needs a non-empty window and a confidence in (0, 1)");
+  }
+}
+
+inline uint64_t BondVaRService::LeafKey(uint32_t instrument, uint32_t book)
+{
+  return (static_cast<uint64_t>(instrument) << 32) | book;
+}
+
+uint32_t BondVaRService::InternInstrument(const Bond &bond)
+{
+  auto it = instrumentIds.find(bond.GetProductId());
+  if (it != instrumentIds.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(instruments.size());
+  instrumentIds.emplace(bond.GetProductId(), id);
+  instruments.push_back(Instrument{bond, false, 0.0, 0.0, 0.0, 0.0, false, 0.0, {}});
+  yieldChanges.resize(yieldChanges.size() + window, 0.0);
+  unitPnLs.resize(unitPnLs.size() + window, 0.0);
+  dayChanges.push_back(0.0);
+  return id;
+}
+
+inline uint32_t BondVaRService::InternBook(const string &book)
+{
+  auto it = bookIds.find(book);
+  if (it != bookIds.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(bookPnLs.size());
+  bookIds.emplace(book, id);
+  bookPnLs.emplace_back(window, 0.0);
+  return id;
+}
+
+inline long BondVaRService::GetQuantity(uint32_t instrument, uint32_t book) const
+{
+  auto it = quantities.find(LeafKey(instrument, book));
+  return (it != quantities.end()) ? it->second : 0;
+}
+
+inline VaRMode BondVaRService::GetMode() const
+{
+  return mode;
+}
+
+inline size_t BondVaRService::GetScenarioCount() const
+{
+  return min(dayCount, window);
+}
+
+inline double BondVaRService::UnitPnL(const Instrument &instrument, double yieldChange) const
+{
+  if (!instrument.priced || yieldChange == 0.0) {
+    return 0.0;
+  }
+  const Bond &bond = instrument.bond;
+  double priceChange;
+  if (mode == SENSITIVITY) {
+    priceChange = yieldChange * (instrument.delta + 0.5 * instrument.gamma * yieldChange);
+  }
+  else {
+    priceChange = bond.ComputeBondPrice(instrument.yield + yieldChange, PAYMENTS) - instrument.price;
+  }
+  return priceChange / bond.GetFaceValue();
+}
+
+void BondVaRService::RevalueInstrument(uint32_t id)
+{
+  // New unit P&Ls for every scenario, then move each holder by the difference
+  size_t scenarios = GetScenarioCount();
+  const Instrument &instrument = instruments[id];
+  const double *changes = &yieldChanges[id * window];
+  double *units = &unitPnLs[id * window];
+  vector<double> moves(scenarios);
+  for (size_t s = 0; s < scenarios; ++s) {
+    double unit = UnitPnL(instrument, changes[s]);
+    moves[s] = unit - units[s];
+    units[s] = unit;
+  }
+
+  for (uint32_t book : instrument.books) {
+    double quantity = static_cast<double>(GetQuantity(id, book));
+    double *bookPnL = bookPnLs[book].data();
+    for (size_t s = 0; s < scenarios; ++s) {
+      double move = quantity * moves[s];
+      bookPnL[s] += move;
+      firmPnLs[s] += move;
+    }
+  }
+}
+
+void BondVaRService::RevalueScenario(size_t slot)
+{
+  for (uint32_t i = 0; i < instruments.size(); ++i) {
+    unitPnLs[i * window + slot] = UnitPnL(instruments[i], yieldChanges[i * window + slot]);
+  }
+
+  // Sum books in instrument order so the result does not depend on the pool
+  for (vector<double> &bookPnL : bookPnLs) {
+    bookPnL[slot] = 0.0;
+  }
+  double firm = 0.0;
+  for (uint32_t i = 0; i < instruments.size(); ++i) {
+    double unit = unitPnLs[i * window + slot];
+    for (uint32_t book : instruments[i].books) {
+      double pnl = GetQuantity(i, book) * unit;
+      bookPnLs[book][slot] += pnl;
+      firm += pnl;
+    }
+  }
+  firmPnLs[slot] = firm;
+}
+
+void BondVaRService::PushDay()
+{
+  size_t slot = dayCount % window;
+  for (uint32_t i = 0; i < instruments.size(); ++i) {
+    yieldChanges[i * window + slot] = dayChanges[i];
+    dayChanges[i] = 0.0;
+  }
+  ++dayCount;
+  RevalueScenario(slot);
+}
+
+void BondVaRService::CloseDay()
+{
+  for (uint32_t i = 0; i < instruments.size(); ++i) {
+    Instrument &instrument = instruments[i];
+    if (!instrument.priced) {
+      continue;
+    }
+    dayChanges[i] = instrument.hasPreviousClose ? instrument.yield - instrument.previousClose : 0.0;
+    instrument.previousClose = instrument.yield;
+    instrument.hasPreviousClose = true;
+  }
+  PushDay();
+}
+
+void BondVaRService::AddHistoricalDay(const unordered_map<string, double> &changes)
+{
+  for (const auto &change : changes) {
+    auto it = instrumentIds.find(change.first);
+    if (it != instrumentIds.end()) {
+      dayChanges[it->second] = change.second;
+    }
+  }
+  PushDay();
+}
+
+void BondVaRService::SetMode(VaRMode _mode)
+{
+  mode = _mode;
+
+  // Each task revalues one scenario, so tasks touch disjoint columns
+  pool.ParallelFor(GetScenarioCount(), [this](size_t slot) { RevalueScenario(slot); });
+}
+
+VaRResult BondVaRService::Measure(const vector<double> &pnl) const
+{
+  VaRResult result;
+  result.scenarios = GetScenarioCount();
+  if (result.scenarios == 0) {
+    return result;
+  }
+
+  // The worst tail scenarios, the last of them being the VaR
+  size_t tail = max<size_t>(1, static_cast<size_t>(ceil((1.0 - confidence) * result.scenarios - 1e-9)));
+  vector<double> losses(pnl.begin(), pnl.begin() + result.scenarios);
+  partial_sort(losses.begin(), losses.begin() + tail, losses.end());
+  double tailSum = 0.0;
+  for (size_t i = 0; i < tail; ++i) {
+    tailSum += losses[i];
+  }
+  result.var = -losses[tail - 1];
+  result.expectedShortfall = -tailSum / tail;
+  return result;
+}
+
+VaRResult BondVaRService::GetBookVaR(const string &book) const
+{
+  auto it = bookIds.find(book);
+  return (it != bookIds.end()) ? Measure(bookPnLs[it->second]) : VaRResult();
+}
+
+inline VaRResult BondVaRService::GetFirmVaR() const
+{
+  return Measure(firmPnLs);
+}
+
+void BondVaRService::ProcessDelta(const Position<Bond> &position, const PositionDelta &delta)
+{
+  uint32_t id = InternInstrument(position.GetProduct());
+  uint32_t book = InternBook(position.GetBookName(delta.book));
+  auto inserted = quantities.emplace(LeafKey(id, book), 0);
+  if (inserted.second) {
+    instruments[id].books.push_back(book);
+  }
+  inserted.first->second += delta.change;
+
+  size_t scenarios = GetScenarioCount();
+  double change = static_cast<double>(delta.change);
+  const double *units = &unitPnLs[id * window];
+  double *bookPnL = bookPnLs[book].data();
+  for (size_t s = 0; s < scenarios; ++s) {
+    double move = change * units[s];
+    bookPnL[s] += move;
+    firmPnLs[s] += move;
+  }
+}
+
+void BondVaRService::ProcessAdd(Price<Bond> &data)
+{
+  // A tick on a new business date closes the previous one first
+  uint32_t today = BusinessDate::GetDayNumber();
+  if (today != businessDay) {
+    CloseDay();
+    businessDay = today;
+  }
+
+  uint32_t id = InternInstrument(data.GetProduct());
+  Instrument &instrument = instruments[id];
+  const Bond &bond = instrument.bond;
+  double yield = bond.ComputeYield(data.GetMid() * bond.GetFaceValue() / 100.0, PAYMENTS);
+  if (instrument.priced && yield == instrument.yield) {
+    return;
+  }
+
+  // Delta and gamma in yield by central differences of one basis point
+  double price = bond.ComputeBondPrice(yield, PAYMENTS);
+  double up = bond.ComputeBondPrice(yield + BUMP, PAYMENTS);
+  double down = bond.ComputeBondPrice(yield - BUMP, PAYMENTS);
+  instrument.priced = true;
+  instrument.yield = yield;
+  instrument.price = price;
+  instrument.delta = (up - down) / (2.0 * BUMP);
+  instrument.gamma = (up + down - 2.0 * price) / (BUMP * BUMP);
+  RevalueInstrument(id);
+}
+
+inline void BondVaRService::ProcessRemove(Price<Bond> &data)
+{
+}
+
+inline void BondVaRService::ProcessUpdate(Price<Bond> &data)
+{
+  ProcessAdd(data);
+}
+
+#endif
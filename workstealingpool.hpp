@@ -0,0 +1,197 @@
+/**
+ * workstealingpool.hpp
+ * Fixed pool of worker threads running index ranges with work stealing.
+ */
+#ifndef WORK_STEALING_POOL_HPP
+#define WORK_STEALING_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Pool of worker threads for data-parallel batches. ParallelFor deals the task
+ * indices round-robin onto one deque per worker; each worker pops from the back
+ * of its own deque and, once it is empty, steals from the front of the others,
+ * so uneven tasks still finish together. The calling thread works as one of the
+ * workers and returns when every task has run.
+ *
+ * Tasks must write to disjoint outputs; which thread runs a task is not fixed,
+ * so any reduction over task results should be done afterwards in index order.
+ * One batch runs at a time.
+ */
+class WorkStealingPool
+{
+
+public:
+
+  // ctor for a pool of threadCount workers, the calling thread included
+  explicit WorkStealingPool(size_t threadCount = thread::hardware_concurrency());
+  ~WorkStealingPool();
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool &) = delete;
+
+  // Number of workers, the calling thread included
+  size_t GetThreadCount() const;
+
+  // Run task(index) for every index in [0, count) and wait for all of them
+  void ParallelFor(size_t count, const function<void(size_t)> &task);
+
+private:
+  struct Queue
+  {
+    mutex lock;
+    deque<size_t> tasks;
+  };
+
+  bool Pop(size_t worker, size_t &index);
+  bool Steal(size_t worker, size_t &index);
+  void RunTasks(size_t worker, const function<void(size_t)> &batchTask);
+  void Work(size_t worker);
+
+  vector<unique_ptr<Queue>> queues;
+  vector<thread> workers;
+
+  mutex batchLock;
+  condition_variable batchReady;
+  condition_variable batchDone;
+  const function<void(size_t)> *task;
+  uint64_t generation;
+  size_t activeWorkers;
+  atomic<size_t> remaining;
+  bool stopping;
+
+};
+
+WorkStealingPool::WorkStealingPool(size_t threadCount) :
+  task(nullptr), generation(0), activeWorkers(0), remaining(0), stopping(false)
+{
+  if (threadCount == 0) {
+    threadCount = 1;
+  }
+  for (size_t i = 0; i < threadCount; ++i) {
+    queues.emplace_back(new Queue());
+  }
+  for (size_t i = 1; i < threadCount; ++i) {
+    workers.emplace_back(&WorkStealingPool::Work, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+  {
+    lock_guard<mutex> guard(batchLock);
+    stopping = true;
+  }
+  batchReady.notify_all();
+  for (thread &worker : workers) {
+    worker.join();
+  }
+}
+
+inline size_t WorkStealingPool::GetThreadCount() const
+{
+  return queues.size();
+}
+
+inline bool WorkStealingPool::Pop(size_t worker, size_t &index)
+{
+  Queue &queue = *queues[worker];
+  lock_guard<mutex> guard(queue.lock);
+  if (queue.tasks.empty()) {
+    return false;
+  }
+  index = queue.tasks.back();
+  queue.tasks.pop_back();
+  return true;
+}
+
+bool WorkStealingPool::Steal(size_t worker, size_t &index)
+{
+  size_t count = queues.size();
+  for (size_t offset = 1; offset < count; ++offset) {
+    Queue &victim = *queues[(worker + offset) % count];
+    lock_guard<mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      index = victim.tasks.front();
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::RunTasks(size_t worker, const function<void(size_t)> &batchTask)
+{
+  size_t index;
+  while (Pop(worker, index) || Steal(worker, index)) {
+    batchTask(index);
+    remaining.fetch_sub(1, memory_order_acq_rel);
+  }
+}
+
+void WorkStealingPool::Work(size_t worker)
+{
+  uint64_t seen = 0;
+  while (true) {
+    const function<void(size_t)> *batchTask;
+    {
+      unique_lock<mutex> guard(batchLock);
+      batchReady.wait(guard, [&] { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+      batchTask = task;
+      if (!batchTask) {
+        continue; // woke after the batch had already finished
+      }
+      ++activeWorkers;
+    }
+    RunTasks(worker, *batchTask);
+    {
+      lock_guard<mutex> guard(batchLock);
+      --activeWorkers;
+    }
+    batchDone.notify_all();
+  }
+}
+
+void WorkStealingPool::ParallelFor(size_t count, const function<void(size_t)> &_task)
+{
+  if (count == 0) {
+    return;
+  }
+  // Workers only start on the queues once the task is published below
+  size_t queueCount = queues.size();
+  for (size_t i = 0; i < count; ++i) {
+    Queue &queue = *queues[i % queueCount];
+    lock_guard<mutex> guard(queue.lock);
+    queue.tasks.push_back(i);
+  }
+
+  {
+    lock_guard<mutex> guard(batchLock);
+    task = &_task;
+    remaining.store(count, memory_order_release);
+    ++generation;
+  }
+  batchReady.notify_all();
+
+  RunTasks(0, _task);
+
+  // Wait for the last tasks and for every worker to let go of the task
+  unique_lock<mutex> guard(batchLock);
+  batchDone.wait(guard, [&] { return remaining.load(memory_order_acquire) == 0 && activeWorkers == 0; });
+  task = nullptr;
+}
+
+#endif